@@ -0,0 +1,118 @@
+/*
+ * bench.c: timing, percentiles and output for the host-side benchmarks
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "bench.h"
+
+static uint32_t rand_state = 1;
+
+uint64_t bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void bench_start(struct bench *b, const char *name, unsigned long maxsamples)
+{
+	b->name = name;
+	b->nsamples = 0;
+	b->maxsamples = maxsamples;
+	b->total = 0;
+	b->nmetrics = 0;
+	b->samples = maxsamples ? malloc(maxsamples * sizeof(uint64_t)) : NULL;
+	if (maxsamples && !b->samples) {
+		fprintf(stderr, "bench: out of memory for %lu samples\n",
+		        maxsamples);
+		exit(1);
+	}
+}
+
+void bench_metric(struct bench *b, const char *key, double value)
+{
+	if (b->nmetrics == BENCH_MAX_METRICS) {
+		fprintf(stderr, "bench: too many metrics for %s\n", b->name);
+		return;
+	}
+	b->metrics[b->nmetrics].key = key;
+	b->metrics[b->nmetrics].value = value;
+	b->nmetrics++;
+}
+
+static int compare_samples(const void *l, const void *r)
+{
+	uint64_t a = *(const uint64_t *)l, b = *(const uint64_t *)r;
+	return (a > b) - (a < b);
+}
+
+static uint64_t percentile(struct bench *b, unsigned int pct)
+{
+	unsigned long idx;
+
+	if (!b->nsamples)
+		return 0;
+	idx = (b->nsamples * pct) / 100;
+	if (idx >= b->nsamples)
+		idx = b->nsamples - 1;
+	return b->samples[idx];
+}
+
+static void print_metrics(struct bench *b)
+{
+	unsigned int i;
+	for (i = 0; i < b->nmetrics; i++)
+		printf(", \"%s\": %.6g", b->metrics[i].key,
+		       b->metrics[i].value);
+	printf("}\n");
+}
+
+void bench_finish(struct bench *b)
+{
+	qsort(b->samples, b->nsamples, sizeof(uint64_t), compare_samples);
+	printf("{\"bench\": \"%s\", \"ops\": %lu, \"ns_per_op\": %.1f, "
+	       "\"p50_ns\": %llu, \"p99_ns\": %llu, \"max_ns\": %llu",
+	       b->name, b->nsamples,
+	       b->nsamples ? (double)b->total / b->nsamples : 0.0,
+	       (unsigned long long)percentile(b, 50),
+	       (unsigned long long)percentile(b, 99),
+	       (unsigned long long)(b->nsamples ? b->samples[b->nsamples - 1]
+	                                        : 0));
+	print_metrics(b);
+	free(b->samples);
+	b->samples = NULL;
+}
+
+void bench_report_metrics(struct bench *b)
+{
+	printf("{\"bench\": \"%s\"", b->name);
+	print_metrics(b);
+}
+
+unsigned long bench_scale(int argc, char **argv)
+{
+	long scale = 1;
+	if (argc > 1)
+		scale = strtol(argv[1], NULL, 10);
+	if (scale < 1) {
+		fprintf(stderr, "usage: %s [SCALE]\n", argv[0]);
+		exit(1);
+	}
+	return scale;
+}
+
+/* xorshift32 */
+uint32_t bench_rand(void)
+{
+	rand_state ^= rand_state << 13;
+	rand_state ^= rand_state >> 17;
+	rand_state ^= rand_state << 5;
+	return rand_state;
+}
+
+void bench_srand(uint32_t seed)
+{
+	rand_state = seed ? seed : 1;
+}
@@ -0,0 +1,88 @@
+/**
+ * bench.h: a tiny harness for host-side benchmarks of the lib/ code
+ *
+ * Each benchmark times individual operations, and then prints one JSON object
+ * per line, so that runs can be saved and compared against a baseline:
+ *
+ *   {"bench": "slab.packet_storm.alloc", "ops": 1000, "ns_per_op": 31.2, ...}
+ *
+ * Usage:
+ *
+ *   struct bench b;
+ *   bench_start(&b, "thing", count);
+ *   for (...) {
+ *       t = bench_now();
+ *       do_thing();
+ *       bench_record(&b, bench_now() - t);
+ *   }
+ *   bench_metric(&b, "something_interesting", value);
+ *   bench_finish(&b);
+ */
+#pragma once
+
+#include <stdint.h>
+
+#define BENCH_MAX_METRICS 8
+
+struct bench {
+	const char *name;
+	uint64_t *samples;
+	unsigned long nsamples;
+	unsigned long maxsamples;
+	uint64_t total;
+	struct {
+		const char *key;
+		double value;
+	} metrics[BENCH_MAX_METRICS];
+	unsigned int nmetrics;
+};
+
+/**
+ * Return a monotonic timestamp in nanoseconds.
+ */
+uint64_t bench_now(void);
+
+/**
+ * Prepare to record up to maxsamples operations.
+ */
+void bench_start(struct bench *b, const char *name, unsigned long maxsamples);
+
+/**
+ * Record the duration of a single operation. Samples beyond maxsamples are
+ * dropped.
+ */
+static inline void bench_record(struct bench *b, uint64_t ns)
+{
+	if (b->nsamples < b->maxsamples) {
+		b->samples[b->nsamples++] = ns;
+		b->total += ns;
+	}
+}
+
+/**
+ * Attach an extra named value (e.g. a fragmentation measurement) to the output.
+ */
+void bench_metric(struct bench *b, const char *key, double value);
+
+/**
+ * Print the results and release the samples.
+ */
+void bench_finish(struct bench *b);
+
+/**
+ * Print a standalone set of metrics, without any timing.
+ */
+void bench_report_metrics(struct bench *b);
+
+/**
+ * Parse the common command line. Currently, an optional scale factor for the
+ * number of operations: "./alloc.bench 10" runs ten times as many.
+ */
+unsigned long bench_scale(int argc, char **argv);
+
+/**
+ * A small, fast, deterministic pseudo random number generator, so that every
+ * run does exactly the same work.
+ */
+uint32_t bench_rand(void);
+void bench_srand(uint32_t seed);
@@ -0,0 +1,182 @@
+/*
+ * bench_alloc.c: benchmark the page allocator (lib/alloc.c)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "alloc_private.h"
+#include "bench.h"
+
+#define START 0x40000000
+#define END   (START + 0x10000000) /* 256MB */
+#define NPAGES ((END - START) / PAGE_SIZE)
+
+#define SLOTS 1024
+
+struct slot {
+	uint32_t addr;
+	uint32_t size;
+};
+
+static void *meta_getter(void)
+{
+	return aligned_alloc(PAGE_SIZE, PAGE_SIZE);
+}
+
+static void *new_allocator(void)
+{
+	void *allocator = meta_getter();
+	init_page_allocator(allocator, START, END);
+	page_allocator_set_getter(allocator, meta_getter);
+	return allocator;
+}
+
+/**
+ * Pick an allocation size in bytes. Most allocations are a page or a few, with
+ * a long tail of larger ones (stacks, DMA buffers, process images).
+ */
+static uint32_t random_size(void)
+{
+	uint32_t r = bench_rand() % 100;
+	if (r < 50)
+		return PAGE_SIZE;
+	else if (r < 75)
+		return (2 + bench_rand() % 3) * PAGE_SIZE;
+	else if (r < 90)
+		return (5 + bench_rand() % 12) * PAGE_SIZE;
+	else
+		return (17 + bench_rand() % 240) * PAGE_SIZE;
+}
+
+/**
+ * Measure fragmentation of the free memory by walking the free lists.
+ */
+static void fragmentation(struct bench *b, void *allocator)
+{
+	struct buddyhdr *hdr = allocator;
+	struct bnode *node;
+	uint32_t free = 0, blocks = 0, largest = 0;
+	int i;
+
+	for (i = 0; i <= MAX_ORDER; i++) {
+		for (node = hdr->free_lists[i]; node; node = node->list.next) {
+			free += 1U << i;
+			blocks++;
+			if ((1U << i) > largest)
+				largest = 1U << i;
+		}
+	}
+	bench_metric(b, "free_pages", free);
+	bench_metric(b, "free_blocks", blocks);
+	bench_metric(b, "largest_free_pages", largest);
+	bench_metric(b, "fragmentation", free ? 1.0 - (double)largest / free : 0);
+	bench_metric(b, "meta_pages", hdr->meta_pages);
+}
+
+/**
+ * Random-size alloc/free churn: each step picks a slot, and frees it if it is
+ * occupied, or fills it otherwise.
+ */
+static void bench_churn(unsigned long ops)
+{
+	static struct slot slots[SLOTS];
+	struct bench alloc, free;
+	void *allocator = new_allocator();
+	unsigned long i, failed = 0;
+	uint64_t t;
+	uint32_t s;
+
+	bench_srand(42);
+	bench_start(&alloc, "alloc.churn.alloc", ops);
+	bench_start(&free, "alloc.churn.free", ops);
+	for (i = 0; i < ops; i++) {
+		s = bench_rand() % SLOTS;
+		if (slots[s].addr) {
+			t = bench_now();
+			free_pages(allocator, slots[s].addr, slots[s].size);
+			bench_record(&free, bench_now() - t);
+			slots[s].addr = 0;
+		} else {
+			slots[s].size = random_size();
+			t = bench_now();
+			slots[s].addr = alloc_pages(allocator, slots[s].size, 0);
+			bench_record(&alloc, bench_now() - t);
+			if (!slots[s].addr)
+				failed++;
+		}
+	}
+	bench_metric(&alloc, "failed", failed);
+	fragmentation(&alloc, allocator);
+	bench_finish(&alloc);
+	bench_finish(&free);
+
+	for (s = 0; s < SLOTS; s++)
+		if (slots[s].addr)
+			free_pages(allocator, slots[s].addr, slots[s].size);
+}
+
+/**
+ * Fill memory to a target occupancy, then churn around it, replacing each freed
+ * allocation with a new one of a different size. Report how fragmented the free
+ * memory ends up, and how many allocations failed even though enough memory was
+ * free in total.
+ */
+static void bench_frag_sweep(unsigned long ops)
+{
+	static const char *names[] = {
+		"alloc.frag_sweep.25", "alloc.frag_sweep.50",
+		"alloc.frag_sweep.75", "alloc.frag_sweep.90",
+	};
+	static const uint32_t pcts[] = { 25, 50, 75, 90 };
+	static struct slot slots[NPAGES];
+	struct bench b;
+	void *allocator;
+	unsigned long i, nslots, failed;
+	uint32_t used, target, s, p;
+	uint64_t t;
+
+	for (p = 0; p < sizeof(pcts) / sizeof(pcts[0]); p++) {
+		allocator = new_allocator();
+		bench_srand(1000 + p);
+		target = NPAGES * pcts[p] / 100;
+		used = 0;
+		nslots = 0;
+		while (used < target) {
+			slots[nslots].size = random_size();
+			slots[nslots].addr =
+			        alloc_pages(allocator, slots[nslots].size, 0);
+			if (!slots[nslots].addr)
+				break;
+			used += slots[nslots].size / PAGE_SIZE;
+			nslots++;
+		}
+
+		bench_start(&b, names[p], ops);
+		failed = 0;
+		for (i = 0; i < ops && nslots; i++) {
+			s = bench_rand() % nslots;
+			if (slots[s].addr)
+				free_pages(allocator, slots[s].addr,
+				           slots[s].size);
+			slots[s].size = random_size();
+			t = bench_now();
+			slots[s].addr = alloc_pages(allocator, slots[s].size, 0);
+			bench_record(&b, bench_now() - t);
+			if (!slots[s].addr)
+				failed++;
+		}
+		bench_metric(&b, "target_pct", pcts[p]);
+		bench_metric(&b, "failed", failed);
+		fragmentation(&b, allocator);
+		bench_finish(&b);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long scale = bench_scale(argc, argv);
+
+	bench_churn(200000 * scale);
+	bench_frag_sweep(50000 * scale);
+	return 0;
+}
@@ -0,0 +1,232 @@
+/*
+ * bench_slab.c: benchmark the slab allocator (lib/slab.c)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "slab_private.h"
+
+#define PAGE_SIZE 4096
+
+#define BURST 64
+#define SLOTS 4096
+
+#define KMALLOC_CLASSES 8
+
+static void *getter(unsigned int order)
+{
+	return aligned_alloc(PAGE_SIZE << order, PAGE_SIZE << order);
+}
+
+static void release(void *ptr, unsigned int order)
+{
+	free(ptr);
+}
+
+/**
+ * Report how well the slab packs its objects: the most objects in use at once,
+ * over the most slab pages it took to hold them.
+ */
+static void efficiency(struct bench *b, struct slab *slab, unsigned long objs,
+                       unsigned long pages)
+{
+	unsigned long bytes = pages * (PAGE_SIZE << slab->order);
+	bench_metric(b, "order", slab->order);
+	bench_metric(b, "peak_slab_pages", pages);
+	bench_metric(b, "efficiency",
+	             bytes ? (double)objs * slab->size / bytes : 0);
+}
+
+/**
+ * Packet-like storms: bursts of fixed-size 2048 byte allocations (like a burst
+ * of received frames), which are then all freed. Bursts grow over time, so the
+ * slab has to keep growing and shrinking.
+ */
+static void bench_packet_storm(const char *alloc_name, const char *free_name,
+                               int order, unsigned long bursts)
+{
+	struct slab *slab = slab_new("packet", 2048, order, getter, release);
+	struct bench alloc, free;
+	void *objs[BURST];
+	unsigned long i, n, j, peak = 0, pages = 0;
+	uint64_t t;
+
+	bench_srand(7);
+	bench_start(&alloc, alloc_name, bursts * BURST);
+	bench_start(&free, free_name, bursts * BURST);
+	for (i = 0; i < bursts; i++) {
+		n = 1 + bench_rand() % BURST;
+		for (j = 0; j < n; j++) {
+			t = bench_now();
+			objs[j] = slab_alloc(slab);
+			bench_record(&alloc, bench_now() - t);
+		}
+		if (slab->total - slab->free > peak)
+			peak = slab->total - slab->free;
+		if (slab->pages > pages)
+			pages = slab->pages;
+		for (j = 0; j < n; j++) {
+			t = bench_now();
+			slab_free(slab, objs[j]);
+			bench_record(&free, bench_now() - t);
+		}
+	}
+	efficiency(&alloc, slab, peak, pages);
+	bench_finish(&alloc);
+	bench_finish(&free);
+}
+
+/**
+ * The same storm, using the bulk API. Each sample is one call, divided by the
+ * number of objects, so that ns_per_op stays comparable with the above.
+ */
+static void bench_packet_storm_bulk(unsigned long bursts)
+{
+	struct slab *slab = slab_new("packet_bulk", 2048, SLAB_ORDER_AUTO,
+	                             getter, release);
+	struct bench alloc, free;
+	void *objs[BURST];
+	unsigned long i, n;
+	uint64_t t;
+
+	bench_srand(7);
+	bench_start(&alloc, "slab.packet_storm_bulk.alloc", bursts);
+	bench_start(&free, "slab.packet_storm_bulk.free", bursts);
+	for (i = 0; i < bursts; i++) {
+		n = 1 + bench_rand() % BURST;
+		t = bench_now();
+		slab_alloc_bulk(slab, objs, n);
+		bench_record(&alloc, (bench_now() - t) / n);
+		t = bench_now();
+		slab_free_bulk(slab, objs, n);
+		bench_record(&free, (bench_now() - t) / n);
+	}
+	bench_finish(&alloc);
+	bench_finish(&free);
+}
+
+/*
+ * Just enough of the kernel's struct packet for its constructor to touch.
+ */
+struct packet_meta {
+	void *ll, *nl, *tl, *al, *end;
+	void *next, *prev;
+	unsigned int capacity;
+};
+
+static void packet_ctor(void *obj)
+{
+	struct packet_meta *pkt = obj;
+	pkt->ll = pkt->nl = pkt->tl = pkt->al = pkt->end = NULL;
+	pkt->next = pkt->prev = NULL;
+	pkt->capacity = 2048 - sizeof(*pkt);
+}
+
+/**
+ * Refilling the RX ring: one packet allocated per packet received. Compare
+ * zeroing the whole packet after slab_alloc(), as packet_alloc() used to,
+ * against the packet slab's constructor, which resets only the metadata.
+ */
+static void bench_packet_refill(unsigned long ops)
+{
+	struct slab *zeroed = slab_new("packet_zeroed", 2048, SLAB_ORDER_AUTO,
+	                               getter, release);
+	struct slab *ctor = slab_new_ctor("packet_ctor", 2048, SLAB_ORDER_AUTO,
+	                                  getter, release, packet_ctor, NULL);
+	struct bench memset_bench, ctor_bench;
+	struct packet_meta *pkt;
+	unsigned long i;
+	uint64_t t;
+
+	bench_start(&memset_bench, "slab.packet_refill.memset", ops);
+	bench_start(&ctor_bench, "slab.packet_refill.ctor", ops);
+	for (i = 0; i < ops; i++) {
+		t = bench_now();
+		pkt = slab_alloc(zeroed);
+		memset(pkt, 0, 2048);
+		pkt->capacity = 2048 - sizeof(*pkt);
+		bench_record(&memset_bench, bench_now() - t);
+		slab_free(zeroed, pkt);
+
+		t = bench_now();
+		pkt = slab_alloc(ctor);
+		bench_record(&ctor_bench, bench_now() - t);
+		slab_free(ctor, pkt);
+	}
+	bench_finish(&memset_bench);
+	bench_finish(&ctor_bench);
+}
+
+/**
+ * A kmalloc-like mix: power of two slabs from 16 to 2048 bytes, with random
+ * sizes (mostly small) allocated and freed in random order. The kernel also has
+ * an 8 byte slab, but that's smaller than a list_head on a 64-bit host.
+ */
+static void bench_kmalloc_mix(unsigned long ops)
+{
+	static struct {
+		void *ptr;
+		unsigned int cls;
+	} slots[SLOTS];
+	struct slab *slabs[KMALLOC_CLASSES];
+	struct bench alloc, free;
+	unsigned long i, live = 0, peak = 0, bytes = 0;
+	unsigned int s, cls;
+	uint64_t t;
+
+	for (cls = 0; cls < KMALLOC_CLASSES; cls++)
+		slabs[cls] = slab_new("kmalloc", 16 << cls, SLAB_ORDER_AUTO,
+		                      getter, release);
+
+	bench_srand(99);
+	bench_start(&alloc, "slab.kmalloc_mix.alloc", ops);
+	bench_start(&free, "slab.kmalloc_mix.free", ops);
+	for (i = 0; i < ops; i++) {
+		s = bench_rand() % SLOTS;
+		if (slots[s].ptr) {
+			cls = slots[s].cls;
+			t = bench_now();
+			slab_free(slabs[cls], slots[s].ptr);
+			bench_record(&free, bench_now() - t);
+			slots[s].ptr = NULL;
+			live -= 16 << cls;
+		} else {
+			/* skew towards small sizes */
+			cls = bench_rand() % KMALLOC_CLASSES;
+			cls = cls * (bench_rand() % KMALLOC_CLASSES) /
+			      (KMALLOC_CLASSES - 1);
+			t = bench_now();
+			slots[s].ptr = slab_alloc(slabs[cls]);
+			bench_record(&alloc, bench_now() - t);
+			slots[s].cls = cls;
+			live += 16 << cls;
+			if (live > peak)
+				peak = live;
+		}
+	}
+	for (cls = 0; cls < KMALLOC_CLASSES; cls++)
+		bytes += (unsigned long)slabs[cls]->pages *
+		         (PAGE_SIZE << slabs[cls]->order);
+	bench_metric(&alloc, "live_bytes", live);
+	bench_metric(&alloc, "peak_bytes", peak);
+	bench_metric(&alloc, "slab_bytes", bytes);
+	bench_metric(&alloc, "efficiency", bytes ? (double)live / bytes : 0);
+	bench_finish(&alloc);
+	bench_finish(&free);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long scale = bench_scale(argc, argv);
+
+	bench_packet_storm("slab.packet_storm.alloc", "slab.packet_storm.free",
+	                   SLAB_ORDER_AUTO, 20000 * scale);
+	bench_packet_storm("slab.packet_storm_order0.alloc",
+	                   "slab.packet_storm_order0.free", 0, 20000 * scale);
+	bench_packet_storm_bulk(20000 * scale);
+	bench_packet_refill(200000 * scale);
+	bench_kmalloc_mix(500000 * scale);
+	return 0;
+}
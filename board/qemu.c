@@ -1,4 +1,5 @@
 #include "config.h"
+#include "kernel.h"
 
 #if CONFIG_BOARD == BOARD_QEMU
 
@@ -8,6 +9,7 @@ void board_premmu(void)
 
 void board_init(void)
 {
+	cache_enable();
 }
 
 #endif
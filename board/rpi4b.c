@@ -23,15 +23,7 @@ void board_premmu(void)
 
 void board_init(void)
 {
-	uint32_t reg;
-
-	/*
-	 * Enable caches
-	 */
-	get_cpreg(reg, c1, 0, c0, 0);
-	reg |= (1 << 2);  // cache
-	reg |= (1 << 12); // icache
-	set_cpreg(reg, c1, 0, c0, 0);
+	cache_enable();
 
 	/*
 	 * Invalidate TLB - this is just superstition on my part after enabling
@@ -1,2 +1,3 @@
 #define CONFIG_BOARD     BOARD_RPI4B
 #define CONFIG_UART_BASE 0xFE201000
+#define CONFIG_RAM_SIZE  0x20000000
@@ -20,4 +20,10 @@ enum {
 	EIO,
 	ENODEV,
 	ENOTDIR,
+	ENOMEM,
+	EFAULT,
+	ESRCH,
+	ETIMEDOUT,
+	EAGAIN,
+	ENOPROTOOPT,
 };
@@ -19,6 +19,10 @@ enum {
 
 #define IPPROTO_UDP 17
 
+#define SOL_SOCKET 1
+
+#define SO_RCVTIMEO 20 /* struct timeval, zero means forever */
+
 struct in_addr {
 	uint32_t s_addr;
 };
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdint.h>
+
+struct timeval {
+	uint32_t tv_sec;
+	uint32_t tv_usec;
+};
+
+struct timespec {
+	uint32_t tv_sec;
+	uint32_t tv_nsec;
+};
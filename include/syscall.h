@@ -6,6 +6,7 @@
 #include <stddef.h>
 
 #include "sys/socket.h"
+#include "sys/time.h"
 
 /* macro quoting utilities */
 #define syscall_h_quote(blah)            #blah
@@ -44,7 +45,10 @@
 #define SYS_CONNECT    8
 #define SYS_SEND       9
 #define SYS_RECV       10
-#define MAX_SYS        10
+#define SYS_SETPRIO    11
+#define SYS_NANOSLEEP  12
+#define SYS_SETSOCKOPT 13
+#define MAX_SYS        13
 
 /*
  * System call syntax sugars
@@ -63,6 +67,10 @@ int bind(int sockfd, const struct sockaddr *address, socklen_t address_len);
 int connect(int sockfd, const struct sockaddr *address, socklen_t address_len);
 int send(int sockfd, const void *buffer, size_t length, int flags);
 int recv(int sockfd, void *buffer, size_t length, int flags);
+int setprio(int pid, int prio);
+int nanosleep(const struct timespec *req, struct timespec *rem);
+int setsockopt(int sockfd, int level, int option_name, const void *option_value,
+               socklen_t option_len);
 
 /*
  * Declare a puts() which wraps the display() system call, necessary for printf
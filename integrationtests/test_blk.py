@@ -55,3 +55,17 @@ def test_readp(blkvm, devname):
 def test_read_out_of_bounds(blkvm, devname):
     res = blkvm.cmd(f'blk read {devname} 2')
     assert 'ERROR' in res
+
+
+def test_write_read_stress(blkvm, devname):
+    """
+    Alternate writes and reads, so that every request buffer goes through the
+    cache maintenance on both sides of the device.
+    """
+    for i in range(64):
+        sector = i % 2
+        data = f'stress_{i}_sector_{sector}'
+        res = blkvm.cmd(f'blk write {devname} {sector} {data}')
+        assert 'written!' in res
+        res = blkvm.cmd(f'blk read {devname} {sector}')
+        assert f'result: "{data}"' in res
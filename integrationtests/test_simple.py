@@ -2,6 +2,7 @@
 """
 Basic tests of functionality for SOS
 """
+import re
 import time
 
 
@@ -36,3 +37,45 @@ def test_demo(vm):
         vm.read_until(r'Process \d+ exited with code 0.')
         count -= 1
     assert count == 0, 'Expect all processes to exit successfully'
+
+
+def test_priority(vm):
+    """
+    Set priorities from the user shell and the kernel shell, and check that
+    processes still get to run.
+    """
+    output = vm.cmd('prio 0 1')
+    assert 'failed' not in output
+    output = vm.cmd('prio 0 9')
+    assert 'failed: rv=' in output
+    vm.cmd('exit', pattern=r'ksh>')
+    output = vm.cmd('proc ls', pattern=r'ksh>')
+    pid = int(re.search(r'^(\d+) \(priority', output, re.M).group(1))
+    output = vm.cmd(f'proc prio {pid} 2', pattern=r'ksh>')
+    assert 'not found' not in output
+    output = vm.cmd('proc ls', pattern=r'ksh>')
+    assert f'{pid} (priority 2/2' in output
+    output = vm.cmd('proc prio 9999 0', pattern=r'ksh>')
+    assert 'pid 9999 not found' in output
+
+
+def test_sleep(vm):
+    start = time.time()
+    output = vm.cmd('sleep 500')
+    assert time.time() - start >= 0.5
+    assert 'failed' not in output
+
+
+def test_tickless(vm):
+    """
+    With nothing competing for the CPU, the scheduler tick should stop.
+    """
+    vm.cmd('exit', pattern=r'ksh>')
+    pattern = r'(\d+) interrupts, (\d+) ticks'
+    before = re.search(pattern, vm.cmd('timer status', pattern=r'ksh>'))
+    time.sleep(1)
+    output = vm.cmd('timer status', pattern=r'ksh>')
+    after = re.search(pattern, output)
+    assert 'tick stopped' in output
+    # a periodic tick would have fired about 100 times by now
+    assert int(after.group(2)) - int(before.group(2)) < 10
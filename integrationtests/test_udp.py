@@ -74,3 +74,45 @@ def test_udp_send_recv_wait(net_vm, sk):
     sk.sendto(b'Hello from the test harness!\0', addr)
     res = net_vm.read_until('[uk]sh>')
     assert 'Hello from the test harness!' in res
+
+
+def test_udp_stress(net_vm, sk):
+    """
+    Many round trips, cycling through the RX and TX rings several times.
+    """
+    res = net_vm.cmd('socket')
+    fildes = int(SOCKET_RE.search(res).group(1))
+
+    net_vm.cmd(f'connect {fildes} 10.0.2.2 {sk.getsockname()[1]}')
+    for i in range(100):
+        net_vm.cmd(f'send {fildes} PING_{i}')
+        data, addr = recvfrom_timeout(sk)
+        assert data == f'PING_{i}\0'.encode('ascii')
+
+        sk.sendto(f'PONG_{i}\0'.encode('ascii'), addr)
+        time.sleep(0.05)
+        res = net_vm.cmd(f'recv {fildes}')
+        assert f'PONG_{i}' in res
+
+
+def test_udp_recv_timeout(net_vm, sk):
+    res = net_vm.cmd('socket')
+    fildes = int(SOCKET_RE.search(res).group(1))
+
+    net_vm.cmd(f'connect {fildes} 10.0.2.2 {sk.getsockname()[1]}')
+    net_vm.cmd(f'send {fildes} ABAB_CDCD_EFEF')
+    data, addr = recvfrom_timeout(sk)
+
+    res = net_vm.cmd(f'timeout {fildes} 500')
+    assert 'setsockopt() = 0' in res
+    start = time.time()
+    res = net_vm.cmd(f'recv {fildes}')
+    assert time.time() - start >= 0.5
+    assert 'recv() = -' in res
+
+    # a packet which arrives in time is still received
+    net_vm.send_cmd(f'recv {fildes}')
+    time.sleep(0.1)
+    sk.sendto(b'Hello from the test harness!\0', addr)
+    res = net_vm.read_until('[uk]sh>')
+    assert 'Hello from the test harness!' in res
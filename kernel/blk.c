@@ -62,12 +62,18 @@ enum blkreq_status blkreq_wait_all(struct blkreq *req)
 
 void blkreq_free_all(struct blkdev *dev, struct blkreq *req)
 {
-	struct blkreq *iter, *next;
+	struct blkreq *iter, *next, *reqs[BLKREQ_BATCH];
+	unsigned int n = 0;
 	list_for_each_entry_safe(iter, next, &req->reqlist, reqlist)
 	{
-		dev->ops->free(dev, iter);
+		reqs[n++] = iter;
+		if (n == BLKREQ_BATCH) {
+			dev->ops->free_bulk(dev, reqs, n);
+			n = 0;
+		}
 	}
-	dev->ops->free(dev, req);
+	reqs[n++] = req;
+	dev->ops->free_bulk(dev, reqs, n);
 }
 
 int blk_cmd_status(int argc, char **argv)
@@ -119,7 +125,7 @@ int blk_cmd_read(int argc, char **argv)
 	}
 	printf("result: \"%s\"\n", req->buf);
 cleanup:
-	kfree(req->buf, req->size);
+	kfree(req->buf);
 	dev->ops->free(dev, req);
 	return rv;
 }
@@ -156,7 +162,7 @@ int blk_cmd_write(int argc, char **argv)
 	puts("written!\n");
 
 cleanup:
-	kfree(req->buf, req->size);
+	kfree(req->buf);
 	dev->ops->free(dev, req);
 	return rv;
 }
@@ -49,6 +49,19 @@ struct blkdev_ops {
 	 * WITHIN IT.
 	 */
 	void (*free)(struct blkdev *dev, struct blkreq *req);
+	/**
+	 * Like alloc(), but create up to n requests at once and store them in
+	 * reqs. Return the number created, which is less than n only when out
+	 * of memory.
+	 */
+	unsigned int (*alloc_bulk)(struct blkdev *dev, struct blkreq **reqs,
+	                           unsigned int n);
+	/**
+	 * Like free(), but free n requests at once. The contents of the reqs
+	 * array are undefined afterward.
+	 */
+	void (*free_bulk)(struct blkdev *dev, struct blkreq **reqs,
+	                  unsigned int n);
 	/**
 	 * Submit a block request to the device.
 	 *
@@ -76,6 +89,9 @@ struct blkdev {
 	char name[16];
 };
 
+/* Requests are allocated and freed in batches of up to this many */
+#define BLKREQ_BATCH 16
+
 /**
  * Initialize the block subsystem.
  */
@@ -38,11 +38,42 @@ void print_fault(uint32_t fsr, uint32_t far, struct ctx *ctx)
 	puts("END OF FAULT REPORT\n");
 }
 
+/**
+ * Try to resolve a fault by paging in user memory, or by copying a
+ * copy-on-write page. Only translation and permission faults in the user
+ * address space of a user process qualify.
+ */
+static bool user_fault(uint32_t fsr, uint32_t far, bool write)
+{
+	if (!current || current->flags.pr_kernel || far < 0x40000000)
+		return false;
+
+	switch (fsr & 0x40F) {
+	case 0x5:
+	case 0x7:
+	case 0xD:
+	case 0xF:
+		return umem_fault(current, far, write) == 0;
+	default:
+		return false;
+	}
+}
+
+/*
+ * When these handlers return, entry.s returns to ctx->ret. The abort left
+ * that pointing 8 (data) or 4 (prefetch) bytes past the faulting instruction,
+ * so we back it up to retry the instruction.
+ */
 void data_abort(struct ctx *ctx)
 {
 	uint32_t dfsr, dfar;
 	get_cpreg(dfsr, c5, 0, c0, 0);
 	get_cpreg(dfar, c6, 0, c0, 0);
+	/* DFSR.WnR tells us whether it was a write */
+	if (user_fault(dfsr, dfar, dfsr & (1 << 11))) {
+		ctx->ret -= 8;
+		return;
+	}
 	printf("Uh-oh... data abort! DFSR=%x DFAR=%x LR=%x\n", dfsr, dfar,
 	       ctx->ret);
 	print_fault(dfsr, dfar, ctx);
@@ -55,6 +86,10 @@ void prefetch_abort(struct ctx *ctx)
 	uint32_t fsr, far;
 	get_cpreg(fsr, c5, 0, c0, 1);
 	get_cpreg(far, c6, 0, c0, 2);
+	if (user_fault(fsr, far, false)) {
+		ctx->ret -= 4;
+		return;
+	}
 	printf("Uh-oh... prefetch abort! FSR=%x IFAR=%x LR=%x\n", fsr, far,
 	       ctx->ret);
 	print_fault(fsr, far, ctx);
@@ -33,3 +33,26 @@
 #if !defined(CONFIG_UART_BASE)
 #error "CONFIG_UART_BASE is required"
 #endif
+
+/*
+ * CONFIG_RAM_SIZE
+ * OPTIONAL: bytes of RAM, starting from the 1MB boundary at or below the
+ * kernel image. The kernel maps up to 512MB of it (see LINEAR_MAX). Defaults
+ * to QEMU's 128MB.
+ */
+#if !defined(CONFIG_RAM_SIZE)
+#define CONFIG_RAM_SIZE 0x08000000
+#endif
+
+/*
+ * CONFIG_VIRTIO_BLK_QUEUE, CONFIG_VIRTIO_NET_QUEUE
+ * OPTIONAL: descriptors to request for the virtio-blk queue, and for each of
+ * the virtio-net RX and TX queues. Rounded down to a power of two, and to what
+ * the device supports (QueueNumMax). Default to 256.
+ */
+#if !defined(CONFIG_VIRTIO_BLK_QUEUE)
+#define CONFIG_VIRTIO_BLK_QUEUE 256
+#endif
+#if !defined(CONFIG_VIRTIO_NET_QUEUE)
+#define CONFIG_VIRTIO_NET_QUEUE 256
+#endif
@@ -0,0 +1,2 @@
+#define CONFIG_BOARD     BOARD_QEMU
+#define CONFIG_UART_BASE 0x09000000
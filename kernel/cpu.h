@@ -84,6 +84,7 @@ struct ctx {
 	__asm__ __volatile__("mrs %[rd], cpsr" : [ rd ] "=r"(dst) : :)
 
 #define mb()                __asm__ __volatile__("dsb")
+#define isb()               __asm__ __volatile__("isb")
 #define interrupt_disable() __asm__ __volatile__("cpsid i")
 #define interrupt_enable()  __asm__ __volatile__("cpsie i")
 
@@ -116,3 +117,162 @@ static inline void tlbiall(void)
 	uint32_t reg = 0;
 	set_cpreg(reg, c8, 0, c7, 0);
 }
+
+/* invalidate one page, given its MVA with the ASID in the low bits */
+static inline void tlbimva(uint32_t mva_asid)
+{
+	set_cpreg(mva_asid, c8, 0, c7, 1);
+}
+
+/* invalidate every non-global entry for an ASID */
+static inline void tlbiasid(uint32_t asid)
+{
+	set_cpreg(asid, c8, 0, c7, 2);
+}
+
+/* invalidate one page, given its MVA, for all ASIDs */
+static inline void tlbimvaa(uint32_t mva)
+{
+	set_cpreg(mva, c8, 0, c7, 3);
+}
+
+/**
+ * Enable the PMU cycle counter (PMCCNTR), for measuring things.
+ */
+static inline void cycle_counter_init(void)
+{
+	uint32_t reg;
+	get_cpreg(reg, c9, 0, c12, 0); /* PMCR */
+	reg |= 1;                      /* E: enable counters */
+	set_cpreg(reg, c9, 0, c12, 0);
+	reg = 1U << 31; /* C: cycle counter */
+	set_cpreg(reg, c9, 0, c12, 1); /* PMCNTENSET */
+}
+
+/**
+ * Read the cycle counter. It wraps, so only use differences.
+ */
+static inline uint32_t get_cycles(void)
+{
+	uint32_t cycles;
+	get_cpreg(cycles, c9, 0, c13, 0);
+	return cycles;
+}
+
+/**
+ * Make PMU event counter 0 count the given event (e.g. PMU_L1D_TLB_REFILL).
+ * Emulators may not implement every event, in which case it reads zero.
+ */
+#define PMU_L1D_TLB_REFILL 0x05
+static inline void pmu_event_init(uint32_t event)
+{
+	uint32_t reg = 0;
+	set_cpreg(reg, c9, 0, c12, 5);   /* PMSELR: counter 0 */
+	set_cpreg(event, c9, 0, c13, 1); /* PMXEVTYPER */
+	reg = 1;
+	set_cpreg(reg, c9, 0, c12, 1); /* PMCNTENSET */
+}
+
+static inline uint32_t pmu_event_read(void)
+{
+	uint32_t count, reg = 0;
+	set_cpreg(reg, c9, 0, c12, 5); /* PMSELR: counter 0 */
+	get_cpreg(count, c9, 0, c13, 2); /* PMXEVCNTR */
+	return count;
+}
+
+/*
+ * Cache maintenance. Kernel and user memory is mapped write-back cacheable,
+ * so memory handed to a device (DMA) needs maintenance around the handoff:
+ *   - clean before the device reads a buffer we wrote
+ *   - clean and invalidate before the device writes a buffer, so no dirty
+ *     line gets evicted on top of its data
+ *   - invalidate after the device wrote it, before we read it
+ * Ranges need not be aligned. The whole lines containing them are affected, so
+ * DMA buffers should not share cache lines with data the CPU writes meanwhile.
+ */
+#define SCTLR_C (1 << 2)
+#define SCTLR_Z (1 << 11)
+#define SCTLR_I (1 << 12)
+
+/**
+ * Return the smallest data cache line size, from CTR.DminLine.
+ */
+static inline uint32_t dcache_line_size(void)
+{
+	uint32_t ctr;
+	get_cpreg(ctr, c0, 0, c0, 1);
+	return 4U << ((ctr >> 16) & 0xF);
+}
+
+#define dcache_range_op(name, CRm)                                             \
+	static inline void name(void *start, uint32_t len)                     \
+	{                                                                      \
+		uint32_t line = dcache_line_size();                            \
+		uint32_t addr = (uint32_t)start & ~(line - 1);                 \
+		uint32_t end = (uint32_t)start + len;                          \
+		for (; addr < end; addr += line)                               \
+			set_cpreg(addr, c7, 0, CRm, 1);                        \
+		mb();                                                          \
+	}
+
+/* DCCMVAC: write dirty lines back to memory */
+dcache_range_op(dcache_clean_range, c10)
+/* DCIMVAC: discard lines, dirty or not */
+dcache_range_op(dcache_inval_range, c6)
+/* DCCIMVAC: write back, then discard */
+dcache_range_op(dcache_clean_inval_range, c14)
+
+/**
+ * Invalidate the whole instruction cache (ICIALLU) and the branch predictor,
+ * after writing instructions through the data cache.
+ */
+static inline void icache_inval_all(void)
+{
+	uint32_t reg = 0;
+	set_cpreg(reg, c7, 0, c5, 0); /* ICIALLU */
+	set_cpreg(reg, c7, 0, c5, 6); /* BPIALL */
+	mb();
+	isb();
+}
+
+/**
+ * Invalidate the level 1 data cache by set/way. Only used before the cache is
+ * enabled, when its contents are unknown.
+ */
+static inline void dcache_l1_inval_all(void)
+{
+	uint32_t ccsidr, sets, ways, set, way, wayshift, lineshift, reg = 0;
+
+	set_cpreg(reg, c0, 2, c0, 0); /* CSSELR: level 1 data cache */
+	isb();
+	get_cpreg(ccsidr, c0, 1, c0, 0); /* CCSIDR */
+	lineshift = (ccsidr & 0x7) + 4;
+	ways = ((ccsidr >> 3) & 0x3FF) + 1;
+	sets = ((ccsidr >> 13) & 0x7FFF) + 1;
+	wayshift = ways > 1 ? __builtin_clz(ways - 1) : 0;
+
+	for (way = 0; way < ways; way++) {
+		for (set = 0; set < sets; set++) {
+			reg = (way << wayshift) | (set << lineshift);
+			set_cpreg(reg, c7, 0, c6, 2); /* DCISW */
+		}
+	}
+	mb();
+}
+
+/**
+ * Enable the data and instruction caches and branch prediction.
+ */
+static inline void cache_enable(void)
+{
+	uint32_t reg;
+
+	get_cpreg(reg, c1, 0, c0, 0);
+	if (!(reg & SCTLR_C))
+		dcache_l1_inval_all();
+	icache_inval_all();
+	reg |= SCTLR_C | SCTLR_I | SCTLR_Z;
+	set_cpreg(reg, c1, 0, c0, 0);
+	isb();
+}
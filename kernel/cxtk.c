@@ -48,8 +48,7 @@ static inline void cxtk_track(uint8_t type, uint32_t arg, uint8_t smallarg)
 void cxtk_init(void)
 {
 	ctxidx = 0;
-	ctxarr = (struct ctx *)kmem_get_pages(PAGE_SIZE * CTX_PAGES, 0);
-	memset(ctxarr, 0, PAGE_SIZE * CTX_PAGES);
+	ctxarr = (struct ctx *)alloc_zeroed_pages(PAGE_SIZE * CTX_PAGES, 0);
 	cxtk_track(CTX_KINIT, 0, 0);
 }
 
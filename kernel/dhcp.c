@@ -34,6 +34,7 @@ static void dhcp_discover(struct netif *netif)
 	pkt->al = (void *)pkt->data + space;
 
 	dhcp = (struct dhcp *)pkt->al;
+	memset(dhcp, 0, sizeof(struct dhcp));
 	dhcp->op = BOOTREQUEST;
 	dhcp->htype = DHCP_HTYPE_ETHERNET;
 	dhcp->hlen = 6; /* mac address = 6 bytes */
@@ -140,6 +141,7 @@ struct packet *dhcp_handle_offer(struct netif *netif, struct packet *pkt)
 	pktr = packet_alloc();
 	pktr->al = pktr->data + udp_reserve();
 	dhcpr = (struct dhcp *)pktr->al;
+	memset(dhcpr, 0, sizeof(struct dhcp));
 	dhcpr->op = BOOTREQUEST;
 	dhcpr->htype = DHCP_HTYPE_ETHERNET;
 	dhcpr->hlen = 6; /* mac address = 6 bytes */
@@ -214,13 +216,25 @@ int dhcp_handle_ack(struct netif *netif, struct packet *pkt)
 	return 0;
 }
 
+/* how long to wait for each reply, and how often to try discovery */
+#define DHCP_TIMEOUT_MS 2000
+#define DHCP_TRIES      3
+
 void dhcp(void)
 {
-	struct packet *offer, *reply, *ack;
+	struct packet *offer = NULL, *reply, *ack;
+	int try;
 
-	interrupt_disable();
-	dhcp_discover(&nif);
-	offer = udp_wait(UDPPORT_DHCP_CLIENT); /* interrupts re-enabled */
+	for (try = 0; try < DHCP_TRIES && !offer; try++) {
+		interrupt_disable();
+		dhcp_discover(&nif);
+		/* interrupts re-enabled */
+		offer = udp_wait(UDPPORT_DHCP_CLIENT, DHCP_TIMEOUT_MS);
+	}
+	if (!offer) {
+		puts("dhcp: no offer received, giving up\n");
+		return;
+	}
 
 	reply = dhcp_handle_offer(&nif, offer);
 	packet_free(offer);
@@ -230,7 +244,12 @@ void dhcp(void)
 	interrupt_disable();
 	udp_send(&nif, reply, 0, 0xFFFFFFFF, htons(UDPPORT_DHCP_CLIENT),
 	         htons(UDPPORT_DHCP_SERVER));
-	ack = udp_wait(UDPPORT_DHCP_CLIENT); /* interrupts re-enabled */
+	/* interrupts re-enabled */
+	ack = udp_wait(UDPPORT_DHCP_CLIENT, DHCP_TIMEOUT_MS);
+	if (!ack) {
+		puts("dhcp: no ack received, giving up\n");
+		return;
+	}
 
 	dhcp_handle_ack(&nif, ack);
 	packet_free(ack);
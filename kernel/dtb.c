@@ -774,7 +774,7 @@ bool dtb_init_interrupt_cb(const struct dtb_iter *iter, void *data)
  */
 void dtb_init(uint32_t phys)
 {
-	uint32_t virt = alloc_pages(kern_virt_allocator, 0x4000, 0);
+	uint32_t virt = vmem_alloc(kern_virt_allocator, 0x4000, 0);
 	kmem_map_pages((uint32_t)virt, phys, 0x4000,
 	               KMEM_ATTR_DEFAULT | KMEM_PERM_DATA);
 
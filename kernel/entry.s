@@ -178,7 +178,7 @@ swi_impl:
 	bic v1, v1, #0xFF000000
 
 	adr lr, _swi_ret           /* set our return address */
-	cmp v1, #10                /* compare to max syscall number */
+	cmp v1, #13                /* compare to max syscall number */
 	movhi a1, v1               /* if higher, go to generic swi() with */
 	bhi sys_unknown            /* syscall number as arg */
 	add pc, pc, v1, lsl #2     /* branch to pc + interrupt number * 4 */
@@ -196,6 +196,9 @@ swi_impl:
 	/*  8 */ b sys_connect
 	/*  9 */ b sys_send
 	/* 10 */ b sys_recv
+	/* 11 */ b sys_setprio
+	/* 12 */ b sys_nanosleep
+	/* 13 */ b sys_setsockopt
 	/* END. Please update max syscall number above. */
 _swi_ret:
 	pop {v1, v2}
@@ -235,8 +238,13 @@ prefetch_abort_impl:
 	push {a1, a2}
 	mov a1, sp
 	bl prefetch_abort
-	nop
-	sub pc, pc, #8
+	/* We only return here if the fault was resolved, so restore the
+	 * context and retry the instruction at the (adjusted) return address */
+	add sp, sp, #8 /* discard dummy SP and LR */
+	pop {a1}
+	pop {a2-a4,r12}
+	pop {v1-v8}
+	rfefd sp!
 
 .global fiq_impl
 fiq_impl:
@@ -265,8 +273,13 @@ data_abort_impl:
 	push {a1, a2}
 	mov a1, sp
 	bl data_abort
-	nop
-	sub pc, pc, #8
+	/* We only return here if the fault was resolved, so restore the
+	 * context and retry the instruction at the (adjusted) return address */
+	add sp, sp, #8 /* discard dummy SP and LR */
+	pop {a1}
+	pop {a2-a4,r12}
+	pop {v1-v8}
+	rfefd sp!
 
 /**
  * Handle IRQ.
@@ -352,15 +365,15 @@ setup_stacks:
 	cps #0x11  /* MODE_FIQ */
 	add a1, a1, #1024
 	mov sp, a1
-	cps #0x17  /* MODE_ABRT */
-	add a1, a1, #1024
+	cps #0x17  /* MODE_ABRT: page faults need some room */
+	add a1, a1, #4096
 	mov sp, a1
 	cps #0x1B  /* MODE_UNDF */
 	add a1, a1, #1024
 	mov sp, a1
 	cps #0x12  /* MODE_IRQ */
 	add a1, a1, #1024
-	add a1, a1, #4096
+	add a1, a1, #5120
 	mov sp, a1
 	cps #0x13  /* MODE_SVC */
 	mov pc, lr
@@ -128,26 +128,32 @@ int fat_extract_shortname(char *input, char *dest)
 
 int fat_clusop(struct blkdev *dev, uint64_t block, void *dst, int op, int nblk)
 {
-	int i, rv = 0;
-	struct blkreq *first, *req;
+	int i, j, got, rv = 0;
+	struct blkreq *first = NULL, *req, *reqs[BLKREQ_BATCH];
 	enum blkreq_status status;
 
-	first = dev->ops->alloc(dev);
-	first->blkidx = block;
-	first->type = op;
-	first->buf = dst;
-	first->size = dev->blksiz;
-	dev->ops->submit(dev, first);
-
-	for (i = 1; i < nblk; i++) {
-		req = dev->ops->alloc(dev);
-		req->blkidx = block + i;
-		req->type = op;
-		req->buf = dst + i * dev->blksiz;
-		req->size = dev->blksiz;
-		list_insert_end(&first->reqlist, &req->reqlist);
-		dev->ops->submit(dev, req);
+	for (i = 0; i < nblk; i += got) {
+		got = dev->ops->alloc_bulk(dev, reqs,
+		                           min(nblk - i, BLKREQ_BATCH));
+		if (!got) {
+			rv = -ENOMEM;
+			break;
+		}
+		for (j = 0; j < got; j++) {
+			req = reqs[j];
+			req->blkidx = block + i + j;
+			req->type = op;
+			req->buf = dst + (i + j) * dev->blksiz;
+			req->size = dev->blksiz;
+			if (first)
+				list_insert_end(&first->reqlist, &req->reqlist);
+			else
+				first = req;
+			dev->ops->submit(dev, req);
+		}
 	}
+	if (!first)
+		return rv;
 
 	status = blkreq_wait_all(first);
 	if (status != BLKREQ_OK)
@@ -298,6 +304,7 @@ int fat_list_chunk(struct fat_fs *fs, struct fs_node *node,
 			child->location = dirent[i].DIR_FstClusHI << 16 |
 			                  dirent[i].DIR_FstClusLO;
 			child->fs = (struct fs *)fs;
+			child->pins = 0;
 
 			list_insert_end(&node->children, &child->list);
 			node->nchildren++;
@@ -426,7 +433,7 @@ int fat_list_root(struct fat_fs *fs, struct fs_node *node)
 	for (i = 0; i < fs->bpb->BPB_RootEntCnt; i++) {
 		rv = fat_read_sector(fs, fs->RootSec + i, dirent);
 		if (rv < 0) {
-			kfree(dirent, bps);
+			kfree(dirent);
 			/* Cleanup the node so that if we retry, we won't have
 			 * duplicate entries. */
 			fs_reset_dir(node);
@@ -439,7 +446,7 @@ int fat_list_root(struct fat_fs *fs, struct fs_node *node)
 		}
 	}
 
-	kfree(dirent, bps);
+	kfree(dirent);
 	node->type = FSN_DIR;
 	return rv;
 }
@@ -464,7 +471,7 @@ int fat_update_size_root(struct fat_fs *fs, struct fs_node *node, uint64_t size)
 		}
 		// otherwise, continue
 	}
-	kfree(dirent, bps);
+	kfree(dirent);
 	return rv;
 }
 
@@ -495,7 +502,7 @@ int fat_update_size_nonroot(struct fat_fs *fs, struct fs_node *node,
 		}
 		// otherwise, continue
 	}
-	kfree(dirent, clus_bytes(fs));
+	kfree(dirent);
 	return rv;
 }
 
@@ -558,12 +565,13 @@ int fat_read(struct file *f, void *dst, size_t amt)
 
 	rv = bytes;
 out:
-	kfree(buf, clusiz);
+	kfree(buf);
 	return rv;
 }
 
 int fat_close(struct file *f)
 {
+	fs_unpin(f->node);
 	fs_free_file(f);
 	return 0;
 }
@@ -631,7 +639,7 @@ int fat_write(struct file *f, const uint8_t *src, size_t count)
 	}
 
 out:
-	kfree(buf, clusiz);
+	kfree(buf);
 	if (f->pos > f->node->size)
 		rv = fat_update_size(fs, f->node, f->pos);
 	return rv;
@@ -653,14 +661,14 @@ int fat_list(struct fs_node *node)
 	for (clus = node->location; clus != FAT_EOF;
 	     clus = fat_next_cluster(fs, clus)) {
 		if (clus == FAT_ERR) {
-			kfree(dirent, clus_bytes(fs));
+			kfree(dirent);
 			fs_reset_dir(node);
 			return -EIO;
 		}
 
 		rv = fat_read_cluster(fs, clus, dirent);
 		if (rv != 0) {
-			kfree(dirent, clus_bytes(fs));
+			kfree(dirent);
 			fs_reset_dir(node);
 			return rv;
 		}
@@ -670,7 +678,7 @@ int fat_list(struct fs_node *node)
 			break;
 		}
 	}
-	kfree(dirent, clus_bytes(fs));
+	kfree(dirent);
 	node->type = FSN_DIR;
 	return rv;
 }
@@ -696,6 +704,7 @@ struct file *fat_open(struct fs_node *node, int flags)
 
 	file->ops = &fat_file_ops;
 	file->node = node;
+	fs_pin(node);
 	file->pos = 0;
 	file->flags = flags;
 	priv->first_cluster = node->location;
@@ -803,9 +812,9 @@ void fat_init(struct blkdev *dev)
 	return;
 
 out:
-	kfree(req->buf, dev->blksiz);
+	kfree(req->buf);
 	dev->ops->free(dev, req);
-	kfree(fs, sizeof(*fs));
+	kfree(fs);
 }
 
 static int cmd_fat(int argc, char **argv)
@@ -10,6 +10,10 @@ struct slab *fs_node_slab;
 struct slab *file_slab;
 struct fs_node *fs_root;
 
+/**
+ * Forget the contents of a directory, so that it's loaded again when next
+ * used. Nothing beneath it may be pinned.
+ */
 void fs_reset_dir(struct fs_node *node)
 {
 	struct fs_node *child, *next;
@@ -17,11 +21,61 @@ void fs_reset_dir(struct fs_node *node)
 	node->type = FSN_LAZY_DIR;
 	list_for_each_entry_safe(child, next, &node->children, list)
 	{
+		if (child->type == FSN_DIR)
+			fs_reset_dir(child);
+		list_remove(&child->list);
 		slab_free(fs_node_slab, child);
-		list_remove(child);
 	}
 }
 
+/**
+ * Pin a node while it's in use, so that the memory shrinker won't free it.
+ * Pins count on every ancestor too, since resetting any of them would free the
+ * node along with it.
+ */
+void fs_pin(struct fs_node *node)
+{
+	for (; node; node = node->parent)
+		node->pins++;
+}
+
+void fs_unpin(struct fs_node *node)
+{
+	for (; node; node = node->parent)
+		node->pins--;
+}
+
+/*
+ * Drop loaded directories which nobody is using. The root stays loaded, since
+ * fs_resolve() relies on it. Directories within pinned ones may still go.
+ */
+static void fs_shrink_dir(struct fs_node *node)
+{
+	struct fs_node *child;
+	list_for_each_entry(child, &node->children, list)
+	{
+		if (child->type != FSN_DIR)
+			continue;
+		if (child->pins)
+			fs_shrink_dir(child);
+		else
+			fs_reset_dir(child);
+	}
+}
+
+static uint32_t fs_shrink(uint32_t want)
+{
+	if (fs_root && fs_root->type == FSN_DIR)
+		fs_shrink_dir(fs_root);
+	return slab_shrink(fs_node_slab);
+}
+
+static struct shrinker fs_shrinker = {
+	.name = "fs_node",
+	.shrink = fs_shrink,
+	.atomic = false,
+};
+
 struct fs_node *fs_find_in_dir(struct fs_node *node, const char *name)
 {
 	struct fs_node *child;
@@ -34,6 +88,10 @@ struct fs_node *fs_find_in_dir(struct fs_node *node, const char *name)
 	return NULL;
 }
 
+/**
+ * Find the node for an absolute path. On success, the node is pinned, and the
+ * caller should fs_unpin() it when done.
+ */
 int fs_resolve(const char *path, struct fs_node **out)
 {
 	struct fs_node *cur, *next;
@@ -51,6 +109,7 @@ int fs_resolve(const char *path, struct fs_node **out)
 	}
 
 	cur = fs_root;
+	fs_pin(cur);
 	pathrem = path + 1;
 	name = kmalloc(FILENAME_MAX);
 	for (;;) {
@@ -89,11 +148,15 @@ int fs_resolve(const char *path, struct fs_node **out)
 			goto out;
 		}
 
+		fs_pin(next);
+		fs_unpin(cur);
 		cur = next;
 		pathrem = end;
 	}
 out:
-	kfree(name, FILENAME_MAX);
+	if (rv)
+		fs_unpin(cur);
+	kfree(name);
 	return rv;
 }
 
@@ -129,6 +192,7 @@ static int cmd_ls(int argc, char **argv)
 	}
 	if (node->type != FSN_DIR) {
 		puts("error: not a directory\n");
+		fs_unpin(node);
 		return 1;
 	}
 	list_for_each_entry(child, &node->children, list)
@@ -137,6 +201,7 @@ static int cmd_ls(int argc, char **argv)
 		       child->name, (uint32_t)child->size);
 	}
 
+	fs_unpin(node);
 	return 0;
 }
 
@@ -160,6 +225,7 @@ static int cmd_cat(int argc, char **argv)
 		return rv;
 	}
 	f = node->fs->fs_ops->fs_open(node, O_RDONLY);
+	fs_unpin(node);
 	buf = kmalloc(blksize);
 	do {
 		rv = f->ops->read(f, buf, blksize);
@@ -167,7 +233,7 @@ static int cmd_cat(int argc, char **argv)
 			nputs(buf, rv);
 	} while (rv == blksize);
 	f->ops->close(f);
-	kfree(buf, blksize);
+	kfree(buf);
 	return rv;
 }
 
@@ -187,10 +253,11 @@ static int cmd_addline(int argc, char **argv)
 	if (rv < 0)
 		return rv;
 	f = node->fs->fs_ops->fs_open(node, O_WRONLY | O_APPEND);
+	fs_unpin(node);
 	buf = kmalloc(1024);
 	bytes = snprintf(buf, 1024, "%s\n", argv[1]);
 	f->ops->write(f, buf, bytes);
-	kfree(buf, 1024);
+	kfree(buf);
 	f->ops->close(f);
 	return rv;
 }
@@ -205,8 +272,10 @@ struct ksh_cmd fs_ksh_cmds[] = {
 void fs_init(void)
 {
 	fs_node_slab =
-	        slab_new("fs_node", sizeof(struct fs_node), kmem_get_page);
-	file_slab = slab_new("file", sizeof(struct file), kmem_get_page);
+	        slab_new("fs_node", sizeof(struct fs_node), SLAB_ORDER_AUTO,
+	                 kmem_get_slab_pages, kmem_free_slab_pages);
+	file_slab = slab_new("file", sizeof(struct file), SLAB_ORDER_AUTO,
+	                     kmem_get_slab_pages, kmem_free_slab_pages);
 	fs_root = slab_alloc(fs_node_slab);
 	strlcpy(fs_root->name, "/", sizeof(fs_root->name));
 	fs_root->type = FSN_LAZY_DIR;
@@ -219,4 +288,6 @@ void fs_init(void)
 	fs_root->list.prev = NULL;
 	fs_root->parent = NULL;
 	fs_root->fs = NULL;
+	fs_root->pins = 0;
+	register_shrinker(&fs_shrinker);
 }
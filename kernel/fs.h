@@ -64,12 +64,16 @@ struct fs_node {
 	} type;
 	uint64_t location;
 	struct fs *fs;
+	/* references to this node or any beneath it, see fs_pin() */
+	unsigned int pins;
 };
 
 extern struct slab *fs_node_slab;
 extern struct fs_node *fs_root;
 void fs_init(void);
 void fs_reset_dir(struct fs_node *node);
+void fs_pin(struct fs_node *node);
+void fs_unpin(struct fs_node *node);
 int fs_resolve(const char *path, struct fs_node **out);
 struct file *fs_alloc_file(void);
 void fs_free_file(struct file *f);
@@ -22,9 +22,9 @@ void gic_init(void)
 		gic_names[i] = NULL;
 	}
 
-	gic_dregs = (gic_distributor_registers *)alloc_pages(
+	gic_dregs = (gic_distributor_registers *)vmem_alloc(
 	        kern_virt_allocator, 0x1000, 0);
-	gic_ifregs = (gic_cpu_interface_registers *)alloc_pages(
+	gic_ifregs = (gic_cpu_interface_registers *)vmem_alloc(
 	        kern_virt_allocator, 0x1000, 0);
 	kmem_map_pages((uint32_t)gic_dregs, GIC_DIST_BASE, 0x1000,
 	               DEVICE_SHAREABLE | KMEM_PERM_DATA);
@@ -99,12 +99,15 @@ int ip_send(struct netif *netif, struct packet *pkt, uint8_t proto,
 
 	/* Set IHL to 5, Version to 4 */
 	pkt->ip->verihl = 5 | (4 << 4);
+	pkt->ip->tos = 0;
 	pkt->ip->len = htons(pkt->end - pkt->nl);
 	pkt->ip->id = htons(ipid++);
+	pkt->ip->flags_foffset = 0;
 	pkt->ip->ttl = 32; /* somewhat low so we don't break the internet */
 	pkt->ip->proto = proto;
 	pkt->ip->src = netif->ip;
 	pkt->ip->dst = dst_ip;
+	pkt->ip->csum = 0;
 	csum_init(&csum);
 	csum_add(&csum, pkt->nl, 10);
 	pkt->ip->csum = csum_finalize(&csum);
@@ -12,7 +12,9 @@
 #include "errno.h"
 #include "format.h"
 #include "list.h"
+#include "vmem.h"
 #include "wait.h"
+#include "wheel.h"
 
 #include "config.h"
 
@@ -94,16 +96,83 @@ uint32_t printf(const char *format, ...);
 void kmem_init(uint32_t phys);
 
 /*
- * Return pages of kernel memory, already mapped and everything!
+ * The kernel owns virtual addresses below KERN_VIRT_END (TTBR0), processes the
+ * rest.
+ */
+#define KERN_VIRT_END 0x40000000U
+
+/*
+ * RAM is mapped linearly at LINEAR_BASE (up to LINEAR_MAX bytes of it), so
+ * translating addresses there is just an add.
+ */
+#define LINEAR_BASE 0x20000000U
+#define LINEAR_MAX  0x20000000U
+#if LINEAR_BASE + LINEAR_MAX > KERN_VIRT_END
+#error "the linear map must fit in the kernel's address space"
+#endif
+extern uint32_t linear_phys;
+extern uint32_t linear_size;
+
+static inline bool kmem_linear(void *virt)
+{
+	return (uint32_t)virt - LINEAR_BASE < linear_size;
+}
+
+static inline void *kmem_phys_to_virt(uint32_t phys)
+{
+	return (void *)(phys - linear_phys + LINEAR_BASE);
+}
+
+/*
+ * Return pages of kernel memory, already mapped and everything! The uncached
+ * ones are mapped separately, for sharing with devices.
  */
 void *kmem_get_pages(uint32_t bytes, uint32_t align);
 void *kmem_get_page(void);
+void *kmem_get_slab_pages(unsigned int order);
+void *kmem_get_uncached_pages(uint32_t bytes, uint32_t align);
+void *kmem_get_uncached_slab_pages(unsigned int order);
+
+/*
+ * Zeroed pages, from pools the idle thread refills (see zeropool.c). Free them
+ * with kmem_free_pages().
+ */
+void *alloc_zeroed_pages(uint32_t bytes, uint32_t align);
+bool zero_pool_refill(void);
+void zero_pool_init(void);
+int zero_pool_cmd_status(int argc, char **argv);
+
+/*
+ * Shrinkers give memory back when the page allocator runs low (see reclaim.c).
+ * shrink() is asked for some count of pages, and returns how many it freed.
+ * Unless atomic is set, it's only called from a thread.
+ */
+struct shrinker {
+	char *name;
+	uint32_t (*shrink)(uint32_t want);
+	bool atomic; /* safe in interrupt handlers and during allocation */
+	uint32_t calls;
+	uint32_t freed;
+	struct list_head list;
+};
+void register_shrinker(struct shrinker *shrinker);
+void reclaim_init(void);
+bool reclaim_run(void);
+bool reclaim_memory_low(void);
+int reclaim_cmd_status(int argc, char **argv);
 
 /*
  * Free that memory.
  */
 void kmem_free_pages(void *virt_ptr, uint32_t len);
 void kmem_free_page(void *ptr);
+void kmem_free_slab_pages(void *ptr, unsigned int order);
+
+/*
+ * Node allocation functions for vmem allocators (see lib/vmem.h)
+ */
+void *kmem_vmem_node_alloc(void);
+void kmem_vmem_node_free(void *ptr);
 
 /*
  * Look up the physical address corresponding to a virtual address
@@ -112,11 +181,13 @@ uint32_t kmem_lookup_phys(void *virt_ptr);
 uint32_t umem_lookup_phys(struct process *p, void *virt_ptr);
 
 /*
- * Map physical memory into the virtual memory space.
+ * Map physical memory into the virtual memory space. Kernel page tables are
+ * preallocated, but a process may need new ones, so umem_map_pages() returns
+ * -ENOMEM if it runs out of memory (and 0 otherwise).
  */
 void kmem_map_pages(uint32_t virt, uint32_t phys, uint32_t len, uint32_t attrs);
-void umem_map_pages(struct process *p, uint32_t virt, uint32_t phys,
-                    uint32_t len, uint32_t attrs);
+int umem_map_pages(struct process *p, uint32_t virt, uint32_t phys,
+                   uint32_t len, uint32_t attrs);
 uint32_t kmem_remap_periph(uint32_t addr);
 
 /*
@@ -131,8 +202,13 @@ void umem_unmap_pages(struct process *p, uint32_t virt, uint32_t len);
 void kmem_print(uint32_t start, uint32_t stop);
 void umem_print(struct process *p, uint32_t start, uint32_t stop);
 
+/*
+ * Free a process's second-level page tables, when destroying it.
+ */
+void umem_free_tables(struct process *p);
+
 extern void *phys_allocator;
-extern void *kern_virt_allocator;
+extern struct vmem *kern_virt_allocator;
 
 /*
  * MMU Constants
@@ -193,20 +269,27 @@ extern void *kern_virt_allocator;
 #define CACHE_OUTER_WT      (SLD__C)
 #define CACHE_OUTER_WB      (SLD__C | SLD__B)
 
-/* Default for kernel memory is to be shareable and non cacheable. Someday I'll
- * think about enabling the caches. */
-#define KMEM_ATTR_DEFAULT (NORMAL_SHAREABLE | CACHE_INNER_WB | CACHE_OUTER_WB)
-#define KMEM_PERM_DATA    (PRW_UNA | EXECUTE_NEVER)
-#define KMEM_PERM_CODE    (PRO_UNA)
+/* Default for kernel memory is to be shareable and write-back cacheable. Rings
+ * shared with devices are mapped uncached instead, see virtq_create(). */
+#define KMEM_ATTR_DEFAULT  (NORMAL_SHAREABLE | CACHE_INNER_WB | CACHE_OUTER_WB)
+#define KMEM_ATTR_UNCACHED (NORMAL_SHAREABLE | CACHE_INNER_NC | CACHE_OUTER_NC)
+#define KMEM_PERM_DATA     (PRW_UNA | EXECUTE_NEVER)
+#define KMEM_PERM_CODE     (PRO_UNA)
+
+/* permissions and attrs for umem, default. Cacheability matches the kernel's
+ * mapping of the same pages, so the two never disagree. */
+#define UMEM_DEFAULT (KMEM_ATTR_DEFAULT | PRW_URW | NOT_GLOBAL)
+#define UMEM_TEXT    (KMEM_ATTR_DEFAULT | PRO_URO | NOT_GLOBAL)
 
-/* permissions and attrs for umem, default */
-#define UMEM_DEFAULT (NORMAL_SHAREABLE | PRW_URW | NOT_GLOBAL)
+/* Translation table walks are inner and outer write-back, shareable (TTBRx) */
+#define TTBR_WALK_ATTRS ((1 << 6) | (1 << 3) | (1 << 1))
 
 /*
- * KMalloc
+ * KMalloc: any size works, though allocations over 2048 bytes take whole pages.
+ * kfree() figures out the size on its own.
  */
 void *kmalloc(uint32_t size);
-void kfree(void *ptr, uint32_t size);
+void kfree(void *ptr);
 void kmalloc_init(void);
 
 /*
@@ -232,13 +315,21 @@ struct process {
 	struct ctx context;
 
 	struct {
-		int pr_ready : 1;  /* ready to be scheduled? */
+		int pr_ready : 1;  /* on the ready queue? see ready_enqueue() */
 		int pr_kernel : 1; /* is a kernel thread? */
 	} flags;
 
 	/** Global process list entry. */
 	struct list_head list;
 
+	/** Ready queue entry, while pr_ready is set. */
+	struct list_head ready;
+
+	/** Scheduling level (0 runs first), see SCHED_LEVELS. */
+	uint8_t prio;
+	uint8_t base_prio; /* highest level, which boosts return it to */
+	uint8_t ticks;     /* timer ticks used of this level's quantum */
+
 	/** List of sockets */
 	struct list_head sockets;
 
@@ -250,21 +341,69 @@ struct process {
 	/** Size of the process image file. */
 	uint32_t size;
 
-	/** Physical address of process image. */
-	uint32_t phys;
+	/** Regions of user memory, and count of pages faulted in so far. */
+	struct list_head regions;
+	uint32_t resident;        /* private pages */
+	uint32_t shared_resident; /* pages mapped from a struct umem_shared */
 
 	/** Allocator for the process address space. */
-	void *vmem_allocator;
+	struct vmem vmem;
+
+	/** ASID and generation (see lib/asid.h), 0 until first scheduled. */
+	uint32_t asid;
 
 	/** First-level page table and shadow page table. */
 	uint32_t ttbr1;
 	uint32_t *first;
 	uint32_t **shadow;
 
+	/** Pages holding our second-level tables (see kernel/kmem.c). */
+	struct list_head tables;
+
 	/** Waitlist for when the process ends */
 	struct waitlist endlist;
 };
 
+/*
+ * Contents which many processes may map from a single physical copy. The copy
+ * is made when the first reference is taken, and freed with the last one.
+ */
+struct umem_shared {
+	const void *src;
+	uint32_t len;
+	uint32_t phys;
+	uint32_t refcount;
+};
+
+/*
+ * A region of user memory which is filled in on demand (see umem.c). Pages
+ * start with the contents of src, and are zero beyond src_len.
+ */
+struct umem_region {
+	struct list_head list;
+	uint32_t start;
+	uint32_t end;
+	uint32_t attrs;
+	uint32_t flags;
+#define UMEM_COW 0x1 /* writes to shared pages make a private copy */
+	const void *src;
+	uint32_t src_len;
+	struct umem_shared *shared; /* or NULL if every page is private */
+	uint32_t shared_off;        /* where src begins in shared */
+};
+
+int umem_add_region(struct process *p, uint32_t start, uint32_t len,
+                    uint32_t attrs, const void *src, uint32_t src_len);
+int umem_add_shared(struct process *p, uint32_t start, uint32_t len,
+                    uint32_t attrs, struct umem_shared *shared, uint32_t off,
+                    uint32_t flags);
+int umem_fault(struct process *p, uint32_t addr, bool write);
+void umem_free_regions(struct process *p);
+
+/* User stacks grow down from here, a page at a time, up to USER_STACK_MAX */
+#define USER_STACK_TOP 0x80000000
+#define USER_STACK_MAX 0x00100000
+
 /* Create a process */
 struct process *create_process(uint32_t binary);
 struct process *create_kthread(void (*func)(void *), void *arg);
@@ -295,6 +434,35 @@ static inline void preempt_enable(void)
 extern struct process *current;
 extern struct list_head process_list;
 
+/*
+ * Only ready processes are on the ready queues, so the scheduler need not look
+ * at blocked ones. These set and clear pr_ready, and may be called with
+ * interrupts enabled or not, even if the process is already in that state.
+ */
+void ready_enqueue(struct process *p);
+void ready_dequeue(struct process *p);
+
+/*
+ * The scheduler is a multi-level feedback queue. Each level has its own ready
+ * queue, and the lowest numbered level with a ready process runs. A process
+ * which uses up its quantum drops a level, and one which is woken after
+ * blocking climbs back one, but never above its base priority. Every
+ * SCHED_BOOST_TICKS, every ready process returns to its base priority, so
+ * nothing starves.
+ */
+#define SCHED_LEVELS       4
+#define SCHED_QUANTUM(lvl) (1U << (lvl)) /* timer ticks */
+#define SCHED_BOOST_TICKS  100
+
+/* Account for a timer tick */
+void sched_tick(void);
+/* Return true if current should be preempted */
+bool sched_should_preempt(void);
+/* Return true if the timer must tick, to share the CPU between processes */
+bool sched_wants_tick(void);
+/* Set the base priority of a process, or of current when pid is 0 */
+int process_set_priority(uint32_t pid, uint32_t prio);
+
 /* Initialize process subsystem */
 void process_init(void);
 
@@ -342,6 +510,17 @@ char *gic_get_name(uint32_t intid);
 /* timer */
 void timer_init(void);
 void timer_isr(uint32_t intid, struct ctx *ctx);
+uint64_t timer_now(void);
+void timer_update(void);
+void timer_kick(void);
+/* Kernel timers, with millisecond resolution */
+void timer_add(struct wheel_timer *timer, uint32_t ms);
+bool timer_cancel(struct wheel_timer *timer);
+uint32_t timer_ms(void);
+void timer_sleep(uint32_t ms);
+/* Longest duration we handle, durations are cut to this */
+#define TIMER_MAX_MS 0x3FFFFFFFU
+uint32_t timer_duration_ms(uint32_t sec, uint32_t nsec);
 
 /* special exectuion functions, see entry.s */
 int __nopreempt setctx(struct ctx *ctx);
@@ -357,7 +536,7 @@ struct netif;
 extern struct netif nif;
 
 void packet_init(void);
-struct packet *udp_wait(uint16_t port);
+struct packet *udp_wait(uint16_t port, uint32_t timeout_ms);
 
 int copy_from_user(void *kerndst, const void *usersrc, size_t n);
 int copy_to_user(void *userdst, const void *kernsrc, size_t n);
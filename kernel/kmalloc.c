@@ -1,9 +1,14 @@
 /*
  * kmalloc.c: A kernel memory allocator based on the slab allocator
  *
- * This allocator can allocate up to 2048 bytes of memory. Larger allocations
- * must be made with a page allocator or some other type of memory management
- * strategy.
+ * Allocations up to 2048 bytes come from a slab of the next power of two. Slab
+ * pages record which slab owns them, so kfree() can find it from the pointer
+ * alone.
+ *
+ * Larger allocations get their own pages, and are tracked in a small hash table
+ * keyed by address, which remembers the size. These are always page aligned,
+ * while slab objects rarely are (every slab page begins with a header), so
+ * kfree() only looks in the table for page aligned pointers.
  */
 
 #include <stdint.h>
@@ -26,6 +31,21 @@ struct kmalloc_size kmalloc_sizes[] = {
 	{ 2048, "kmalloc(2048)", NULL },
 };
 
+struct kmalloc_large {
+	struct list_head list;
+	void *ptr;
+	uint32_t size;
+};
+
+#define KMALLOC_LARGE_BUCKETS 16
+static struct list_head kmalloc_large[KMALLOC_LARGE_BUCKETS];
+
+static struct list_head *large_bucket(void *ptr)
+{
+	return &kmalloc_large[((uint32_t)ptr >> PAGE_BITS) %
+	                      KMALLOC_LARGE_BUCKETS];
+}
+
 static struct slab *find_slab(uint32_t size)
 {
 	int32_t i;
@@ -37,41 +57,96 @@ static struct slab *find_slab(uint32_t size)
 	return NULL;
 }
 
-void *kmalloc(uint32_t size)
+static void *kmalloc_large_alloc(uint32_t size)
 {
-	struct slab *slab;
+	struct kmalloc_large *large;
 
-	slab = find_slab(size);
-	if (!slab) {
-		printf("kmalloc: Got allocation for size %u greater than "
-		       "2048. Somebody didn't read the docs! Get ready for "
-		       "a very interesting crash.\n",
-		       size);
+	large = kmalloc(sizeof(*large));
+	if (!large)
+		return NULL;
+	large->size = ALIGN(size, PAGE_SIZE);
+	large->ptr = kmem_get_pages(large->size, 0);
+	if (!large->ptr) {
+		kfree(large);
 		return NULL;
 	}
-	return slab_alloc(slab);
+	list_insert(large_bucket(large->ptr), &large->list);
+	return large->ptr;
 }
 
-void kfree(void *ptr, uint32_t size)
+static bool kmalloc_large_free(void *ptr)
+{
+	struct kmalloc_large *large;
+
+	list_for_each_entry(large, large_bucket(ptr), list)
+	{
+		if (large->ptr == ptr) {
+			list_remove(&large->list);
+			kmem_free_pages(ptr, large->size);
+			kfree(large);
+			return true;
+		}
+	}
+	return false;
+}
+
+void *kmalloc(uint32_t size)
 {
 	struct slab *slab;
 
 	slab = find_slab(size);
-	if (!slab) {
-		printf("kfree: Got free request for size %u greater than "
-		       "2048. Very weird.\n",
-		       size);
+	if (!slab)
+		return kmalloc_large_alloc(size);
+	return slab_alloc(slab);
+}
+
+void kfree(void *ptr)
+{
+	if (!ptr)
 		return;
-	}
-	return slab_free(slab, ptr);
+	if (((uint32_t)ptr & (PAGE_SIZE - 1)) == 0 && kmalloc_large_free(ptr))
+		return;
+	slab_free(slab_of(ptr), ptr);
+}
+
+static unsigned int kmalloc_slab_context(void)
+{
+	uint32_t cpsr;
+	get_cpsr(cpsr);
+	if ((cpsr & ARM_MODE_MASK) == ARM_MODE_IRQ)
+		return SLAB_CTX_IRQ;
+	return SLAB_CTX_THREAD;
 }
 
+static unsigned long kmalloc_slab_irq_save(void)
+{
+	int flags;
+	irqsave(&flags);
+	return flags;
+}
+
+static void kmalloc_slab_irq_restore(unsigned long flags)
+{
+	int iflags = flags;
+	irqrestore(&iflags);
+}
+
+static const struct slab_sync kmalloc_slab_sync = {
+	.context = kmalloc_slab_context,
+	.irq_save = kmalloc_slab_irq_save,
+	.irq_restore = kmalloc_slab_irq_restore,
+};
+
 void kmalloc_init(void)
 {
 	uint32_t i;
+	slab_set_sync(&kmalloc_slab_sync);
 	for (i = 0; i < nelem(kmalloc_sizes); i++) {
 		kmalloc_sizes[i].slab =
 		        slab_new(kmalloc_sizes[i].slabname,
-		                 kmalloc_sizes[i].size, kmem_get_page);
+		                 kmalloc_sizes[i].size, SLAB_ORDER_AUTO,
+		                 kmem_get_slab_pages, kmem_free_slab_pages);
 	}
+	for (i = 0; i < KMALLOC_LARGE_BUCKETS; i++)
+		INIT_LIST_HEAD(kmalloc_large[i]);
 }
@@ -1,7 +1,10 @@
 /*
  * Memory routines and initialization
  */
+#include "asid.h"
 #include "kernel.h"
+#include "ksh.h"
+#include "string.h"
 
 #define top_n_bits(n) (0xFFFFFFFF << (32 - n))
 #define bot_n_bits(n) (0xFFFFFFFF >> (32 - n))
@@ -19,14 +22,28 @@
  * SLD. However, we don't pre-allocate all second-level tables (this is much
  * memory). Since the first-level table contains physical addresses, we also
  * need a "shadow page table" to record virtual addresses of each second-level
- * table.
+ * table. The tables themselves are only 1KB, so we pack four into each page,
+ * and keep a list of those pages (see struct table_page).
  *
  * With this struct, we can have all the info necessary, and delegate to proper
  * functions for doing tasks.
+ *
+ * Changing or removing a valid descriptor means the TLB may still hold the old
+ * one. As we modify the tables, we record each such address in a tlb_batch,
+ * and tlb_flush() invalidates them once we're done (see below).
  */
+#define TLB_BATCH_MAX 16
+struct tlb_batch {
+	uint32_t count; /* TLB_BATCH_MAX + 1 means "too many, flush it all" */
+	uint32_t addrs[TLB_BATCH_MAX];
+};
+
 struct mem {
 	uint32_t *base;
 	uint32_t **shadow;
+	uint32_t asid;             /* user memory only, see lib/asid.h */
+	struct list_head *tables; /* user memory only, see table_alloc() */
+	struct tlb_batch tlb;
 
 #define STRAT_KERNEL 1
 #define STRAT_SHADOW 2
@@ -52,11 +69,28 @@ uint32_t phys_dynamic;
 void *second_level_table;
 void *dynamic;
 
+/*
+ * All RAM is mapped with sections at LINEAR_BASE, so that page allocations
+ * need no mapping of their own, and translating their addresses is arithmetic.
+ * Everything else the kernel maps (the image, peripherals, uncached pages)
+ * still comes from kern_virt_allocator and the page tables.
+ */
+uint32_t linear_phys;
+uint32_t linear_size;
+
 /*
  * Allocators.
  */
 void *phys_allocator;
-void *kern_virt_allocator;
+struct vmem *kern_virt_allocator;
+
+/*
+ * The kernel virtual allocator needs a few nodes before kmalloc() works. It's
+ * never destroyed, so these are never freed.
+ */
+static struct vmem kern_vmem;
+static struct vmem_node kern_vmem_boot[16];
+static uint32_t kern_vmem_boot_used;
 
 /*
  * Top-of-stack pointers, initialized by kmem_init()
@@ -77,6 +111,124 @@ static void init_second_level(uint32_t *second)
 		second[i] = 0;
 }
 
+/*
+ * Attributes are always given in small page format (see kernel.h). Sections
+ * and large pages hold the same bits in different places, so convert them.
+ */
+static uint32_t small_to_section(uint32_t attrs)
+{
+	return (attrs & (SLD__B | SLD__C)) | ((attrs & EXECUTE_NEVER) << 4) |
+	       (((attrs >> 4) & 0x3) << 10) | (((attrs >> 6) & 0x7) << 12) |
+	       (((attrs >> 9) & 0x7) << 15);
+}
+
+static uint32_t section_to_small(uint32_t fld)
+{
+	return (fld & (SLD__B | SLD__C)) | ((fld >> 4) & EXECUTE_NEVER) |
+	       (((fld >> 10) & 0x3) << 4) | (((fld >> 12) & 0x7) << 6) |
+	       (((fld >> 15) & 0x7) << 9);
+}
+
+/* B, C, AP[1:0], AP2, S and nG are in the same place for large pages */
+#define LARGE_SAME_BITS                                                        \
+	(SLD__B | SLD__C | SLD__AP0 | SLD__AP1 | SLD__AP2 | SLD__S | SLD_NG)
+
+static uint32_t small_to_large(uint32_t attrs)
+{
+	return (attrs & LARGE_SAME_BITS) | (((attrs >> 6) & 0x7) << 12) |
+	       ((attrs & EXECUTE_NEVER) << 15);
+}
+
+static uint32_t large_to_small(uint32_t sld)
+{
+	return (sld & LARGE_SAME_BITS) | (((sld >> 12) & 0x7) << 6) |
+	       ((sld >> 15) & EXECUTE_NEVER);
+}
+
+/*
+ * TLB maintenance.
+ *
+ * Kernel mappings are global, so we invalidate them by MVA for all ASIDs, or
+ * the whole TLB. User mappings are invalidated by MVA and ASID, or by ASID.
+ * Invalidating any address within a section or large page removes the entry
+ * for all of it, as well as any cached walk through the first-level entry, so
+ * one address per descriptor is enough.
+ */
+static void tlb_begin(struct mem *mem)
+{
+	mem->tlb.count = 0;
+}
+
+static void tlb_add(struct mem *mem, uint32_t virt)
+{
+	if (mem->tlb.count < TLB_BATCH_MAX)
+		mem->tlb.addrs[mem->tlb.count++] = virt & top_n_bits(20);
+	else
+		mem->tlb.count = TLB_BATCH_MAX + 1;
+}
+
+/**
+ * Record every valid descriptor in second[from] to second[to - 1].
+ */
+static void tlb_add_second(struct mem *mem, uint32_t *second,
+                           uint32_t first_idx, uint32_t from, uint32_t to)
+{
+	uint32_t i = from;
+	while (i < to) {
+		switch (second[i] & SLD_MASK) {
+		case SLD_UNMAPPED:
+			i += 1;
+			break;
+		case SLD_LARGE:
+			tlb_add(mem, (first_idx << 20) | (i << 12));
+			i = (i | 0xF) + 1;
+			break;
+		default:
+			tlb_add(mem, (first_idx << 20) | (i << 12));
+			i += 1;
+			break;
+		}
+	}
+}
+
+/**
+ * Issue the invalidations recorded since tlb_begin(). The first barrier makes
+ * sure the table walker sees our descriptor writes before the invalidation,
+ * and the last ones make sure the invalidation is complete before we return to
+ * code which may rely on it.
+ */
+static void tlb_flush(struct mem *mem)
+{
+	uint32_t i;
+
+	if (!mem->tlb.count)
+		return;
+
+	/* a user address space which never ran has nothing in the TLB */
+	if (mem->strategy == STRAT_SHADOW && !mem->asid) {
+		mem->tlb.count = 0;
+		return;
+	}
+
+	mb();
+	if (mem->tlb.count > TLB_BATCH_MAX) {
+		if (mem->strategy == STRAT_KERNEL)
+			tlbiall();
+		else
+			tlbiasid(asid_hw(mem->asid));
+	} else {
+		for (i = 0; i < mem->tlb.count; i++)
+			if (mem->strategy == STRAT_KERNEL)
+				tlbimvaa(mem->tlb.addrs[i]);
+			else
+				tlbimva(mem->tlb.addrs[i] |
+				        asid_hw(mem->asid));
+	}
+	mb();
+	isb();
+	mem->tlb.count = 0;
+}
+
 /**
  * Return the address of a second-level table, assuming it already exists.
  */
@@ -93,81 +245,353 @@ static uint32_t *get_second(struct mem *mem, uint32_t first_idx)
 	}
 }
 
+/*
+ * A page holding up to four user second-level tables. Each process has a list
+ * of these, which is usually only a few entries long, so that's where we
+ * look for free slots, and it's all that needs freeing on process exit. Pages
+ * come from the zero pool, and we clear slots as they're freed, so a free slot
+ * is always an empty table.
+ */
+#define TABLES_PER_PAGE (PAGE_SIZE / 1024)
+#define TABLE_WORDS     256
+struct table_page {
+	struct list_head list;
+	uint32_t *virt;
+	uint8_t used;     /* bitmask of slots in use */
+	uint8_t refcount; /* count of slots in use */
+};
+
+/*
+ * Return a cleared 1KB table, or NULL if we're out of memory.
+ */
+static uint32_t *table_alloc(struct list_head *tables)
+{
+	struct table_page *tp;
+	uint32_t slot;
+
+	list_for_each_entry(tp, tables, list)
+	{
+		if (tp->refcount < TABLES_PER_PAGE)
+			goto found;
+	}
+
+	tp = kmalloc(sizeof(struct table_page));
+	if (!tp)
+		return NULL;
+	tp->virt = alloc_zeroed_pages(PAGE_SIZE, 0);
+	if (!tp->virt) {
+		kfree(tp);
+		return NULL;
+	}
+	tp->used = 0;
+	tp->refcount = 0;
+	list_insert(tables, &tp->list);
+found:
+	for (slot = 0; tp->used & (1 << slot); slot++)
+		;
+	tp->used |= 1 << slot;
+	tp->refcount++;
+	return tp->virt + slot * TABLE_WORDS;
+}
+
+static void table_free(struct list_head *tables, uint32_t *table)
+{
+	struct table_page *tp;
+	uint32_t *page = (uint32_t *)((uint32_t)table & ~(PAGE_SIZE - 1));
+
+	list_for_each_entry(tp, tables, list)
+	{
+		if (tp->virt != page)
+			continue;
+		tp->used &= ~(1 << ((table - page) / TABLE_WORDS));
+		if (--tp->refcount == 0) {
+			list_remove(&tp->list);
+			kmem_free_pages(tp->virt, PAGE_SIZE);
+			kfree(tp);
+		} else {
+			memset(table, 0, TABLE_WORDS * sizeof(uint32_t));
+		}
+		return;
+	}
+}
+
 /**
- * Create a second-level table, given that it doesn't exist.
+ * Free every second-level table of a process, at once. Only for use when the
+ * process is being destroyed, since this doesn't touch its page tables.
  */
-static uint32_t *create_second(struct mem *mem, uint32_t first_idx)
+void umem_free_tables(struct process *p)
 {
-	uint32_t *second, second_phys;
+	struct table_page *tp, *next;
+
+	list_for_each_entry_safe(tp, next, &p->tables, list)
+	{
+		list_remove(&tp->list);
+		kmem_free_pages(tp->virt, PAGE_SIZE);
+		kfree(tp);
+	}
+}
+
+/**
+ * Allocate a second-level table without installing it. The caller fills it in
+ * and then calls install_second(). Return NULL if we're out of memory, which
+ * only happens for user memory.
+ */
+static uint32_t *alloc_second(struct mem *mem, uint32_t first_idx)
+{
+	uint32_t *second;
 	if (mem->strategy == STRAT_KERNEL) {
-		/* for kernel memory, we simply reset it to "mapped" and return
-		 * the proper second level location */
-		mem->base[first_idx] &= ~FLD_MASK;
-		mem->base[first_idx] |= FLD_COARSE;
+		/* kernel second-level tables are pre-allocated */
 		second = second_level_table + (first_idx * 1024);
 		init_second_level(second);
 	} else {
-		/* for user memory, we allocate a page (4KB rather than 1KB, so
-		 * TODO we're wasting memory) of physical memory, map it into
-		 * kernel space, and we use that as a second-level table. */
-		second = (uint32_t *)kmem_get_pages(0x1000, 0);
-		second_phys = kmem_lookup_phys(second);
+		/* for user memory, we take a 1KB slot of a page which is
+		 * mapped into kernel space, and is already clear */
+		second = table_alloc(mem->tables);
+		if (!second)
+			return NULL;
 		mem->shadow[first_idx] = second;
-		mem->base[first_idx] = second_phys | FLD_COARSE;
-		init_second_level(second);
 	}
 	return second;
 }
 
 /**
- * Release a second-level table, assuming it has been emptied of entries.
+ * Point a first-level descriptor at its second-level table. This is a single
+ * word write, so it's safe to replace a live section this way.
+ */
+static void install_second(struct mem *mem, uint32_t first_idx)
+{
+	uint32_t second_phys;
+	if (mem->strategy == STRAT_KERNEL)
+		second_phys = phys_second_level_table + (first_idx * 1024);
+	else
+		second_phys = kmem_lookup_phys(mem->shadow[first_idx]);
+	mem->base[first_idx] = second_phys | FLD_COARSE;
+}
+
+/**
+ * Create a second-level table, given that it doesn't exist.
+ */
+static uint32_t *create_second(struct mem *mem, uint32_t first_idx)
+{
+	uint32_t *second = alloc_second(mem, first_idx);
+	if (second)
+		install_second(mem, first_idx);
+	return second;
+}
+
+/**
+ * Release a second-level table or section, assuming its memory is no longer
+ * needed.
  */
 static void destroy_second(struct mem *mem, uint32_t first_idx)
 {
-	if (mem->strategy == STRAT_KERNEL) {
-		mem->base[first_idx] &= ~FLD_MASK;
-		mem->base[first_idx] |= FLD_UNMAPPED;
-	} else {
-		mem->base[first_idx] = 0;
-		kmem_free_pages(mem->shadow[first_idx], 0x1000);
+	/* also drops any walk cached through this entry */
+	tlb_add(mem, first_idx << 20);
+	mem->base[first_idx] = 0;
+	if (mem->strategy == STRAT_SHADOW && mem->shadow[first_idx]) {
+		table_free(mem->tables, mem->shadow[first_idx]);
 		mem->shadow[first_idx] = NULL;
 	}
 }
 
+/**
+ * Replace a section with a second-level table of small pages which map the
+ * same memory, so that part of it may be changed.
+ */
+static uint32_t *split_section(struct mem *mem, uint32_t first_idx)
+{
+	uint32_t i, *second;
+	uint32_t fld = mem->base[first_idx];
+	uint32_t phys = fld & top_n_bits(12);
+	uint32_t attrs = section_to_small(fld);
+
+	second = alloc_second(mem, first_idx);
+	if (!second)
+		return NULL; /* the section stays as it is */
+	for (i = 0; i < 256; i++)
+		second[i] = (phys + (i << 12)) | attrs | SLD_SMALL;
+	install_second(mem, first_idx);
+	tlb_add(mem, first_idx << 20);
+	return second;
+}
+
+/**
+ * Replace the large page containing second[idx] with 16 small pages.
+ */
+static void split_large(struct mem *mem, uint32_t *second, uint32_t first_idx,
+                        uint32_t idx)
+{
+	uint32_t i;
+	uint32_t group = idx & ~0xF;
+	uint32_t phys = second[group] & top_n_bits(16);
+	uint32_t attrs = large_to_small(second[group]);
+
+	for (i = 0; i < 16; i++)
+		second[group + i] = (phys + (i << 12)) | attrs | SLD_SMALL;
+	tlb_add(mem, (first_idx << 20) | (group << 12));
+}
+
+/**
+ * Return the second-level table for virt, creating it (or splitting a section)
+ * if necessary. Return NULL if we're out of memory.
+ */
+static uint32_t *need_second(struct mem *mem, uint32_t first_idx)
+{
+	switch (mem->base[first_idx] & FLD_MASK) {
+	case FLD_COARSE:
+		return get_second(mem, first_idx);
+	case FLD_SECTION:
+		return split_section(mem, first_idx);
+	default:
+		return create_second(mem, first_idx);
+	}
+}
+
 /**
  * Insert a mapping from a virtual to a physical page.
  *
  * virt: physical virtual address (should be page aligned)
  * phys: physical virtual address (should be page aligned)
  * attrs: access control attributes
+ * return: 0, or -ENOMEM if there's no memory for a second-level table
  */
-static void map_page(struct mem *mem, uint32_t virt, uint32_t phys,
-                     uint32_t attrs)
+static int map_page(struct mem *mem, uint32_t virt, uint32_t phys,
+                    uint32_t attrs)
 {
 	uint32_t *second;
 	uint32_t first_idx = virt >> 20;
 	uint32_t second_idx = (virt >> 12) & 0xFF;
 
-	if ((mem->base[first_idx] & FLD_MASK) != FLD_COARSE) {
-		second = create_second(mem, first_idx);
-	} else {
-		second = get_second(mem, first_idx);
-	}
+	second = need_second(mem, first_idx);
+	if (!second)
+		return -ENOMEM;
+	if ((second[second_idx] & SLD_MASK) == SLD_LARGE)
+		split_large(mem, second, first_idx, second_idx);
+	else if ((second[second_idx] & SLD_MASK) != SLD_UNMAPPED)
+		tlb_add(mem, virt);
 
 	if (mem->strategy == STRAT_SHADOW)
 		attrs |= SLD_NG;
 
 	second[second_idx] = (phys & 0xFFFFF000) | attrs | SLD_SMALL;
+	return 0;
 }
 
-void umem_map_page(struct process *p, uint32_t virt, uint32_t phys,
-                   uint32_t attrs)
+/**
+ * Map a 64KB large page. The 16 descriptors must currently be unmapped. Return
+ * 0, or -ENOMEM as for map_page().
+ */
+static int map_large(struct mem *mem, uint32_t virt, uint32_t phys,
+                     uint32_t attrs)
+{
+	uint32_t i, sld, *second;
+	uint32_t first_idx = virt >> 20;
+	uint32_t second_idx = (virt >> 12) & 0xF0;
+
+	second = need_second(mem, first_idx);
+	if (!second)
+		return -ENOMEM;
+
+	if (mem->strategy == STRAT_SHADOW)
+		attrs |= SLD_NG;
+
+	/* the architecture requires the descriptor to be repeated 16 times */
+	sld = (phys & top_n_bits(16)) | small_to_large(attrs) | SLD_LARGE;
+	for (i = 0; i < 16; i++)
+		second[second_idx + i] = sld;
+	return 0;
+}
+
+/**
+ * Map a 1MB section. The first-level descriptor must currently be unmapped.
+ */
+static void map_section(struct mem *mem, uint32_t virt, uint32_t phys,
+                        uint32_t attrs)
+{
+	if (mem->strategy == STRAT_SHADOW)
+		attrs |= SLD_NG;
+
+	mem->base[virt >> 20] =
+	        (phys & top_n_bits(12)) | small_to_section(attrs) | FLD_SECTION;
+}
+
+/**
+ * Return true if the 64KB at virt are unmapped, so that a large page may be
+ * placed there.
+ */
+static bool large_unmapped(struct mem *mem, uint32_t virt)
+{
+	uint32_t i, *second;
+	uint32_t first_idx = virt >> 20;
+	uint32_t second_idx = (virt >> 12) & 0xF0;
+
+	switch (mem->base[first_idx] & FLD_MASK) {
+	case FLD_UNMAPPED:
+		return true;
+	case FLD_COARSE:
+		second = get_second(mem, first_idx);
+		for (i = 0; i < 16; i++)
+			if ((second[second_idx + i] & SLD_MASK) != SLD_UNMAPPED)
+				return false;
+		return true;
+	default:
+		return false;
+	}
+}
+
+/**
+ * Map a range using the largest descriptors which alignment and length allow.
+ *
+ * We only use sections and large pages for memory which isn't mapped yet. Any
+ * existing mapping may be live (e.g. the kernel image, when kmem_init() sets
+ * its permissions), and replacing small pages with a larger descriptor would
+ * need a break-before-make sequence that live code can't tolerate.
+ *
+ * Return 0, or -ENOMEM if we ran out of memory for page tables, in which case
+ * only part of the range may be mapped.
+ */
+static int map_range(struct mem *mem, uint32_t virt, uint32_t phys,
+                     uint32_t len, uint32_t attrs)
+{
+	uint32_t step;
+	int rv = 0;
+
+	tlb_begin(mem);
+	while (len && !rv) {
+		if (!((virt | phys) & bot_n_bits(20)) && len >= (1 << 20) &&
+		    (mem->base[virt >> 20] & FLD_MASK) == FLD_UNMAPPED) {
+			map_section(mem, virt, phys, attrs);
+			step = 1 << 20;
+		} else if (!((virt | phys) & bot_n_bits(16)) &&
+		           len >= (1 << 16) && large_unmapped(mem, virt)) {
+			rv = map_large(mem, virt, phys, attrs);
+			step = 1 << 16;
+		} else {
+			rv = map_page(mem, virt, phys, attrs);
+			step = 1 << 12;
+		}
+		virt += step;
+		phys += step;
+		len = len > step ? len - step : 0;
+	}
+	tlb_flush(mem);
+	return rv;
+}
+
+int umem_map_page(struct process *p, uint32_t virt, uint32_t phys,
+                  uint32_t attrs)
 {
 	struct mem mem;
+	int rv;
 	mem.base = p->first;
 	mem.shadow = p->shadow;
+	mem.tables = &p->tables;
+	mem.asid = p->asid;
 	mem.strategy = STRAT_SHADOW;
-	map_page(&mem, virt, phys, attrs);
+	tlb_begin(&mem);
+	rv = map_page(&mem, virt, phys, attrs);
+	tlb_flush(&mem);
+	return rv;
 }
 
 void kmem_map_page(uint32_t virt, uint32_t phys, uint32_t attrs)
@@ -175,7 +599,9 @@ void kmem_map_page(uint32_t virt, uint32_t phys, uint32_t attrs)
 	struct mem mem;
 	mem.base = first_level_table;
 	mem.strategy = STRAT_KERNEL;
+	tlb_begin(&mem);
 	map_page(&mem, virt, phys, attrs);
+	tlb_flush(&mem);
 }
 
 /**
@@ -186,16 +612,26 @@ static uint32_t lookup_phys(struct mem *mem, void *virt_ptr)
 	uint32_t virt = (uint32_t)virt_ptr;
 	uint32_t first_idx = virt >> 20;
 	uint32_t second_idx = (virt >> 12) & 0xFF;
-	uint32_t *second = get_second(mem, first_idx);
+	uint32_t fld = mem->base[first_idx];
+	uint32_t *second;
+
+	if ((fld & FLD_MASK) == FLD_SECTION)
+		return (fld & top_n_bits(12)) | (virt & bot_n_bits(20));
 
+	second = get_second(mem, first_idx);
 	if (!second)
 		return 0;
 
-	if ((second[second_idx] & SLD_MASK) == SLD_UNMAPPED)
+	switch (second[second_idx] & SLD_MASK) {
+	case SLD_UNMAPPED:
 		return 0;
-
-	return ((second[second_idx] & top_n_bits(20)) |
-	        (virt & bot_n_bits(12)));
+	case SLD_LARGE:
+		return ((second[second_idx] & top_n_bits(16)) |
+		        (virt & bot_n_bits(16)));
+	default:
+		return ((second[second_idx] & top_n_bits(20)) |
+		        (virt & bot_n_bits(12)));
+	}
 }
 
 uint32_t umem_lookup_phys(struct process *p, void *virt_ptr)
@@ -203,6 +639,7 @@ uint32_t umem_lookup_phys(struct process *p, void *virt_ptr)
 	struct mem mem;
 	mem.base = p->first;
 	mem.shadow = p->shadow;
+	mem.tables = &p->tables;
 	mem.strategy = STRAT_SHADOW;
 	return lookup_phys(&mem, virt_ptr);
 }
@@ -210,6 +647,8 @@ uint32_t umem_lookup_phys(struct process *p, void *virt_ptr)
 uint32_t kmem_lookup_phys(void *virt_ptr)
 {
 	struct mem mem;
+	if (kmem_linear(virt_ptr))
+		return (uint32_t)virt_ptr - LINEAR_BASE + linear_phys;
 	mem.base = first_level_table;
 	mem.strategy = STRAT_KERNEL;
 	return lookup_phys(&mem, virt_ptr);
@@ -217,25 +656,43 @@ uint32_t kmem_lookup_phys(void *virt_ptr)
 
 void kmem_map_pages(uint32_t virt, uint32_t phys, uint32_t len, uint32_t attrs)
 {
-	uint32_t i;
-	for (i = 0; i < len; i += 4096)
-		kmem_map_page(virt + i, phys + i, attrs);
+	struct mem mem;
+	mem.base = first_level_table;
+	mem.strategy = STRAT_KERNEL;
+	map_range(&mem, virt, phys, len, attrs);
 }
 
-void umem_map_pages(struct process *p, uint32_t virt, uint32_t phys,
-                    uint32_t len, uint32_t attrs)
+int umem_map_pages(struct process *p, uint32_t virt, uint32_t phys,
+                   uint32_t len, uint32_t attrs)
 {
-	uint32_t i;
-	for (i = 0; i < len; i += 4096)
-		umem_map_page(p, virt + i, phys + i, attrs);
+	struct mem mem;
+	mem.base = p->first;
+	mem.shadow = p->shadow;
+	mem.tables = &p->tables;
+	mem.asid = p->asid;
+	mem.strategy = STRAT_SHADOW;
+	return map_range(&mem, virt, phys, len, attrs);
 }
 
-static bool unmap_second(uint32_t *second, uint32_t start, uint32_t len)
+/**
+ * Unmap len bytes from start within a single second-level table, splitting
+ * large pages which straddle either end. Return true if the table is now empty.
+ */
+static bool unmap_second(struct mem *mem, uint32_t *second, uint32_t start,
+                         uint32_t len)
 {
 	uint32_t i;
+	uint32_t first_idx = start >> 20;
 	uint32_t base = (start >> 12) & 0xFF;
-	uint32_t num_descriptors = (len >> 12) & 0xFF;
-	for (i = base; i < base + num_descriptors; i++) {
+	uint32_t end = base + (len >> 12);
+
+	if ((base & 0xF) && (second[base] & SLD_MASK) == SLD_LARGE)
+		split_large(mem, second, first_idx, base);
+	if (end < 256 && (end & 0xF) && (second[end] & SLD_MASK) == SLD_LARGE)
+		split_large(mem, second, first_idx, end);
+
+	tlb_add_second(mem, second, first_idx, base, end);
+	for (i = base; i < end; i++) {
 		second[i] = 0;
 	}
 
@@ -250,56 +707,49 @@ static bool unmap_second(uint32_t *second, uint32_t start, uint32_t len)
 }
 
 /**
- * Unmap pages beginning at start, for a total length of len.
+ * Unmap pages beginning at start, for a total length of len. We go one 1MB
+ * block at a time: whole blocks simply lose their section or second-level
+ * table, while partial blocks are unmapped within their second-level table
+ * (which we create by splitting a section if necessary).
  */
 static void unmap_pages(struct mem *mem, uint32_t start, uint32_t len)
 {
-	/*
-	 * First, unmap any second level descriptors before the first 1MB
-	 * boundary, if there are any.
-	 */
-	if (start & bot_n_bits(20)) {
-		uint32_t first_idx = start >> 20;
-		uint32_t to_unmap;
-		uint32_t next_mb = (start & top_n_bits(12)) + (1 << 20);
-		uint32_t *second = get_second(mem, first_idx);
-		;
-		if (next_mb - start < len)
-			to_unmap = next_mb - start;
-		else
+	uint32_t idx, to_unmap, *second;
+
+	tlb_begin(mem);
+	while (len) {
+		idx = start >> 20;
+		to_unmap = (1 << 20) - (start & bot_n_bits(20));
+		if (to_unmap > len)
 			to_unmap = len;
-		if (unmap_second(second, start, to_unmap)) {
-			destroy_second(mem, first_idx);
-		}
-		len -= to_unmap;
-		start = next_mb;
-	}
 
-	/*
-	 * Next, unmap all 1MB regions, if there are any. We erase their
-	 * second-level tables too, for safety, but it's not really necessary,
-	 * because kmem_map_pages() will erase them when in re-maps a 1MB block.
-	 */
-	while (len > 0x00100000) {
-		uint32_t idx = start >> 20;
-		if ((mem->base[idx] & FLD_MASK) != FLD_UNMAPPED) {
-			destroy_second(mem, idx);
+		switch (mem->base[idx] & FLD_MASK) {
+		case FLD_SECTION:
+			if (to_unmap == (1 << 20)) {
+				destroy_second(mem, idx);
+				break;
+			}
+			second = split_section(mem, idx);
+			if (unmap_second(mem, second, start, to_unmap))
+				destroy_second(mem, idx);
+			break;
+		case FLD_COARSE:
+			second = get_second(mem, idx);
+			if (to_unmap == (1 << 20)) {
+				tlb_add_second(mem, second, idx, 0, 256);
+				destroy_second(mem, idx);
+			} else if (unmap_second(mem, second, start, to_unmap)) {
+				destroy_second(mem, idx);
+			}
+			break;
+		default:
+			break;
 		}
-		len -= 1 << 20;
-		start += 1 << 20;
-	}
 
-	/*
-	 * Finally, unmap any second-level descriptors after the last 1MB block,
-	 * if there are any.
-	 */
-	if (len) {
-		uint32_t first_idx = start >> 20;
-		uint32_t *second = get_second(mem, first_idx);
-		if (unmap_second(second, start, len)) {
-			destroy_second(mem, first_idx);
-		}
+		len -= to_unmap;
+		start += to_unmap;
 	}
+	tlb_flush(mem);
 }
 
 void umem_unmap_pages(struct process *p, uint32_t virt, uint32_t len)
@@ -307,6 +757,8 @@ void umem_unmap_pages(struct process *p, uint32_t virt, uint32_t len)
 	struct mem mem;
 	mem.base = p->first;
 	mem.shadow = p->shadow;
+	mem.tables = &p->tables;
+	mem.asid = p->asid;
 	mem.strategy = STRAT_SHADOW;
 	unmap_pages(&mem, virt, len);
 }
@@ -326,19 +778,29 @@ void kmem_unmap_pages(uint32_t virt, uint32_t len)
  * end: last virtual address to print entries for (may be outside of range)
  *
  * For start and end, we really only care about the middle bits that determine
- * which second level descriptor to use.
+ * which second level descriptor to use. Large pages are printed once, at the
+ * first of their 16 descriptors in the range.
  */
 static void print_second_level(uint32_t *second, uint32_t start, uint32_t end)
 {
 	uint32_t virt_base = start & top_n_bits(12);
 	uint32_t i = (start >> 12) & 0xFF;
+	uint32_t attrs;
 
 	while (start < end && i < 256) {
 		switch (second[i] & SLD_MASK) {
 		case SLD_LARGE:
-			printf("\t0x%x: 0x%x (large)\n", virt_base + (i << 12),
-			       second[i] & top_n_bits(16));
-			break;
+			attrs = large_to_small(second[i]);
+			printf("\t0x%x: 0x%x (large), xn=%u, tex=%u, ap=%u, "
+			       "apx=%u, ng=%u\n",
+			       virt_base + (i << 12),
+			       second[i] & top_n_bits(16), attrs & 0x1,
+			       (attrs >> 6) & 0x7, (attrs >> 4) & 0x3,
+			       (attrs & (1 << 9)) ? 1 : 0,
+			       (attrs & SLD_NG) ? 1 : 0);
+			i = (i | 0xF) + 1;
+			start = virt_base | (i << 12);
+			continue;
 		case 0x3:
 		case SLD_SMALL:
 			printf("\t0x%x: 0x%x (small), xn=%u, tex=%u, ap=%u, "
@@ -361,13 +823,18 @@ static void print_first_level(struct mem *mem, uint32_t start, uint32_t stop)
 {
 	uint32_t i = start >> 20;
 	uint32_t stop_idx = stop >> 20;
-	uint32_t *second;
+	uint32_t *second, attrs;
 	while (i <= stop_idx) {
 		switch (mem->base[i] & FLD_MASK) {
 		case FLD_SECTION:
-			printf("0x%x: SECTION 0x%x, domain=%u\n", i << 20,
-			       mem->base[i] & top_n_bits(10),
-			       (mem->base[i] >> 5) & 0xF);
+			attrs = section_to_small(mem->base[i]);
+			printf("0x%x: SECTION 0x%x, domain=%u, xn=%u, tex=%u, "
+			       "ap=%u, apx=%u, ng=%u\n",
+			       i << 20, mem->base[i] & top_n_bits(12),
+			       (mem->base[i] >> 5) & 0xF, attrs & 0x1,
+			       (attrs >> 6) & 0x7, (attrs >> 4) & 0x3,
+			       (attrs & (1 << 9)) ? 1 : 0,
+			       (attrs & SLD_NG) ? 1 : 0);
 			break;
 		case FLD_COARSE:
 			second = get_second(mem, i);
@@ -399,23 +866,59 @@ void umem_print(struct process *p, uint32_t start, uint32_t stop)
 	struct mem mem;
 	mem.base = p->first;
 	mem.shadow = p->shadow;
+	mem.tables = &p->tables;
 	mem.strategy = STRAT_SHADOW;
 	print_first_level(&mem, start, stop);
 }
 
 /**
- * Get mapped pages. That is, allocate some physical memory, allocate some
- * virtual memory, and map the virtual to the physical and return it.
+ * Get pages of kernel memory. They come straight from the physical allocator,
+ * and we return their address within the linear map.
  * bytes: count of bytes to allocate (increments of 4096 bytes)
- * align: alignment (only applied to the virtual address allocation)
+ * align: alignment, as for alloc_pages()
+ * return: NULL if out of memory
  */
 void *kmem_get_pages(uint32_t bytes, uint32_t align)
 {
-	void *virt = (void *)alloc_pages(kern_virt_allocator, bytes, align);
-	uint32_t phys = alloc_pages(phys_allocator, bytes, 0);
-	kmem_map_pages((uint32_t)virt, phys, bytes,
-	               KMEM_ATTR_DEFAULT | KMEM_PERM_DATA);
-	return virt;
+	uint32_t phys = alloc_pages(phys_allocator, bytes, align);
+	if (!phys)
+		return NULL;
+	return kmem_phys_to_virt(phys);
+}
+
+/**
+ * Get pages mapped uncached, outside of the linear map, for memory shared with
+ * devices. Free them with kmem_free_pages().
+ * bytes: count of bytes to allocate (increments of 4096 bytes)
+ * align: alignment of the virtual address, as for alloc_pages()
+ * return: NULL if out of memory
+ *
+ * The physical allocation is aligned to its size, so we align large virtual
+ * allocations to match, which lets kmem_map_pages() use sections and large
+ * pages for them.
+ */
+void *kmem_get_uncached_pages(uint32_t bytes, uint32_t align)
+{
+	uint32_t virt, phys;
+
+	if (bytes >= (1 << 20))
+		align = max(align, 20);
+	else if (bytes >= (1 << 16))
+		align = max(align, 16);
+
+	phys = alloc_pages(phys_allocator, bytes, 0);
+	if (!phys)
+		return NULL;
+	virt = vmem_alloc(kern_virt_allocator, bytes, align);
+	if (!virt) {
+		free_pages(phys_allocator, phys, bytes);
+		return NULL;
+	}
+
+	/* the linear map aliases these pages: leave nothing of them cached */
+	dcache_clean_inval_range(kmem_phys_to_virt(phys), bytes);
+	kmem_map_pages(virt, phys, bytes, KMEM_ATTR_UNCACHED | KMEM_PERM_DATA);
+	return (void *)virt;
 }
 
 /**
@@ -427,11 +930,52 @@ void *kmem_get_page(void)
 }
 
 /**
- * Free memory which was allocated via kmem_get_pages(). This involves:
+ * Slab pages are 2^order pages, aligned to their size
+ */
+void *kmem_get_slab_pages(unsigned int order)
+{
+	return kmem_get_pages(PAGE_SIZE << order, PAGE_BITS + order);
+}
+
+/**
+ * Slab pages mapped uncached, for small structures shared with devices, which
+ * would otherwise share cache lines with their neighbours. Like all slab pages,
+ * they're aligned to their size. Free them with kmem_free_slab_pages().
+ */
+void *kmem_get_uncached_slab_pages(unsigned int order)
+{
+	return kmem_get_uncached_pages(PAGE_SIZE << order, PAGE_BITS + order);
+}
+
+/**
+ * Node allocation for vmem allocators.
+ */
+void *kmem_vmem_node_alloc(void)
+{
+	return kmalloc(sizeof(struct vmem_node));
+}
+
+void kmem_vmem_node_free(void *ptr)
+{
+	kfree(ptr);
+}
+
+static void *kern_vmem_node_alloc(void)
+{
+	if (kern_vmem_boot_used < nelem(kern_vmem_boot))
+		return &kern_vmem_boot[kern_vmem_boot_used++];
+	return kmem_vmem_node_alloc();
+}
+
+/**
+ * Free memory which was allocated via kmem_get_pages() or
+ * kmem_get_uncached_pages(). Linear map memory only goes back to the physical
+ * allocator. Otherwise:
  * 1. Determine the physical address, we can do this via a software page table
  *    walk.
- * 2. Free the memory segments from the physical and virtual allocators.
- * 3. Unmap the virtual memory range.
+ * 2. Unmap the virtual memory range, and invalidate it in the TLB.
+ * 3. Free the memory segments from the physical and virtual allocators. This
+ *    must come last, so nobody can reuse them while stale entries remain.
  *
  * virt_ptr: virtual address pointer (must be page aligned)
  * len: length (must be page aligned)
@@ -441,10 +985,15 @@ void kmem_free_pages(void *virt_ptr, uint32_t len)
 	uint32_t phys = kmem_lookup_phys(virt_ptr);
 	uint32_t virt = (uint32_t)virt_ptr;
 
-	free_pages(phys_allocator, phys, len);
-	free_pages(kern_virt_allocator, virt, len);
+	if (kmem_linear(virt_ptr)) {
+		free_pages(phys_allocator, phys, len);
+		return;
+	}
 
 	kmem_unmap_pages(virt, len);
+
+	free_pages(phys_allocator, phys, len);
+	vmem_free(kern_virt_allocator, virt, len);
 }
 
 void kmem_free_page(void *ptr)
@@ -452,6 +1001,11 @@ void kmem_free_page(void *ptr)
 	kmem_free_pages(ptr, 4096);
 }
 
+void kmem_free_slab_pages(void *ptr, unsigned int order)
+{
+	kmem_free_pages(ptr, PAGE_SIZE << order);
+}
+
 void kmem_init(uint32_t phys)
 {
 	uint32_t alloc_so_far, cpreg;
@@ -478,16 +1032,40 @@ void kmem_init(uint32_t phys)
 	 * (b) Kernel virtual memory allocator
 	 */
 	phys_allocator = dynamic;
-	kern_virt_allocator = dynamic + 0x1000;
-	kmem_map_pages((uint32_t)dynamic, phys_dynamic, 0x2000,
+	kern_virt_allocator = &kern_vmem;
+	kmem_map_pages((uint32_t)dynamic, phys_dynamic, 0x1000,
 	               KMEM_ATTR_DEFAULT | KMEM_PERM_DATA);
 
-	alloc_so_far = phys_dynamic - phys_code_start + 0x2000;
-	init_page_allocator(phys_allocator, phys_code_start, 0xFFFFFFFF);
+	linear_phys = phys_code_start & top_n_bits(12);
+	linear_size = min(CONFIG_RAM_SIZE, LINEAR_MAX);
+	alloc_so_far = phys_dynamic - phys_code_start + 0x1000;
+	init_page_allocator(phys_allocator, phys_code_start,
+	                    linear_phys + linear_size);
 	mark_alloc(phys_allocator, phys_code_start, alloc_so_far);
-	init_page_allocator(kern_virt_allocator, (uint32_t)code_start,
-	                    0x3FFFFFFF);
-	mark_alloc(kern_virt_allocator, (uint32_t)code_start, alloc_so_far);
+	vmem_init(kern_virt_allocator, (uint32_t)code_start, KERN_VIRT_END,
+	          kern_vmem_node_alloc, NULL);
+	vmem_mark_alloc(kern_virt_allocator, (uint32_t)code_start, alloc_so_far);
+
+	/*
+	 * Map all of RAM at LINEAR_BASE. It's 1MB aligned at both ends, and
+	 * nothing is mapped there yet, so this is all sections. If the range
+	 * weren't reserved, vmem_alloc() could hand out addresses within it,
+	 * and mapping those would clobber the sections.
+	 */
+	if (!vmem_mark_alloc(kern_virt_allocator, LINEAR_BASE, linear_size)) {
+		puts("kmem: can't reserve the linear map\n");
+		panic(NULL);
+	}
+	kmem_map_pages(LINEAR_BASE, linear_phys, linear_size,
+	               KMEM_ATTR_DEFAULT | KMEM_PERM_DATA);
+
+	/*
+	 * The physical allocator needs more bookkeeping as memory fragments.
+	 * Now that it can hand out mapped pages, it gets it from kmem_get_page().
+	 * These pages are never returned, but the allocator reuses them as
+	 * memory coalesces.
+	 */
+	page_allocator_set_getter(phys_allocator, kmem_get_page);
 
 	/*
 	 * Here we unmap the old physical code locations, and the old UART
@@ -517,12 +1095,12 @@ void kmem_init(uint32_t phys)
 	 * Setup stacks for other modes, and map the first code page at 0x00 so
 	 * we can handle exceptions.
 	 */
-	stack = kmem_get_pages(8192, 0);
+	stack = kmem_get_pages(12288, 0);
 	setup_stacks(stack); /* asm; sets the stacks in each mode */
 	fiq_stack = stack + 1 * 1024;
-	abrt_stack = stack + 2 * 1024;
-	undf_stack = stack + 3 * 1024;
-	irq_stack = stack + 8 * 1024;
+	abrt_stack = stack + 5 * 1024;
+	undf_stack = stack + 6 * 1024;
+	irq_stack = stack + 12 * 1024;
 	svc_stack = &stack_end;
 
 	/* This may be a no-op, but let's map the interrupt vector at 0x0 */
@@ -550,14 +1128,20 @@ void kmem_init(uint32_t phys)
 	           0x3000);
 	free_pages(phys_allocator,
 	           (uint32_t)phys_second_level_table + 0x00100000, 0x00300000);
-	free_pages(kern_virt_allocator, (uint32_t)first_level_table + 0x1000,
+	vmem_free(kern_virt_allocator, (uint32_t)first_level_table + 0x1000,
 	           0x3000);
-	free_pages(kern_virt_allocator,
+	vmem_free(kern_virt_allocator,
 	           (uint32_t)second_level_table + 0x00100000, 0x00300000);
 
 	/* Set TTBCR to determine the 1/3 user kernel split */
 	cpreg = 2;
 	set_cpreg(cpreg, c2, 0, c0, 2);
+
+	/* Walk the kernel tables through the caches, once they are enabled */
+	get_cpreg(cpreg, c2, 0, c0, 0);
+	cpreg |= TTBR_WALK_ATTRS;
+	set_cpreg(cpreg, c2, 0, c0, 0);
+	isb();
 }
 
 uint32_t kmem_remap_periph(uint32_t addr)
@@ -565,8 +1149,103 @@ uint32_t kmem_remap_periph(uint32_t addr)
 	uint32_t new_addr;
 	uint32_t offset = addr & 0xFFF;
 	addr &= 0xFFFFF000;
-	new_addr = alloc_pages(kern_virt_allocator, 0x1000, 0);
+	new_addr = vmem_alloc(kern_virt_allocator, 0x1000, 0);
 	kmem_map_pages(new_addr, addr, 0x1000,
 	               PRW_UNA | EXECUTE_NEVER | DEVICE_SHAREABLE);
 	return new_addr | offset;
 }
+
+/*
+ * Map len bytes of phys at a fresh virtual address which is deliberately one
+ * page off of a 1MB boundary, so that only small pages can be used.
+ */
+static void *map_small_alias(uint32_t phys, uint32_t len)
+{
+	uint32_t virt = vmem_alloc(kern_virt_allocator, len + PAGE_SIZE, 20);
+	if (!virt)
+		return NULL;
+	virt += PAGE_SIZE;
+	kmem_map_pages(virt, phys, len, KMEM_ATTR_DEFAULT | KMEM_PERM_DATA);
+	return (void *)virt;
+}
+
+static void unmap_small_alias(void *virt, uint32_t len)
+{
+	kmem_unmap_pages((uint32_t)virt, len);
+	vmem_free(kern_virt_allocator, (uint32_t)virt - PAGE_SIZE,
+	          len + PAGE_SIZE);
+}
+
+static uint32_t time_memcpy(void *dst, void *src, uint32_t len, int reps)
+{
+	uint32_t start = get_cycles();
+	for (int i = 0; i < reps; i++)
+		memcpy(dst, src, len);
+	return get_cycles() - start;
+}
+
+/*
+ * Copy a large buffer in the dynamic region, once through the section mapping
+ * kmem_get_pages() gives us, and once through a small page alias of the same
+ * memory. The difference is mostly TLB misses.
+ */
+static int cmd_mem_bench(int argc, char **argv)
+{
+	uint32_t mb = 2, len, big, small;
+	int reps = 4, rv = 1;
+	void *src, *dst, *src_alias, *dst_alias;
+
+	if (argc > 1) {
+		puts("usage: mem bench [MEGABYTES]\n");
+		return 1;
+	}
+	if (argc == 1)
+		mb = atoi(argv[0]);
+	if (mb == 0 || mb > 16) {
+		puts("mem bench: size must be 1-16 MB\n");
+		return 1;
+	}
+	len = mb << 20;
+
+	if (!(src = kmem_get_pages(len, 0)))
+		goto out;
+	if (!(dst = kmem_get_pages(len, 0)))
+		goto free_src;
+	if (!(src_alias = map_small_alias(kmem_lookup_phys(src), len)))
+		goto free_dst;
+	if (!(dst_alias = map_small_alias(kmem_lookup_phys(dst), len)))
+		goto unmap_src;
+	memset(src, 0x5a, len);
+
+	/* warm up, then measure each mapping */
+	time_memcpy(dst, src, len, 1);
+	big = time_memcpy(dst, src, len, reps);
+	time_memcpy(dst_alias, src_alias, len, 1);
+	small = time_memcpy(dst_alias, src_alias, len, reps);
+
+	printf("memcpy %u MB x%d: sections %u cycles (%u/KB), "
+	       "small pages %u cycles (%u/KB)\n",
+	       mb, reps, big, big / (reps * (len >> 10)), small,
+	       small / (reps * (len >> 10)));
+
+	unmap_small_alias(dst_alias, len);
+	rv = 0;
+unmap_src:
+	unmap_small_alias(src_alias, len);
+free_dst:
+	kmem_free_pages(dst, len);
+free_src:
+	kmem_free_pages(src, len);
+out:
+	if (rv)
+		puts("mem bench: out of memory\n");
+	return rv;
+}
+
+struct ksh_cmd mem_ksh_cmds[] = {
+	KSH_CMD("bench", cmd_mem_bench, "time memcpy with sections vs pages"),
+	KSH_CMD("zeropool", zero_pool_cmd_status, "show pre-zeroed page pools"),
+	KSH_CMD("reclaim", reclaim_cmd_status,
+	        "show watermarks and shrinkers, or reclaim PAGES"),
+	{ 0 },
+};
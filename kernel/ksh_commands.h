@@ -7,6 +7,7 @@ extern struct ksh_cmd proc_ksh_cmds[];
 extern struct ksh_cmd fat_ksh_cmds[];
 extern struct ksh_cmd sync_ksh_cmds[];
 extern struct ksh_cmd fs_ksh_cmds[];
+extern struct ksh_cmd mem_ksh_cmds[];
 
 #define KSH_SUB_COMMANDS                                                       \
 	KSH_SUB("blk", blk_ksh_cmds, "block commands"),                        \
@@ -15,4 +16,5 @@ extern struct ksh_cmd fs_ksh_cmds[];
 	        KSH_SUB("proc", proc_ksh_cmds, "process commands"),            \
 	        KSH_SUB("fat", fat_ksh_cmds, "FAT commands"),                  \
 	        KSH_SUB("sync", sync_ksh_cmds, "synchronization commands"),    \
-	        KSH_SUB("fs", fs_ksh_cmds, "file system commands"),
+	        KSH_SUB("fs", fs_ksh_cmds, "file system commands"),            \
+	        KSH_SUB("mem", mem_ksh_cmds, "memory commands"),
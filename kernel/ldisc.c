@@ -21,7 +21,7 @@ static inline void flip_add(struct flip_file *ff, struct flip_buffer *b)
 		list_insert_end(&ff->buflist, &b->list);
 	} else {
 		ff->current = b;
-		wait_list_awaken(&ff->wait);
+		wake_all(&ff->wait);
 	}
 	_spin_release(&ff->lock);
 }
@@ -54,11 +54,7 @@ static struct flip_buffer *flip_get_buffer(struct flip_file *ff)
 {
 	struct flip_buffer *rv;
 
-	while (!(rv = flip_maybe_get_buffer(ff))) {
-		wait_for(&ff->wait);
-		wait_list_init(&ff->wait);
-	}
-
+	wait_event(&ff->wait, (rv = flip_maybe_get_buffer(ff)) != NULL);
 	return rv;
 }
 
@@ -74,8 +70,8 @@ struct flip_buffer *flip_buffer_new(void)
 
 void flip_buffer_free(struct flip_buffer *fb)
 {
-	kfree(fb->buf, LLE_INIT_BUF);
-	kfree(fb, sizeof(*fb));
+	kfree(fb->buf);
+	kfree(fb);
 }
 
 static int flip_read(struct file *f, void *dst, size_t amt)
@@ -49,8 +49,10 @@ void main(uint32_t phys)
 	kmem_init(phys);
 	uart_remap();
 	puts(" started!\n");
+	cycle_counter_init();
 	board_init();
 	kmalloc_init();
+	reclaim_init();
 	process_init();
 	dtb_init(0x44000000); /* TODO: pass this addr from startup.s */
 	gic_init();
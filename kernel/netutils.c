@@ -37,17 +37,40 @@ uint16_t csum_finalize(uint32_t *csum)
 	return ~((uint16_t)*csum);
 }
 
+/**
+ * Reset the packet metadata. The data area is left alone: whoever fills in a
+ * packet is responsible for every header field they send.
+ */
+static void packet_ctor(void *obj)
+{
+	struct packet *pkt = obj;
+	pkt->ll = NULL;
+	pkt->nl = NULL;
+	pkt->tl = NULL;
+	pkt->al = NULL;
+	pkt->end = NULL;
+	pkt->list.next = NULL;
+	pkt->list.prev = NULL;
+	pkt->capacity = PACKET_CAPACITY;
+}
+
 void packet_init(void)
 {
-	pktslab = slab_new("packet", PACKET_SIZE, kmem_get_page);
+	pktslab = slab_new_ctor("packet", PACKET_SIZE, SLAB_ORDER_AUTO,
+	                        kmem_get_slab_pages, kmem_free_slab_pages,
+	                        packet_ctor, NULL);
+	/* packets are allocated and freed by virtio_net_isr() too */
+	slab_enable_magazines(pktslab);
 }
 
 struct packet *packet_alloc(void)
 {
-	struct packet *pkt = (struct packet *)slab_alloc(pktslab);
-	memset(pkt, 0, PACKET_SIZE);
-	pkt->capacity = PACKET_CAPACITY;
-	return pkt;
+	return (struct packet *)slab_alloc(pktslab);
+}
+
+unsigned int packet_alloc_bulk(struct packet **pkts, unsigned int n)
+{
+	return slab_alloc_bulk(pktslab, (void **)pkts, n);
 }
 
 void packet_free(struct packet *pkt)
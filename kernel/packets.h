@@ -162,6 +162,7 @@ struct packet {
 };
 
 struct packet *packet_alloc(void);
+unsigned int packet_alloc_bulk(struct packet **pkts, unsigned int n);
 void packet_free(struct packet *pkt);
 #define PACKET_SIZE     2048
 #define PACKET_CAPACITY (PACKET_SIZE - sizeof(struct packet))
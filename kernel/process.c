@@ -1,6 +1,7 @@
 /*
  * Routines for dealing with processes.
  */
+#include "asid.h"
 #include "cxtk.h"
 #include "kernel.h"
 #include "ksh.h"
@@ -10,10 +11,15 @@
 #include "wait.h"
 
 struct list_head process_list;
+static struct list_head ready_queues[SCHED_LEVELS];
+static uint32_t ready_levels; /* bit n is set while level n has processes */
+static bool need_resched;
+static uint32_t boost_ticks;
 struct process *current = NULL;
 struct slab *proc_slab;
 static uint32_t pid = 1;
 struct process *idle_process = NULL;
+static struct asid_allocator asids;
 
 bool preempt_enabled = true;
 const char nopreempt_begin;
@@ -25,6 +31,17 @@ struct static_binary {
 	void *start;
 	void *end;
 	char *name;
+	struct umem_shared image; /* shared by every process running it */
+};
+
+/*
+ * Each binary begins with this (see user/startup.s). Everything before
+ * data_start is text, which all processes share read-only. Data is shared
+ * copy-on-write.
+ */
+struct image_header {
+	uint32_t branch;
+	uint32_t data_start;
 };
 
 struct static_binary binaries[] = {
@@ -58,96 +75,108 @@ bool timer_can_reschedule(struct ctx *ctx)
 }
 
 /**
- * Create a process.
- *
- * The returned process resides in the current address space, and has a stack of
- * 4096 bytes (minus the space reserved for the process struct itself). You can
- * take this process and either start it using start_process(), or context
- * switch it in later.
+ * Create an empty user address space for p: a virtual memory allocator, and
+ * the page tables. The ASID is allocated when p is first switched to.
  */
-struct process *create_process(uint32_t binary)
+static void address_space_init(struct process *p)
 {
-	uint32_t size, phys, i, *dst, *src, virt;
-	struct process *p = slab_alloc(proc_slab);
+	/*
+	 * Create an allocator for the user virtual memory space
+	 */
+	vmem_init(&p->vmem, 0x40000000, 0xFFFFFFFF, kmem_vmem_node_alloc,
+	          kmem_vmem_node_free);
 
 	/*
-	 * Allocate a kernel stack.
+	 * Allocate the first-level table and a shadow table (for virtual
+	 * addresses of second-level tables). The first-level table must be
+	 * physically 16KB aligned, which the linear map preserves.
 	 */
-	p->kstack = (void *)kmem_get_pages(4096, 0) + 4096;
+	p->first = alloc_zeroed_pages(0x8000, 14);
+	p->shadow = (void *)p->first + 0x4000;
+	p->ttbr1 = kmem_lookup_phys(p->first) | TTBR_WALK_ATTRS;
+	p->asid = 0;
+	INIT_LIST_HEAD(p->tables);
+	INIT_LIST_HEAD(p->regions);
+	p->resident = 0;
+	p->shared_resident = 0;
+}
 
+/**
+ * Free the page tables and virtual memory allocator of a user address space.
+ * Memory mapped into it must be freed separately. Its ASID isn't freed, since
+ * the TLB may still hold entries for it (see lib/asid.h).
+ */
+static void address_space_destroy(struct process *p)
+{
 	/*
-	 * Determine the size of the "process image" rounded to a whole page
+	 * Free the process's virtual memory allocator.
 	 */
-	size = (
-	        /* subtract start from end */
-	        (uint32_t)binaries[binary].end -
-	        (uint32_t)binaries[binary].start
-	        /* object file doesn't include stack space, so we assume 8 bytes
-	         * of alignment and a page of stack */
-	        + 0x1000 + 8);
-	size = ((size >> PAGE_BITS) + 1) << PAGE_BITS;
+	vmem_destroy(&p->vmem);
 
 	/*
-	 * Create an allocator for the user virtual memory space
+	 * Free the second-level page tables too!
 	 */
-	p->vmem_allocator = kmem_get_pages(0x1000, 0);
-	init_page_allocator(p->vmem_allocator, 0x40000000, 0xFFFFFFFF);
+	umem_free_tables(p);
 
 	/*
-	 * Allocate the first-level table and a shadow table (for virtual
-	 * addresses of second-level tables). Since we require physical address
-	 * which is aligned (not virtual), need to do it manually.
+	 * Free the first-level table + shadow table
 	 */
-	phys = alloc_pages(phys_allocator, 0x8000, 14);
-	virt = alloc_pages(kern_virt_allocator, 0x8000, 0);
-	kmem_map_pages(virt, phys, 0x8000, KMEM_ATTR_DEFAULT | KMEM_PERM_DATA);
-	p->first = (uint32_t *)virt;
-	p->shadow = (void *)p->first + 0x4000;
-	p->ttbr1 = phys;
-	for (i = 0; i < 0x2000; i++) /* one day I'll implement memset() */
-		p->first[i] = 0;
+	kmem_free_pages(p->first, 0x8000);
+}
+
+/**
+ * Create a process.
+ *
+ * The returned process has its own address space, with regions for its image
+ * and its stack. Neither is allocated yet: pages are filled in as the process
+ * touches them (see umem.c). You can context switch it in later.
+ */
+struct process *create_process(uint32_t binary)
+{
+	uint32_t size, text;
+	struct static_binary *bin = &binaries[binary];
+	struct image_header *hdr = bin->start;
+	struct process *p = slab_alloc(proc_slab);
 
 	/*
-	 * Allocate physical memory for the process image, and map it
-	 * temporarily into kernel memory.
+	 * Allocate a kernel stack.
 	 */
-	phys = alloc_pages(phys_allocator, size, 0);
-	virt = alloc_pages(kern_virt_allocator, size, 0);
-	kmem_map_pages(virt, phys, size, KMEM_ATTR_DEFAULT | KMEM_PERM_DATA);
+	p->kstack = (void *)kmem_get_pages(4096, 0) + 4096;
 
 	/*
-	 * Copy the "process image" over.
+	 * Determine the size of the "process image" (the bss is included in
+	 * the image file)
 	 */
-	dst = (uint32_t *)virt;
-	src = (uint32_t *)binaries[binary].start;
-	for (i = 0; i < (size / 4); i++)
-		dst[i] = src[i];
+	size = (uint32_t)bin->end - (uint32_t)bin->start;
+	text = min(hdr->data_start - 0x40000000, size);
+	bin->image.src = bin->start;
+	bin->image.len = size;
 
 	/*
-	 * Remove the temporary mapping from kernel virtual memory, and map the
-	 * process image into the actual process address space.
+	 * Describe the image and stack, to be filled in on demand.
 	 */
-	kmem_unmap_pages(virt, size);
-	free_pages(kern_virt_allocator, virt, size);
-	/* Here we invalidate the TLB for the virtual address we just freed.
-	 * This fixes a bug where the virtual address gets immediately re-used
-	 * and our new mapping is ignored by the TLB. Need to do this more
-	 * generally whenever we free virtual addresses TODO. */
-	set_cpreg(virt, c8, 0, c7, 3);
-	mark_alloc(p->vmem_allocator, 0x40000000, size);
-	umem_map_pages(p, 0x40000000, phys, size, UMEM_DEFAULT);
+	address_space_init(p);
+	umem_add_shared(p, 0x40000000, text, UMEM_TEXT, &bin->image, 0, 0);
+	if (size > text)
+		umem_add_shared(p, 0x40000000 + text, size - text,
+		                UMEM_DEFAULT | EXECUTE_NEVER, &bin->image, text,
+		                UMEM_COW);
+	umem_add_region(p, USER_STACK_TOP - USER_STACK_MAX, USER_STACK_MAX,
+	                UMEM_DEFAULT | EXECUTE_NEVER, NULL, 0);
 
 	/*
 	 * Set up some process variables
 	 */
 	p->context.spsr = ARM_MODE_USER;
 	p->context.ret = 0x40000000; /* jump to process img */
+	p->context.sp = USER_STACK_TOP;
 	p->id = pid++;
 	p->size = size;
-	p->phys = phys;
 	list_insert(&process_list, &p->list);
-	p->flags.pr_ready = 1;
+	p->flags.pr_ready = 0;
 	p->flags.pr_kernel = 0;
+	p->prio = p->base_prio = 0;
+	p->ticks = 0;
 
 	/*umem_print(p, 0x40000000, 0xFFFFFFFF);*/
 
@@ -156,6 +185,7 @@ struct process *create_process(uint32_t binary)
 
 	wait_list_init(&p->endlist);
 
+	ready_enqueue(p);
 	return p;
 }
 
@@ -168,14 +198,15 @@ struct process *create_kthread(void (*func)(void *), void *arg)
 	struct process *p = slab_alloc(proc_slab);
 	p->id = pid++;
 	p->size = 0;
-	p->phys = 0;
-	p->flags.pr_ready = 1;
+	p->flags.pr_ready = 0;
 	p->flags.pr_kernel = 1;
+	p->prio = p->base_prio = 0;
+	p->ticks = 0;
 	p->kstack = (void *)kmem_get_pages(4096, 0) + 4096;
 
 	/* kthread is in kernel memory space, no user memory region */
-	p->vmem_allocator = NULL;
 	p->ttbr1 = 0;
+	p->asid = 0;
 	p->first = NULL;
 	p->shadow = NULL;
 
@@ -189,44 +220,29 @@ struct process *create_kthread(void (*func)(void *), void *arg)
 	p->context.sp = (uint32_t)(p->kstack);
 
 	wait_list_init(&p->endlist);
+	ready_enqueue(p);
 	return p;
 }
 
 void destroy_current_process()
 {
-	uint32_t i;
 	struct socket *sock;
 	// printf("[kernel]\t\tdestroy process %u (p=0x%x)\n", proc->id, proc);
 	preempt_disable();
 
 	/*
-	 * Remove from the global process list
+	 * Remove from the global process list and the ready queue
 	 */
 	list_remove(&current->list);
+	ready_dequeue(current);
 
 	if (!current->flags.pr_kernel) {
 		/*
-		 * Free the process image's physical memory (it's not mapped
-		 * anywhere except for the process's virtual address space)
-		 */
-		free_pages(phys_allocator, current->phys, current->size);
-
-		/*
-		 * Free the process's virtual memory allocator.
-		 */
-		kmem_free_pages(current->vmem_allocator, 0x1000);
-
-		/*
-		 * Find any second-level page tables, and free them too!
+		 * Free the pages we faulted in (they're not mapped anywhere
+		 * except for the process's virtual address space)
 		 */
-		for (i = 0; i < 0x1000; i++)
-			if (current->shadow[i])
-				kmem_free_pages(current->shadow[i], 0x1000);
-
-		/*
-		 * Free the first-level table + shadow table
-		 */
-		kmem_free_pages(current->first, 0x8000);
+		umem_free_regions(current);
+		address_space_destroy(current);
 	} else {
 	}
 
@@ -265,6 +281,38 @@ void destroy_current_process()
 	schedule();
 }
 
+/**
+ * Switch TTBR1 and the ASID to those of p. Kernel threads have no user memory,
+ * so they use the reserved ASID.
+ *
+ * CONTEXTIDR and TTBR1 can't be changed atomically, so we follow B3.10.4 of
+ * the ARMv7a reference: switch to the reserved ASID, then the TTBR, then the
+ * new ASID. Anything speculatively walked in between is tagged with the
+ * reserved ASID, which no process uses for its own mappings.
+ * The PROCID field of CONTEXTIDR gets the pid, which helps debuggers.
+ */
+static void __nopreempt switch_address_space(struct process *p)
+{
+	uint32_t reg = ASID_RESERVED;
+
+	if (!p->flags.pr_kernel && asid_update(&asids, &p->asid)) {
+		/* a new generation: old ASIDs may be handed out again */
+		tlbiall();
+		mb();
+	}
+
+	set_cpreg(reg, c13, 0, c0, 1);
+	isb();
+	reg = p->ttbr1;
+	set_cpreg(reg, c2, 0, c0, 1);
+	isb();
+	reg = p->id << 8;
+	if (!p->flags.pr_kernel)
+		reg |= asid_hw(p->asid);
+	set_cpreg(reg, c13, 0, c0, 1);
+	isb();
+}
+
 void __nopreempt context_switch(struct process *new_process)
 {
 	if (new_process == current) {
@@ -281,51 +329,207 @@ void __nopreempt context_switch(struct process *new_process)
 		if (setctx(&current->context))
 			return; /* This is where we get scheduled back in */
 
-	/* Set the current ASID */
-	set_cpreg(new_process->id, c13, 0, c0, 1);
-
-	/* Set ttbr */
-	set_cpreg(new_process->ttbr1, c2, 0, c0, 1);
-
+	switch_address_space(new_process);
 	current = new_process;
 
-	/* TODO: It is possible for ASIDs to overlap. Need to check for this and
-	 * invalidate caches. */
-
-	/* TODO: Speculative execution could result in weirdness when ASID is
-	 * changed and TTBR is changed (non-atomically). See B3.10.4 in ARMv7a
-	 * reference for solution. */
-
 	cxtk_track_proc();
 	preempt_enable();
 	resctx(0, &current->context);
 }
 
-struct process *choose_new_process(void)
+static void rq_insert(struct process *p)
 {
-	struct process *iter, *chosen = NULL;
-	int count_seen = 0, count_ready = 0;
+	list_insert_end(&ready_queues[p->prio], &p->ready);
+	ready_levels |= 1U << p->prio;
+}
 
-	list_for_each_entry(iter, &process_list, list)
-	{
-		count_seen++;
-		if (iter->flags.pr_ready) {
-			count_ready++;
-			if (iter != current) {
-				chosen = iter;
+static void rq_remove(struct process *p)
+{
+	list_remove(&p->ready);
+	if (ready_queues[p->prio].next == &ready_queues[p->prio])
+		ready_levels &= ~(1U << p->prio);
+}
+
+void ready_enqueue(struct process *p)
+{
+	int flags;
+	irqsave(&flags);
+	if (!p->flags.pr_ready) {
+		/* it blocked rather than use up its quantum: move up a level */
+		if (p->prio > p->base_prio)
+			p->prio--;
+		p->ticks = 0;
+		p->flags.pr_ready = 1;
+		rq_insert(p);
+		if (sched_should_preempt())
+			timer_kick();
+		else
+			timer_update();
+	}
+	irqrestore(&flags);
+}
+
+void ready_dequeue(struct process *p)
+{
+	int flags;
+	irqsave(&flags);
+	if (p->flags.pr_ready) {
+		p->flags.pr_ready = 0;
+		rq_remove(p);
+	}
+	irqrestore(&flags);
+}
+
+/*
+ * Return every ready process to its base priority.
+ */
+static void sched_boost(void)
+{
+	struct process *p, *next;
+	unsigned int level;
+
+	for (level = 1; level < SCHED_LEVELS; level++) {
+		list_for_each_entry_safe(p, next, &ready_queues[level], ready)
+		{
+			if (p->prio == p->base_prio)
+				continue;
+			rq_remove(p);
+			p->prio = p->base_prio;
+			p->ticks = 0;
+			rq_insert(p);
+		}
+	}
+}
+
+/*
+ * Called from the timer interrupt, once per tick. Ticks only run while another
+ * process competes with current, see sched_wants_tick().
+ */
+void sched_tick(void)
+{
+	struct process *p = current;
+
+	if (++boost_ticks >= SCHED_BOOST_TICKS) {
+		boost_ticks = 0;
+		sched_boost();
+	}
+
+	if (p && p->flags.pr_ready &&
+	    ++p->ticks >= SCHED_QUANTUM(p->prio)) {
+		/* to the back of the next level down */
+		rq_remove(p);
+		if (p->prio < SCHED_LEVELS - 1)
+			p->prio++;
+		p->ticks = 0;
+		rq_insert(p);
+		need_resched = true;
+	}
+}
+
+/*
+ * We reschedule when current has used up its quantum, or when a process on a
+ * higher level (or any process at all, if we are idle) is ready. A reschedule
+ * which can't happen yet, because we interrupted a non-preemptible section,
+ * stays pending until it can.
+ */
+bool sched_should_preempt(void)
+{
+	struct process *p = current;
+
+	if (ready_levels && (!p || !p->flags.pr_ready ||
+	                     __builtin_ctz(ready_levels) < p->prio))
+		need_resched = true;
+	return need_resched;
+}
+
+/*
+ * Ticks are only needed when some process other than current is ready. When
+ * current is the only ready process, it is alone on its level.
+ */
+bool sched_wants_tick(void)
+{
+	struct process *p = current;
+	struct list_head *q;
+
+	if (!ready_levels)
+		return false;
+	if (!p || !p->flags.pr_ready || ready_levels != 1U << p->prio)
+		return true;
+	q = &ready_queues[p->prio];
+	return q->next != q->prev;
+}
+
+int process_set_priority(uint32_t pid, uint32_t prio)
+{
+	struct process *p = NULL, *iter;
+	int flags;
+
+	if (prio >= SCHED_LEVELS)
+		return -EINVAL;
+	if (pid == 0 || pid == current->id) {
+		p = current;
+	} else {
+		list_for_each_entry(iter, &process_list, list)
+		{
+			if (iter->id == pid) {
+				p = iter;
 				break;
 			}
 		}
 	}
+	if (!p)
+		return -ESRCH;
+
+	irqsave(&flags);
+	if (p->flags.pr_ready)
+		rq_remove(p);
+	p->base_prio = prio;
+	p->prio = prio;
+	p->ticks = 0;
+	if (p->flags.pr_ready)
+		rq_insert(p);
+	irqrestore(&flags);
+	return 0;
+}
 
+/*
+ * The running process stays on its ready queue while it's ready. We take the
+ * first process on the highest level, other than current, unless current is on
+ * a higher level still. Since only current is ever skipped, this looks at no
+ * more than two levels.
+ */
+struct process *choose_new_process(void)
+{
+	struct process *chosen = NULL;
+	struct list_head *head;
+	uint32_t levels, level;
+	int flags;
+
+	irqsave(&flags);
+	need_resched = false;
+	for (levels = ready_levels; levels && !chosen;
+	     levels &= ~(1U << level)) {
+		level = __builtin_ctz(levels);
+		head = ready_queues[level].next;
+		if (container_of(head, struct process, ready) == current)
+			head = head->next;
+		if (head != &ready_queues[level])
+			chosen = container_of(head, struct process, ready);
+	}
+	if (chosen && current && current->flags.pr_ready &&
+	    current->prio < chosen->prio)
+		chosen = NULL;
 	if (chosen) {
 		/*
-		 * A new process is chosen, move it to the end to give other
-		 * processes a chance (round robin scheduler).
+		 * A new process is chosen, move it to the end of its level to
+		 * give the others there a chance (round robin).
 		 */
-		list_remove(&chosen->list);
-		list_insert_end(&process_list, &chosen->list);
+		list_remove(&chosen->ready);
+		list_insert_end(&ready_queues[chosen->prio], &chosen->ready);
+	}
+	irqrestore(&flags);
 
+	if (chosen) {
 		return chosen;
 	} else if (current && current->flags.pr_ready) {
 		/*
@@ -337,11 +541,11 @@ struct process *choose_new_process(void)
 		/*
 		 * At this point, either there is no process available at all,
 		 * or no process is ready. We'll use the IDLE process, which is
-		 * always marked as not ready, but in reality we can always
+		 * never on a ready queue, but in reality we can always
 		 * idle a bit.
 		 */
 		static bool warned = false;
-		if (count_seen == 0 && !warned) {
+		if (process_list.next == &process_list && !warned) {
 			puts("[kernel] WARNING: no more processes remain, "
 			     "dropping into kernel shell\n");
 			warned = true;
@@ -360,11 +564,7 @@ void irq_schedule(struct ctx *ctx)
 	if (current == new)
 		return;
 
-	/* Set the current ASID */
-	set_cpreg(new->id, c13, 0, c0, 1);
-
-	/* Set ttbr */
-	set_cpreg(new->ttbr1, c2, 0, c0, 1);
+	switch_address_space(new);
 
 	/* Swap contexts! */
 	current->context = *ctx;
@@ -422,7 +622,15 @@ static int cmd_lsproc(int argc, char **argv)
 	struct process *p;
 	list_for_each_entry(p, &process_list, list)
 	{
-		printf("%u\n", p->id);
+		if (p->flags.pr_kernel)
+			printf("%u (priority %u/%u)\n", p->id, p->prio,
+			       p->base_prio);
+		else
+			printf("%u (priority %u/%u, image %u pages, "
+			       "%u private, %u shared)\n",
+			       p->id, p->prio, p->base_prio,
+			       ALIGN(p->size, PAGE_SIZE) / PAGE_SIZE,
+			       p->resident, p->shared_resident);
 	}
 	return 0;
 }
@@ -455,17 +663,148 @@ static int cmd_execproc(int argc, char **argv)
 	return 0;
 }
 
+/*
+ * ASID benchmark: ping-pong between two address spaces, touching a page in
+ * each of ASID_BENCH_PAGES user mappings after every switch. With ASIDs, each
+ * address space's TLB entries survive the other one running. For comparison,
+ * we repeat this with a TLB flush on every switch, which is what sharing a
+ * single ASID would require.
+ */
+#define ASID_BENCH_PAGES 32
+#define ASID_BENCH_VIRT  0x40000000
+
+static uint32_t asid_bench_touch(void)
+{
+	volatile uint32_t *ptr = (uint32_t *)ASID_BENCH_VIRT;
+	uint32_t i, sum = 0;
+	for (i = 0; i < ASID_BENCH_PAGES; i++)
+		sum += ptr[i * (PAGE_SIZE / sizeof(uint32_t))];
+	return sum;
+}
+
+static void asid_bench_run(struct process **spaces, uint32_t iters,
+                           bool flush, uint32_t *cycles, uint32_t *refills)
+{
+	uint32_t i, j, start_cycles, start_refills;
+
+	start_refills = pmu_event_read();
+	start_cycles = get_cycles();
+	for (i = 0; i < iters; i++) {
+		for (j = 0; j < 2; j++) {
+			switch_address_space(spaces[j]);
+			if (flush) {
+				tlbiall();
+				mb();
+			}
+			asid_bench_touch();
+		}
+	}
+	*cycles = get_cycles() - start_cycles;
+	*refills = pmu_event_read() - start_refills;
+}
+
+static void asid_bench_free(struct process **spaces, uint32_t n, void *page)
+{
+	uint32_t j;
+
+	for (j = 0; j < n; j++) {
+		address_space_destroy(spaces[j]);
+		slab_free(proc_slab, spaces[j]);
+	}
+	kmem_free_page(page);
+}
+
+static int cmd_asid_bench(int argc, char **argv)
+{
+	struct process *spaces[2];
+	uint32_t i, j, iters = 1000, cycles, refills, phys;
+	uint32_t virt = ASID_BENCH_VIRT;
+	void *page;
+	int rv = 0;
+
+	if (argc > 1) {
+		puts("usage: proc asidbench [ITERATIONS]\n");
+		return 1;
+	}
+	if (argc == 1)
+		iters = atoi(argv[0]);
+	if (iters == 0) {
+		puts("proc asidbench: need at least one iteration\n");
+		return 1;
+	}
+
+	/*
+	 * Map the same physical page at every virtual page, so that each one
+	 * needs its own TLB entry while we only use one page of memory.
+	 */
+	page = kmem_get_page();
+	phys = kmem_lookup_phys(page);
+	for (j = 0; j < 2; j++) {
+		spaces[j] = slab_alloc(proc_slab);
+		spaces[j]->id = 0;
+		spaces[j]->flags.pr_kernel = 0;
+		address_space_init(spaces[j]);
+		for (i = 0; i < ASID_BENCH_PAGES && !rv; i++)
+			rv = umem_map_pages(spaces[j], virt + i * PAGE_SIZE,
+			                    phys, PAGE_SIZE, UMEM_DEFAULT);
+		if (rv) {
+			puts("proc asidbench: out of memory\n");
+			asid_bench_free(spaces, j + 1, page);
+			return 1;
+		}
+	}
+
+	pmu_event_init(PMU_L1D_TLB_REFILL);
+	preempt_disable();
+	asid_bench_run(spaces, iters, false, &cycles, &refills);
+	printf("asids:    %u switches, %u cycles/switch, %u TLB refills\n",
+	       2 * iters, cycles / (2 * iters), refills);
+	asid_bench_run(spaces, iters, true, &cycles, &refills);
+	printf("flushing: %u switches, %u cycles/switch, %u TLB refills\n",
+	       2 * iters, cycles / (2 * iters), refills);
+	switch_address_space(current);
+	preempt_enable();
+
+	asid_bench_free(spaces, 2, page);
+	return 0;
+}
+
+static int cmd_prio(int argc, char **argv)
+{
+	int rv;
+
+	if (argc != 2) {
+		printf("usage: proc prio PID LEVEL (0 is highest, %u lowest)\n",
+		       SCHED_LEVELS - 1);
+		return 1;
+	}
+	rv = process_set_priority(atoi(argv[0]), atoi(argv[1]));
+	if (rv == -ESRCH)
+		printf("pid %s not found\n", argv[0]);
+	else if (rv == -EINVAL)
+		printf("bad priority %s\n", argv[1]);
+	return rv;
+}
+
 struct ksh_cmd proc_ksh_cmds[] = {
 	KSH_CMD("create", cmd_mkproc, "create new process given binary image"),
-	KSH_CMD("ls", cmd_lsproc, "list process IDs"),
+	KSH_CMD("ls", cmd_lsproc, "list process IDs and priorities"),
+	KSH_CMD("prio", cmd_prio, "set the base priority of a process"),
 	KSH_CMD("exec", cmd_execproc, "run process"),
+	KSH_CMD("asidbench", cmd_asid_bench, "time address space switches"),
 	{ 0 },
 };
 
+/*
+ * The idle thread only runs when nothing else is ready, which makes it the
+ * right place to reclaim memory and to prepare zeroed pages. Once there's
+ * nothing left to do, it sleeps.
+ */
 static void idle(void *arg)
 {
 	while (1) {
-		asm("wfi");
+		if (!reclaim_run() && !zero_pool_refill())
+			asm("wfi");
 	}
 }
 
@@ -474,8 +813,16 @@ static void idle(void *arg)
  */
 void process_init(void)
 {
+	unsigned int i;
+
 	INIT_LIST_HEAD(process_list);
-	proc_slab = slab_new("process", sizeof(struct process), kmem_get_page);
+	for (i = 0; i < SCHED_LEVELS; i++)
+		INIT_LIST_HEAD(ready_queues[i]);
+	ready_levels = 0;
+	asid_init(&asids);
+	zero_pool_init();
+	proc_slab = slab_new("process", sizeof(struct process), SLAB_ORDER_AUTO,
+	                     kmem_get_slab_pages, kmem_free_slab_pages);
 	idle_process = create_kthread(idle, NULL);
-	idle_process->flags.pr_ready = 0; /* idle process is never ready */
+	ready_dequeue(idle_process); /* idle process is never ready */
 }
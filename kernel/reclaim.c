@@ -0,0 +1,181 @@
+/*
+ * reclaim.c: give memory back from kernel caches when pages run short
+ *
+ * Subsystems which hold on to memory they could do without (free slab pages,
+ * loaded directories, pre-zeroed pages) register a shrinker. The physical page
+ * allocator calls us whenever an allocation leaves it below the low watermark,
+ * or fails entirely.
+ *
+ * Most shrinkers can't run just anywhere: the allocation may come from an
+ * interrupt handler, or from inside the very slab we'd like to shrink. So the
+ * allocator's callback only records how much memory we want back, and the idle
+ * thread does the work. Idle only runs when every other thread is blocked, so
+ * none of them is halfway through a slab or directory operation when it starts.
+ * To keep it that way until it's done, preemption stays disabled while the
+ * shrinkers run: a thread woken meanwhile waits rather than walking into the
+ * half-trimmed slab. A failed allocation can't wait for idle, so it runs just
+ * the shrinkers marked atomic, which are safe in any context, and then retries.
+ */
+#include "kernel.h"
+#include "ksh.h"
+#include "slab.h"
+#include "string.h"
+
+static DECLARE_LIST_HEAD(shrinkers);
+
+static uint32_t low, high; /* watermarks, in pages */
+static uint32_t pending;   /* pages the idle thread should reclaim */
+static uint32_t low_events, failures, runs;
+static uint32_t last_freed; /* by the most recent run */
+static struct waitlist run_done;
+
+void register_shrinker(struct shrinker *shrinker)
+{
+	shrinker->calls = 0;
+	shrinker->freed = 0;
+	list_insert(&shrinkers, &shrinker->list);
+}
+
+static uint32_t run_shrinkers(uint32_t want, bool atomic_only)
+{
+	struct shrinker *shrinker;
+	uint32_t freed, total = 0;
+
+	list_for_each_entry(shrinker, &shrinkers, list)
+	{
+		if (total >= want)
+			break;
+		if (atomic_only && !shrinker->atomic)
+			continue;
+		freed = shrinker->shrink(want - total);
+		shrinker->calls++;
+		shrinker->freed += freed;
+		total += freed;
+	}
+	return total;
+}
+
+/*
+ * Called by the page allocator, possibly from an interrupt handler, and with
+ * interrupts enabled or not.
+ */
+static uint32_t reclaim_callback(uint32_t want, bool failing)
+{
+	int flags;
+
+	irqsave(&flags);
+	if (want > pending)
+		pending = want;
+	if (failing)
+		failures++;
+	else
+		low_events++;
+	irqrestore(&flags);
+
+	if (failing)
+		return run_shrinkers(want, true);
+	return 0;
+}
+
+/**
+ * Run any reclaim requested by the allocator or by "mem reclaim". Called by the
+ * idle thread. Return true if there was work to do.
+ */
+bool reclaim_run(void)
+{
+	uint32_t want;
+	int flags;
+
+	preempt_disable();
+	irqsave(&flags);
+	want = pending;
+	pending = 0;
+	irqrestore(&flags);
+
+	if (!want) {
+		preempt_enable();
+		return false;
+	}
+	last_freed = run_shrinkers(want, false);
+	runs++;
+	preempt_enable();
+
+	wake_all(&run_done);
+	return true;
+}
+
+/**
+ * Return true when free memory is below the high watermark, in which case
+ * caches shouldn't be growing for their own sake.
+ */
+bool reclaim_memory_low(void)
+{
+	return page_allocator_count_free(phys_allocator) < high;
+}
+
+static uint32_t shrink_slabs(uint32_t want)
+{
+	return slab_shrink_all();
+}
+
+static struct shrinker slab_shrinker = {
+	.name = "slab",
+	.shrink = shrink_slabs,
+	.atomic = false,
+};
+
+/*
+ * Watermarks are a fraction of the memory free at boot: we start reclaiming
+ * below 1/32 of it, and stop once we're back above 1/16.
+ */
+void reclaim_init(void)
+{
+	uint32_t free = page_allocator_count_free(phys_allocator);
+
+	low = free / 32;
+	high = free / 16;
+	pending = 0;
+	wait_list_init(&run_done);
+	/* newest shrinkers run first, so slabs go last: other caches free
+	 * their objects into them */
+	register_shrinker(&slab_shrinker);
+	page_allocator_set_reclaim(phys_allocator, low, high, reclaim_callback);
+}
+
+int reclaim_cmd_status(int argc, char **argv)
+{
+	struct shrinker *shrinker;
+	uint32_t want, start;
+	int flags;
+
+	if (argc > 1) {
+		puts("usage: mem reclaim [PAGES]\n");
+		return 1;
+	}
+	if (argc == 1) {
+		/* Other threads may be preempted within a slab right now, so
+		 * leave the work to the idle thread and wait for it. */
+		want = atoi(argv[0]);
+		if (!want)
+			want = 1;
+		irqsave(&flags);
+		start = runs;
+		if (want > pending)
+			pending = want;
+		irqrestore(&flags);
+		wait_event(&run_done, runs != start);
+		printf("reclaimed %u pages\n", last_freed);
+	}
+
+	printf("%u pages free, watermarks low=%u high=%u\n",
+	       page_allocator_count_free(phys_allocator), low, high);
+	printf("%u low watermark events, %u failed allocations, %u runs\n",
+	       low_events, failures, runs);
+	list_for_each_entry(shrinker, &shrinkers, list)
+	{
+		printf("  %s%s: %u calls, %u pages freed\n", shrinker->name,
+		       shrinker->atomic ? " (atomic)" : "", shrinker->calls,
+		       shrinker->freed);
+	}
+	return 0;
+}
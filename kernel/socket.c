@@ -2,6 +2,7 @@
 #include "kernel.h"
 #include "slab.h"
 #include "string.h"
+#include "sys/time.h"
 
 struct slab *socket_slab;
 
@@ -37,14 +38,11 @@ int socket_socket(int domain, int type, int protocol)
 		return -EPROTONOSUPPORT;
 
 	sock = slab_alloc(socket_slab);
-	memset(sock, 0, sizeof(struct socket));
 	current->max_fildes++;
 	sock->fildes = current->max_fildes;
 	sock->proc = current;
 	sock->ops = ops;
 	list_insert_end(&current->sockets, &sock->sockets);
-	INIT_LIST_HEAD(sock->recvq);
-	wait_list_init(&sock->recvwait);
 	return sock->fildes;
 }
 
@@ -64,6 +62,32 @@ void socket_destroy(struct socket *sock)
 	slab_free(socket_slab, sock);
 }
 
+/**
+ * Set a socket level option. Values come from user memory.
+ */
+int socket_setsockopt(struct socket *sock, int option_name,
+                      const void *option_value, socklen_t option_len)
+{
+	struct timeval tv;
+	int rv;
+
+	switch (option_name) {
+	case SO_RCVTIMEO:
+		if (option_len != sizeof(tv))
+			return -EINVAL;
+		rv = copy_from_user(&tv, option_value, sizeof(tv));
+		if (rv < 0)
+			return rv;
+		if (tv.tv_usec >= 1000000)
+			return -EINVAL;
+		sock->rcvtimeo =
+		        timer_duration_ms(tv.tv_sec, tv.tv_usec * 1000);
+		return 0;
+	default:
+		return -ENOPROTOOPT;
+	}
+}
+
 struct socket *socket_get_by_fd(struct process *proc, int fd)
 {
 	struct socket *sk;
@@ -75,7 +99,23 @@ struct socket *socket_get_by_fd(struct process *proc, int fd)
 	return NULL;
 }
 
+/**
+ * Sockets start out unbound and unconnected, with nothing queued.
+ */
+static void socket_ctor(void *obj)
+{
+	struct socket *sock = obj;
+	memset(&sock->flags, 0, sizeof(sock->flags));
+	memset(&sock->src, 0, sizeof(sock->src));
+	memset(&sock->dst, 0, sizeof(sock->dst));
+	INIT_LIST_HEAD(sock->recvq);
+	wait_list_init(&sock->recvwait);
+	sock->rcvtimeo = 0;
+}
+
 void socket_init(void)
 {
-	socket_slab = slab_new("socket", sizeof(struct socket), kmem_get_page);
+	socket_slab = slab_new_ctor("socket", sizeof(struct socket),
+	                            SLAB_ORDER_AUTO, kmem_get_slab_pages,
+	                            kmem_free_slab_pages, socket_ctor, NULL);
 }
@@ -40,10 +40,13 @@ struct socket {
 	struct sockaddr_in dst;
 	struct list_head recvq;
 	struct waitlist recvwait;
+	uint32_t rcvtimeo; /* SO_RCVTIMEO in milliseconds, 0 for none */
 };
 
 int socket_socket(int domain, int type, int protocol);
 void socket_register_proto(struct sockops *ops);
 void socket_destroy(struct socket *sock);
+int socket_setsockopt(struct socket *sock, int option_name,
+                      const void *option_value, socklen_t option_len);
 struct socket *socket_get_by_fd(struct process *proc, int fd);
 void socket_init(void);
@@ -7,6 +7,7 @@
 #include "cxtk.h"
 #include "kernel.h"
 #include "socket.h"
+#include "sys/time.h"
 
 void sys_relinquish(void)
 {
@@ -170,6 +171,56 @@ out:
 	return rv;
 }
 
+int sys_setprio(int pid, int prio)
+{
+	int rv;
+	cxtk_track_syscall();
+	rv = process_set_priority(pid, prio);
+	cxtk_track_syscall_return();
+	return rv;
+}
+
+int sys_nanosleep(const struct timespec *req)
+{
+	struct timespec ts;
+	int rv;
+	cxtk_track_syscall();
+
+	rv = copy_from_user(&ts, req, sizeof(ts));
+	if (rv < 0)
+		goto out;
+	if (ts.tv_nsec >= 1000000000) {
+		rv = -EINVAL;
+		goto out;
+	}
+
+	timer_sleep(timer_duration_ms(ts.tv_sec, ts.tv_nsec));
+	rv = 0;
+out:
+	cxtk_track_syscall_return();
+	return rv;
+}
+
+/* Only socket level options exist, so the user stub checks the level */
+int sys_setsockopt(int sockfd, int option_name, const void *option_value,
+                   socklen_t option_len)
+{
+	int rv;
+	struct socket *sk;
+	cxtk_track_syscall();
+
+	sk = socket_get_by_fd(current, sockfd);
+	if (!sk) {
+		rv = -EBADF;
+		goto out;
+	}
+
+	rv = socket_setsockopt(sk, option_name, option_value, option_len);
+out:
+	cxtk_track_syscall_return();
+	return rv;
+}
+
 void sys_unknown(uint32_t svc_num)
 {
 	cxtk_track_syscall();
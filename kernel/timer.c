@@ -4,6 +4,7 @@
 #include "gic.h"
 #include "kernel.h"
 #include "ksh.h"
+#include "wheel.h"
 
 #define TIMER_INTID 30
 
@@ -21,7 +22,218 @@
 #define GET_CNTP_TVAL(dst) get_cpreg(dst, c14, 0, c2, 0);
 #define SET_CNTP_TVAL(dst) set_cpreg(dst, c14, 0, c2, 0);
 
-#define HZ 100
+#define HZ       100
+#define TIMER_HZ 1000 /* resolution of kernel timers: milliseconds */
+
+#define CNTP_CTL_ENABLE 1
+
+/*
+ * The timer no longer interrupts us HZ times per second regardless of what's
+ * going on. Instead, CNTP_CVAL is set for the next event we actually care
+ * about, and the timer is turned off when there is none:
+ *
+ * - Scheduler ticks only matter while some other process competes with the
+ *   current one for the CPU (sched_wants_tick()). Then we tick every 1/HZ
+ *   seconds, to charge quanta and to preempt. A lone process, or the idle
+ *   thread, runs without any timer interrupts at all.
+ * - When a process becomes ready and should preempt the current one, it need
+ *   not wait for a tick: timer_kick() fires the timer right away.
+ * - Kernel timers (timer_add()) live on a timer wheel counting milliseconds,
+ *   and the timer fires when the wheel next has work to do.
+ *
+ * All of these must be called with interrupts disabled.
+ */
+static uint32_t tick_cycles;   /* counter cycles per scheduler tick */
+static uint64_t tick_deadline; /* counter value of the next tick, 0 if none */
+static uint64_t next_event;    /* what CNTP_CVAL is set to, 0 if disabled */
+
+static struct wheel wheel;
+static uint32_t jiffy_cycles; /* counter cycles per millisecond */
+static uint32_t jiffies;      /* milliseconds since boot */
+static uint64_t jiffies_at;   /* counter value when jiffies last went up */
+
+static uint32_t stat_irqs, stat_ticks, stat_kicks;
+
+uint64_t timer_now(void)
+{
+	uint32_t lo, hi;
+	GET_CNTPCT(lo, hi);
+	return ((uint64_t)hi << 32) | lo;
+}
+
+/*
+ * Bring jiffies up to date. We have no 64-bit division, so after a long idle
+ * whole seconds are counted first, until the rest fits in 32 bits.
+ */
+static uint32_t update_jiffies(void)
+{
+	uint64_t elapsed = timer_now() - jiffies_at;
+	uint32_t second = jiffy_cycles * TIMER_HZ;
+	uint32_t n;
+
+	while (elapsed >> 32) {
+		jiffies += TIMER_HZ;
+		jiffies_at += second;
+		elapsed -= second;
+	}
+	n = (uint32_t)elapsed / jiffy_cycles;
+	jiffies += n;
+	jiffies_at += (uint64_t)n * jiffy_cycles;
+	return jiffies;
+}
+
+static uint64_t jiffies_to_cycles(uint32_t when)
+{
+	if ((int32_t)(when - jiffies) <= 0)
+		return jiffies_at; /* already due */
+	return jiffies_at + (uint64_t)(when - jiffies) * jiffy_cycles;
+}
+
+static void timer_program(uint64_t cval)
+{
+	uint32_t lo = (uint32_t)cval, hi = (uint32_t)(cval >> 32);
+	uint32_t ctl = CNTP_CTL_ENABLE;
+
+	next_event = cval;
+	SET_CNTP_CVAL(lo, hi);
+	SET_CNTP_CTL(ctl);
+}
+
+static void timer_stop(void)
+{
+	uint32_t ctl = 0;
+
+	next_event = 0;
+	SET_CNTP_CTL(ctl);
+}
+
+/**
+ * Program the timer for the next event, or turn it off if there is none. Call
+ * this whenever the scheduler's need for ticks may have changed.
+ */
+void timer_update(void)
+{
+	uint64_t next, cval;
+	uint32_t when;
+
+	if (!tick_cycles)
+		return; /* not initialized yet */
+
+	if (!sched_wants_tick())
+		tick_deadline = 0;
+	else if (!tick_deadline)
+		tick_deadline = timer_now() + tick_cycles;
+	next = tick_deadline;
+
+	if (wheel_next(&wheel, &when)) {
+		cval = jiffies_to_cycles(when);
+		if (!next || cval < next)
+			next = cval;
+	}
+
+	if (next) {
+		if (next_event != next)
+			timer_program(next);
+	} else if (next_event) {
+		timer_stop();
+	}
+}
+
+/**
+ * Interrupt as soon as possible, so that the timer interrupt can preempt the
+ * current process.
+ */
+void timer_kick(void)
+{
+	if (!tick_cycles)
+		return;
+	stat_kicks++;
+	timer_program(timer_now());
+}
+
+/**
+ * Call timer->func(timer->arg) from the timer interrupt, once at least `ms`
+ * milliseconds have passed. A pending timer is moved. Initialize the timer
+ * with wheel_timer_init() first.
+ */
+void timer_add(struct wheel_timer *timer, uint32_t ms)
+{
+	uint32_t now;
+	int flags;
+
+	irqsave(&flags);
+	now = update_jiffies();
+	if (!wheel.pending)
+		wheel_advance(&wheel, now); /* no work, just catch up */
+	/* the current millisecond has partly passed, so count one more */
+	wheel_add(&wheel, timer, now + ms + 1);
+	timer_update();
+	irqrestore(&flags);
+}
+
+/**
+ * Cancel a timer, returning true if it had not yet fired.
+ */
+bool timer_cancel(struct wheel_timer *timer)
+{
+	bool pending;
+	int flags;
+
+	irqsave(&flags);
+	pending = wheel_cancel(&wheel, timer);
+	irqrestore(&flags);
+	return pending;
+}
+
+/**
+ * Return milliseconds since boot.
+ */
+uint32_t timer_ms(void)
+{
+	uint32_t now;
+	int flags;
+
+	irqsave(&flags);
+	now = update_jiffies();
+	irqrestore(&flags);
+	return now;
+}
+
+/**
+ * Convert `sec` seconds and `nsec` (less than a second) nanoseconds to
+ * milliseconds, rounding up.
+ */
+uint32_t timer_duration_ms(uint32_t sec, uint32_t nsec)
+{
+	if (sec >= TIMER_MAX_MS / 1000)
+		return TIMER_MAX_MS;
+	return sec * 1000 + (nsec + 999999) / 1000000;
+}
+
+static void timer_wake(void *arg)
+{
+	ready_enqueue(arg);
+}
+
+/**
+ * Block the current process for at least `ms` milliseconds.
+ */
+void timer_sleep(uint32_t ms)
+{
+	struct wheel_timer timer;
+	int flags;
+
+	wheel_timer_init(&timer, timer_wake, current);
+	irqsave(&flags);
+	timer_add(&timer, ms);
+	while (wheel_timer_pending(&timer)) {
+		ready_dequeue(current);
+		irqrestore(&flags);
+		schedule();
+		irqsave(&flags);
+	}
+	irqrestore(&flags);
+}
 
 static int cmd_timer_get_freq(int argc, char **argv)
 {
@@ -34,7 +246,7 @@ static int cmd_timer_get_freq(int argc, char **argv)
 static int cmd_timer_get_count(int argc, char **argv)
 {
 	uint32_t dst_hi, dst_lo;
-	GET_CNTPCT(dst_hi, dst_lo);
+	GET_CNTPCT(dst_lo, dst_hi);
 	printf("CNTPCT: hi 0x%x lo 0x%x\n", dst_hi, dst_lo);
 	return 0;
 }
@@ -47,52 +259,70 @@ static int cmd_timer_get_ctl(int argc, char **argv)
 	return 0;
 }
 
+static int cmd_timer_status(int argc, char **argv)
+{
+	printf("%u interrupts, %u ticks, %u kicks\n", stat_irqs, stat_ticks,
+	       stat_kicks);
+	printf("tick %s, %u kernel timers pending\n",
+	       tick_deadline ? "running" : "stopped", wheel.pending);
+	return 0;
+}
+
 struct ksh_cmd timer_ksh_cmds[] = {
 	KSH_CMD("get-freq", cmd_timer_get_freq, "get timer frequency"),
 	KSH_CMD("get-count", cmd_timer_get_count, "get current timer value"),
 	KSH_CMD("get-ctl", cmd_timer_get_ctl, "get timer ctl register"),
+	KSH_CMD("status", cmd_timer_status, "show timer interrupt counts"),
 	{ 0 },
 };
 
 void timer_init(void)
 {
 	uint32_t dst;
+	int flags;
 
-	/* get timer frequency */
+	/* get timer frequency, and divide it by HZ for the tick length */
 	GET_CNTFRQ(dst);
+	jiffy_cycles = dst / TIMER_HZ;
+	jiffies = 0;
+	jiffies_at = timer_now();
+	wheel_init(&wheel, jiffies);
+	tick_cycles = dst / HZ; /* timer_update() does nothing until now */
 
-	/* Set timer tval to tick at appx HZ per second, by dividing the
-	 * frequency by HZ */
-	dst /= HZ;
-	SET_CNTP_TVAL(dst);
-
-	/* Enable the timer */
-	dst = 1;
-	SET_CNTP_CTL(dst); /* enable timer */
-
+	timer_stop();
 	gic_register_isr(TIMER_INTID, 1, timer_isr, "timer");
 	gic_enable_interrupt(TIMER_INTID);
+
+	/* processes may already be ready */
+	irqsave(&flags);
+	timer_update();
+	irqrestore(&flags);
 }
 
 void timer_isr(uint32_t intid, struct ctx *ctx)
 {
-	uint32_t reg;
+	stat_irqs++;
 
-	/* Reset timer to go off in another 1/HZ second */
-	GET_CNTFRQ(reg);
-	reg /= HZ;
-	SET_CNTP_TVAL(reg);
+	if (tick_deadline && timer_now() >= tick_deadline) {
+		stat_ticks++;
+		tick_deadline = 0;
+		sched_tick();
+	}
 
-	/* Ensure the timer is still on */
-	reg = 1;
-	SET_CNTP_CTL(reg);
+	/* run expired kernel timers */
+	wheel_advance(&wheel, update_jiffies());
 
-	if (timer_can_reschedule(ctx)) {
+	if (sched_should_preempt() && timer_can_reschedule(ctx)) {
 		/* We interrupted sys/user mode. This means we can go ahead and
 		 * reschedule safely. */
 		irq_schedule(ctx);
 	}
 
+	/* Set up the next event (for the new process, if we switched). This
+	 * also clears the interrupt condition, unless the event has already
+	 * come. */
+	timer_update();
+
 	/* Interrupt should now be safe to clear */
 	gic_end_interrupt(intid);
 }
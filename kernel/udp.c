@@ -30,19 +30,26 @@ static struct udp_wait_entry *lookup_entry(uint16_t port)
 	return NULL;
 }
 
+static void udp_wait_timeout(void *arg)
+{
+	ready_enqueue(arg);
+}
+
 /*
- * Wait for a packet to come in on "port".
+ * Wait for a packet to come in on "port", for at most timeout_ms milliseconds.
+ * Return NULL if none came.
  *
  * YOU MUST HAVE ALREADY DISABLED INTERRUPTS BEFORE CALLING THIS FUNCTION.
  *
  * Why? We are about to go into a sleep which we can only wake from by the
- * receipt of a packet. Presumably, you have already sent out the packet which
- * will trigger this receipt. If interrupts are enabled, the packet could be
- * received and handled BEFORE we have entered our sleep.
+ * receipt of a packet (or the timeout). Presumably, you have already sent out
+ * the packet which will trigger this receipt. If interrupts are enabled, the
+ * packet could be received and handled BEFORE we have entered our sleep.
  */
-struct packet *udp_wait(uint16_t port)
+struct packet *udp_wait(uint16_t port, uint32_t timeout_ms)
 {
 	struct udp_wait_entry entry;
+	struct wheel_timer timer;
 	uint32_t hash = udp_hash(port);
 
 	entry.sock = NULL;
@@ -51,12 +58,18 @@ struct packet *udp_wait(uint16_t port)
 	entry.rcv = NULL;
 	hlist_insert(&udp_hlist[hash], &entry.list);
 
-	current->flags.pr_ready = 0;
-
-	interrupt_enable();
-	schedule();
+	wheel_timer_init(&timer, udp_wait_timeout, current);
+	timer_add(&timer, timeout_ms);
+	while (!entry.rcv && wheel_timer_pending(&timer)) {
+		ready_dequeue(current);
+		interrupt_enable();
+		schedule();
+		interrupt_disable();
+	}
 
+	timer_cancel(&timer);
 	hlist_remove(&udp_hlist[hash], &entry.list);
+	interrupt_enable();
 	return entry.rcv;
 }
 
@@ -73,12 +86,12 @@ void udp_recv(struct netif *netif, struct packet *pkt)
 			/* TODO: socket may not be connected to this endpoint,
 			 * need to better check here */
 			list_insert_end(&entry->sock->recvq, &pkt->list);
-			wait_list_awaken(&entry->sock->recvwait);
+			wake_one(&entry->sock->recvwait);
 			return;
 		} else {
 			if (entry->port == ntohs(pkt->udp->dst_port)) {
 				entry->rcv = pkt;
-				entry->proc->flags.pr_ready = true;
+				ready_enqueue(entry->proc);
 				return;
 			}
 		}
@@ -98,6 +111,8 @@ void udp_send(struct netif *netif, struct packet *pkt, uint32_t src_ip,
 	pkt->udp->dst_port = dst_port;
 	pkt->udp->len = htons(pkt->end - pkt->tl);
 	len_rounded = pkt->end - pkt->tl;
+	if (len_rounded % 2)
+		*(uint8_t *)pkt->end = 0; /* checksum pads with a zero byte */
 	len_rounded = (len_rounded / 2) + (len_rounded % 2);
 	pkt->udp->csum = 0;
 	csum_init(&csum);
@@ -266,6 +281,37 @@ struct packet *socket_recvq_get(struct socket *socket)
 	return NULL;
 }
 
+/*
+ * Take the first packet off the receive queue, if there is one. Packets are
+ * queued by the interrupt handler.
+ */
+static struct packet *udp_recvq_take(struct socket *sock)
+{
+	struct packet *pkt;
+	int flags;
+
+	irqsave(&flags);
+	pkt = socket_recvq_get(sock);
+	if (pkt)
+		list_remove(&pkt->list);
+	irqrestore(&flags);
+	return pkt;
+}
+
+/*
+ * Return a packet we couldn't deliver to the head of the receive queue, and
+ * let the next reader have a go at it.
+ */
+static void udp_recvq_untake(struct socket *sock, struct packet *pkt)
+{
+	int flags;
+
+	irqsave(&flags);
+	list_insert(&sock->recvq, &pkt->list);
+	irqrestore(&flags);
+	wake_one(&sock->recvwait);
+}
+
 int udp_sys_recv(struct socket *sock, void *data, size_t len, int flags)
 {
 	struct packet *pkt;
@@ -279,23 +325,25 @@ int udp_sys_recv(struct socket *sock, void *data, size_t len, int flags)
 		return -EINVAL;
 	}
 
-	/* Get packet or wait for one to come */
-	pkt = socket_recvq_get(sock);
-	while (!pkt) {
-		wait_for(&sock->recvwait);
-		pkt = socket_recvq_get(sock);
-	}
+	/* Get packet or wait for one to come. Each packet wakes one reader. */
+	if (wait_event_exclusive_timeout(&sock->recvwait,
+	                                 (pkt = udp_recvq_take(sock)) != NULL,
+	                                 sock->rcvtimeo) < 0)
+		return -EAGAIN;
 
 	/* This may not be standard, but we only allow recv()ing entire packets,
 	 * no less. */
 	pktlen = (uint32_t)(pkt->end - pkt->al);
-	if (pktlen > len)
+	if (pktlen > len) {
+		udp_recvq_untake(sock, pkt);
 		return -EMSGSIZE;
+	}
 
-	if ((rv = copy_to_user(data, pkt->al, pktlen)) < 0)
+	if ((rv = copy_to_user(data, pkt->al, pktlen)) < 0) {
+		udp_recvq_untake(sock, pkt);
 		return rv;
+	}
 
-	list_remove(&pkt->list);
 	packet_free(pkt);
 	return pktlen;
 }
@@ -0,0 +1,251 @@
+/*
+ * umem.c: user memory regions, filled in on demand
+ *
+ * Rather than allocating and mapping all of a process's memory up front, we
+ * record regions of its address space along with where their contents come
+ * from. Pages are allocated, filled and mapped when they are first touched:
+ * either by the process itself, via the abort handlers, or by the kernel,
+ * via copy_to_user() and copy_from_user().
+ *
+ * A region may also be backed by a struct umem_shared, a single physical copy
+ * of some contents which many processes map. Shared pages are mapped read-only.
+ * If the region is UMEM_COW, a write to one of them gives the process its own
+ * private copy of the page, otherwise the write is a fault.
+ */
+#include "kernel.h"
+#include "string.h"
+
+#define UMEM_AP_MASK (SLD__AP2 | SLD__AP1 | SLD__AP0)
+
+/**
+ * Take a reference to shared contents, making the physical copy if this is
+ * the first one. Return false if we're out of memory.
+ */
+static bool umem_shared_get(struct umem_shared *sh)
+{
+	uint32_t len = ALIGN(sh->len, PAGE_SIZE);
+	void *virt;
+
+	if (sh->refcount++)
+		return true;
+
+	virt = kmem_get_pages(len, 0);
+	if (!virt) {
+		sh->refcount--;
+		return false;
+	}
+	memcpy(virt, sh->src, sh->len);
+	memset(virt + sh->len, 0, len - sh->len);
+	sh->phys = kmem_lookup_phys(virt);
+
+	/* this may be text: it must reach memory before anybody fetches it */
+	dcache_clean_range(virt, len);
+	icache_inval_all();
+	return true;
+}
+
+static void umem_shared_put(struct umem_shared *sh)
+{
+	if (--sh->refcount == 0) {
+		free_pages(phys_allocator, sh->phys, ALIGN(sh->len, PAGE_SIZE));
+		sh->phys = 0;
+	}
+}
+
+static int add_region(struct process *p, uint32_t start, uint32_t len,
+                      uint32_t attrs, const void *src, uint32_t src_len,
+                      struct umem_shared *shared, uint32_t shared_off,
+                      uint32_t flags)
+{
+	struct umem_region *r;
+
+	len = ALIGN(len, PAGE_SIZE);
+	if (!vmem_mark_alloc(&p->vmem, start, len))
+		return -EINVAL;
+
+	r = kmalloc(sizeof(struct umem_region));
+	if (!r || (shared && !umem_shared_get(shared))) {
+		kfree(r);
+		vmem_free(&p->vmem, start, len);
+		return -ENOMEM;
+	}
+	r->start = start;
+	r->end = start + len;
+	r->attrs = attrs;
+	r->flags = flags;
+	r->src = src;
+	r->src_len = src_len;
+	r->shared = shared;
+	r->shared_off = shared_off;
+	list_insert(&p->regions, &r->list);
+	return 0;
+}
+
+/**
+ * Record a region of p's address space.
+ * start: first address (page aligned)
+ * len: length in bytes (rounded up to a page)
+ * attrs: attributes for pages in the region
+ * src: contents of the start of the region, or NULL
+ * src_len: bytes of src to use, anything beyond that is zero-filled
+ * Return 0 on success, or negative error.
+ */
+int umem_add_region(struct process *p, uint32_t start, uint32_t len,
+                    uint32_t attrs, const void *src, uint32_t src_len)
+{
+	return add_region(p, start, len, attrs, src, src_len, NULL, 0, 0);
+}
+
+/**
+ * Record a region of p's address space which maps shared contents, beginning
+ * at byte off (page aligned) of them. Pages beyond the shared contents are
+ * private and zero-filled. flags may contain UMEM_COW.
+ */
+int umem_add_shared(struct process *p, uint32_t start, uint32_t len,
+                    uint32_t attrs, struct umem_shared *shared, uint32_t off,
+                    uint32_t flags)
+{
+	return add_region(p, start, len, attrs, shared->src + off,
+	                  shared->len > off ? shared->len - off : 0, shared,
+	                  off, flags);
+}
+
+static struct umem_region *find_region(struct process *p, uint32_t addr)
+{
+	struct umem_region *r;
+	list_for_each_entry(r, &p->regions, list)
+	{
+		if (addr >= r->start && addr < r->end)
+			return r;
+	}
+	return NULL;
+}
+
+/**
+ * Return the physical address of the shared copy of the page at offset off
+ * within r, or 0 if the page isn't shared.
+ */
+static uint32_t shared_phys(struct umem_region *r, uint32_t off)
+{
+	if (!r->shared || off >= r->src_len)
+		return 0;
+	return r->shared->phys + r->shared_off + off;
+}
+
+/**
+ * Fill a freshly allocated page at offset off within region r. We write it
+ * through the linear map, so that p's mapping only appears once the page is
+ * complete, and so that p needn't be the current process.
+ */
+static void fill_page(struct umem_region *r, uint32_t off, uint32_t phys)
+{
+	uint32_t copy = 0;
+	void *virt = kmem_phys_to_virt(phys);
+
+	if (r->src && off < r->src_len) {
+		copy = min(r->src_len - off, PAGE_SIZE);
+		memcpy(virt, r->src + off, copy);
+	}
+	if (copy < PAGE_SIZE)
+		memset(virt + copy, 0, PAGE_SIZE - copy);
+}
+
+/**
+ * Give p a private copy of the page at offset off within r.
+ */
+static int map_private(struct process *p, struct umem_region *r, uint32_t off)
+{
+	uint32_t phys;
+	void *virt;
+
+	if (r->src && off < r->src_len) {
+		phys = alloc_pages(phys_allocator, PAGE_SIZE, 0);
+		if (!phys)
+			return -ENOMEM;
+		fill_page(r, off, phys);
+	} else {
+		/* nothing to copy, e.g. the stack */
+		virt = alloc_zeroed_pages(PAGE_SIZE, 0);
+		if (!virt)
+			return -ENOMEM;
+		phys = kmem_lookup_phys(virt);
+	}
+	if (umem_map_pages(p, r->start + off, phys, PAGE_SIZE, r->attrs) < 0) {
+		free_pages(phys_allocator, phys, PAGE_SIZE);
+		return -ENOMEM;
+	}
+	p->resident++;
+	return 0;
+}
+
+/**
+ * Resolve a fault at addr in p's address space.
+ * write: true if the access was a write
+ * Return 0 if the access may now be retried, -EFAULT if addr isn't in any
+ * region, -EACCES if the region doesn't allow it, or -ENOMEM if we're out of
+ * memory.
+ */
+int umem_fault(struct process *p, uint32_t addr, bool write)
+{
+	struct umem_region *r;
+	uint32_t phys, off, page = addr & ~(PAGE_SIZE - 1);
+	int rv;
+
+	r = find_region(p, page);
+	if (!r)
+		return -EFAULT;
+	if (write && (r->attrs & UMEM_AP_MASK) != PRW_URW)
+		return -EACCES;
+	off = page - r->start;
+
+	phys = umem_lookup_phys(p, (void *)page);
+	if (phys) {
+		/* mapped already, but perhaps read-only and copy-on-write */
+		if (!write || phys != shared_phys(r, off))
+			return 0;
+		if (!(r->flags & UMEM_COW))
+			return -EACCES;
+		rv = map_private(p, r, off);
+		if (rv == 0)
+			p->shared_resident--;
+		return rv;
+	}
+
+	phys = shared_phys(r, off);
+	if (phys && !(write && (r->flags & UMEM_COW))) {
+		rv = umem_map_pages(p, page, phys, PAGE_SIZE,
+		                    (r->attrs & ~UMEM_AP_MASK) | PRO_URO);
+		if (rv == 0)
+			p->shared_resident++;
+		return rv;
+	}
+	return map_private(p, r, off);
+}
+
+/**
+ * Free every private page which was faulted in, along with the region
+ * descriptors and references to shared contents. Only for use when the process
+ * is being destroyed: it never runs again, so it's fine to free pages before
+ * they're unmapped.
+ */
+void umem_free_regions(struct process *p)
+{
+	struct umem_region *r, *next;
+	uint32_t page, phys;
+
+	list_for_each_entry_safe(r, next, &p->regions, list)
+	{
+		for (page = r->start; page < r->end; page += PAGE_SIZE) {
+			phys = umem_lookup_phys(p, (void *)page);
+			if (phys && phys != shared_phys(r, page - r->start))
+				free_pages(phys_allocator, phys, PAGE_SIZE);
+		}
+		umem_unmap_pages(p, r->start, r->end - r->start);
+		if (r->shared)
+			umem_shared_put(r->shared);
+		list_remove(&r->list);
+		kfree(r);
+	}
+	p->resident = 0;
+	p->shared_resident = 0;
+}
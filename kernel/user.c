@@ -7,23 +7,37 @@
 #include "string.h"
 #include "sys/socket.h"
 
-static int check_bounds(const void *user, size_t n)
+/*
+ * User memory is paged in on demand, so fault in any page which isn't mapped
+ * yet, and copy any copy-on-write page we're about to write. This way, we
+ * never take a page fault in kernel mode.
+ */
+static int check_page(void *page, bool write)
+{
+	if (!write && umem_lookup_phys(current, page) != 0)
+		return 0;
+	if (umem_fault(current, (uint32_t)page, write) != 0)
+		return -EACCES;
+	return 0;
+}
+
+static int check_bounds(const void *user, size_t n, bool write)
 {
 	void *page;
 	void *first = (void *)user;
 	void *last = (void *)user + n - 1;
 
-	if (umem_lookup_phys(current, first) == 0)
+	if (check_page(first, write))
 		return -EACCES;
 
 	page = (void *)(((uint32_t)first & (~0xFFF)) + 0x1000);
 	while (page < last) {
-		if (umem_lookup_phys(current, page) == 0)
+		if (check_page(page, write))
 			return -EACCES;
 		page = (void *)((uint32_t)page + 0x1000);
 	}
 
-	if (umem_lookup_phys(current, last) == 0)
+	if (check_page(last, write))
 		return -EACCES;
 
 	return 0;
@@ -31,7 +45,7 @@ static int check_bounds(const void *user, size_t n)
 
 int copy_from_user(void *kerndst, const void *usersrc, size_t n)
 {
-	int rv = check_bounds(usersrc, n);
+	int rv = check_bounds(usersrc, n, false);
 	if (rv < 0)
 		return rv;
 	memcpy(kerndst, usersrc, n);
@@ -40,7 +54,7 @@ int copy_from_user(void *kerndst, const void *usersrc, size_t n)
 
 int copy_to_user(void *userdst, const void *kernsrc, size_t n)
 {
-	int rv = check_bounds(userdst, n);
+	int rv = check_bounds(userdst, n, true);
 	if (rv < 0)
 		return rv;
 	memcpy(userdst, kernsrc, n);
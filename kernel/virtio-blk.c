@@ -48,13 +48,13 @@ struct virtio_blk {
 #define HI32(u64) ((uint32_t)((0xFFFFFFFF00000000ULL & (u64)) >> 32))
 #define LO32(u64) ((uint32_t)(0x00000000FFFFFFFFULL & (u64)))
 
-static void virtio_blk_handle_used(struct virtio_blk *dev, uint32_t usedidx)
+static void virtio_blk_handle_used(struct virtio_blk *dev, uint16_t usedidx)
 {
 	struct virtqueue *virtq = dev->virtq;
 	uint32_t desc1, desc2, desc3;
 	struct virtio_blk_req *req;
 
-	desc1 = virtq->used->ring[usedidx].id;
+	desc1 = virtq->used->ring[virtq_slot(virtq, usedidx)].id;
 	if (!(virtq->desc[desc1].flags & VIRTQ_DESC_F_NEXT))
 		goto bad_desc;
 	desc2 = virtq->desc[desc1].next;
@@ -67,6 +67,8 @@ static void virtio_blk_handle_used(struct virtio_blk *dev, uint32_t usedidx)
 		goto bad_desc;
 
 	req = virtq->desc_virt[desc1];
+	if (req->blkreq.type == BLKREQ_READ)
+		dcache_inval_range(req->blkreq.buf, VIRTIO_BLK_SECTOR_SIZE);
 
 	virtq_free_desc(virtq, desc1);
 	virtq_free_desc(virtq, desc2);
@@ -109,7 +111,7 @@ static struct virtio_blk *virtio_blk_get_dev_by_intid(uint32_t intid)
 
 static void virtio_blk_isr(uint32_t intid, struct ctx *ctx)
 {
-	int i, len;
+	uint16_t i;
 	struct virtio_blk *dev = virtio_blk_get_dev_by_intid(intid);
 
 	if (!dev) {
@@ -118,25 +120,23 @@ static void virtio_blk_isr(uint32_t intid, struct ctx *ctx)
 		return; /* just to make it obvious we won't continue */
 	}
 
-	len = dev->virtq->len;
-
 	WRITE32(dev->regs->InterruptACK, READ32(dev->regs->InterruptStatus));
 
-	for (i = dev->virtq->seen_used; i != (dev->virtq->used->idx % len);
-	     i = wrap(i + 1, len)) {
+	for (i = dev->virtq->seen_used; i != dev->virtq->used->idx; i++)
 		virtio_blk_handle_used(dev, i);
-	}
-	dev->virtq->seen_used = dev->virtq->used->idx % len;
+	dev->virtq->seen_used = i;
 
 	gic_end_interrupt(intid);
 }
 
 static void virtio_blk_send(struct virtio_blk *blk, struct virtio_blk_req *hdr)
 {
-	blk->virtq->avail->ring[blk->virtq->avail->idx % blk->virtq->len] =
+	struct virtqueue *virtq = blk->virtq;
+
+	virtq->avail->ring[virtq_slot(virtq, virtq->avail->idx)] =
 	        hdr->descriptor;
 	mb();
-	blk->virtq->avail->idx += 1;
+	virtq->avail->idx += 1;
 	mb();
 	WRITE32(blk->regs->QueueNotify, 0);
 }
@@ -162,10 +162,17 @@ static int virtio_blk_status(struct blkdev *dev)
 	return 0;
 }
 
+static void virtio_blk_req_ctor(void *obj)
+{
+	struct virtio_blk_req *vblkreq = obj;
+	vblkreq->reserved = 0;
+	vblkreq->status = 0;
+	blkreq_init(&vblkreq->blkreq);
+}
+
 static struct blkreq *virtio_blk_alloc(struct blkdev *dev)
 {
 	struct virtio_blk_req *vblkreq = slab_alloc(blkreq_slab);
-	blkreq_init(&vblkreq->blkreq);
 	return &vblkreq->blkreq;
 }
 
@@ -175,6 +182,27 @@ static void virtio_blk_free(struct blkdev *dev, struct blkreq *req)
 	slab_free(blkreq_slab, vblkreq);
 }
 
+static unsigned int virtio_blk_alloc_bulk(struct blkdev *dev,
+                                          struct blkreq **reqs, unsigned int n)
+{
+	unsigned int i, got = slab_alloc_bulk(blkreq_slab, (void **)reqs, n);
+	struct virtio_blk_req *vblkreq;
+	for (i = 0; i < got; i++) {
+		vblkreq = (struct virtio_blk_req *)reqs[i];
+		reqs[i] = &vblkreq->blkreq;
+	}
+	return got;
+}
+
+static void virtio_blk_free_bulk(struct blkdev *dev, struct blkreq **reqs,
+                                 unsigned int n)
+{
+	unsigned int i;
+	for (i = 0; i < n; i++)
+		reqs[i] = (struct blkreq *)get_vblkreq(reqs[i]);
+	slab_free_bulk(blkreq_slab, (void **)reqs, n);
+}
+
 static void virtio_blk_submit(struct blkdev *dev, struct blkreq *req)
 {
 	struct virtio_blk *blk = get_vblkdev(dev);
@@ -189,6 +217,12 @@ static void virtio_blk_submit(struct blkdev *dev, struct blkreq *req)
 	}
 	hdr->sector = req->blkidx;
 
+	/* The header lives in uncached memory, but the data buffer does not */
+	if (req->type == BLKREQ_READ)
+		dcache_clean_inval_range(req->buf, VIRTIO_BLK_SECTOR_SIZE);
+	else
+		dcache_clean_range(req->buf, VIRTIO_BLK_SECTOR_SIZE);
+
 	d1 = virtq_alloc_desc(blk->virtq, hdr);
 	hdr->descriptor = d1;
 	blk->virtq->desc[d1].len = VIRTIO_BLK_REQ_HEADER_SIZE;
@@ -212,9 +246,11 @@ static void virtio_blk_submit(struct blkdev *dev, struct blkreq *req)
 static void maybe_virtio_mod_init(void)
 {
 	if (!blkreq_slab) {
-		blkreq_slab =
-		        slab_new("virtio_blk_req",
-		                 sizeof(struct virtio_blk_req), kmem_get_page);
+		blkreq_slab = slab_new_ctor(
+		        "virtio_blk_req", sizeof(struct virtio_blk_req),
+		        SLAB_ORDER_AUTO, kmem_get_uncached_slab_pages,
+		        kmem_free_slab_pages, virtio_blk_req_ctor, NULL);
+		slab_enable_magazines(blkreq_slab);
 		INIT_LIST_HEAD(vdevs);
 		INIT_SPINSEM(&vdev_list_lock, 1);
 	}
@@ -223,6 +259,8 @@ static void maybe_virtio_mod_init(void)
 struct blkdev_ops virtio_blk_ops = {
 	.alloc = virtio_blk_alloc,
 	.free = virtio_blk_free,
+	.alloc_bulk = virtio_blk_alloc_bulk,
+	.free_bulk = virtio_blk_free_bulk,
 	.submit = virtio_blk_submit,
 	.status = virtio_blk_status,
 };
@@ -232,7 +270,7 @@ int virtio_blk_init(virtio_regs *regs, uint32_t intid)
 	struct virtio_blk *vdev;
 	struct virtqueue *virtq;
 	int flags;
-	uint32_t genbefore, genafter;
+	uint32_t genbefore, genafter, len;
 
 	maybe_virtio_mod_init();
 	vdev = kmalloc(sizeof(struct virtio_blk));
@@ -247,7 +285,12 @@ int virtio_blk_init(virtio_regs *regs, uint32_t intid)
 		return -1;
 	}
 
-	virtq = virtq_create(128);
+	len = virtq_choose_len(regs, 0, CONFIG_VIRTIO_BLK_QUEUE);
+	virtq = virtq_create(len);
+	if (!virtq) {
+		puts("error: virtio-blk queue setup failed\n");
+		return -1;
+	}
 	virtq_add_to_device(regs, virtq, 0);
 
 	vdev->regs = regs;
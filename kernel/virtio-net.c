@@ -48,53 +48,91 @@ struct virtio_cap net_caps[] = {
 	VIRTIO_INDP_CAPS
 };
 
+/**
+ * Headers are set up for transmit, with no offloads. On receive, the device
+ * overwrites them anyway. They live in uncached pages, so unlike the packet
+ * data they need no cache maintenance.
+ */
+static void nethdr_ctor(void *obj)
+{
+	struct virtio_net_hdr *hdr = obj;
+	hdr->flags = 0;
+	hdr->gso_type = VIRTIO_NET_HDR_GSO_NONE;
+	hdr->hdr_len = 0;  /* not used unless we have segmentation offload */
+	hdr->gso_size = 0; /* same */
+	hdr->csum_start = 0;
+	hdr->csum_offset = 0;
+	hdr->num_buffers = 0;
+	hdr->packet = NULL;
+}
+
 static void maybe_init_nethdr_slab(void)
 {
-	if (!nethdr_slab)
-		nethdr_slab =
-		        slab_new("virtio_net_hdr",
-		                 sizeof(struct virtio_net_hdr), kmem_get_page);
+	if (!nethdr_slab) {
+		nethdr_slab = slab_new_ctor(
+		        "virtio_net_hdr", sizeof(struct virtio_net_hdr),
+		        SLAB_ORDER_AUTO, kmem_get_uncached_slab_pages,
+		        kmem_free_slab_pages, nethdr_ctor, NULL);
+		slab_enable_magazines(nethdr_slab);
+	}
 }
 
-void add_packets_to_virtqueue(int n, struct virtqueue *virtq)
+/*
+ * Post up to n empty packets to the RX queue, and return how many we could
+ * allocate.
+ */
+static int add_packets_to_virtqueue(int n, struct virtqueue *virtq)
 {
-	int i;
+	int i, j, batch, nhdrs, got, added = 0;
 	uint32_t d1, d2;
-	struct virtio_net_hdr *hdr;
-	struct packet *pkt;
-	for (i = 0; i < n; i++) {
-		hdr = slab_alloc(nethdr_slab);
-		pkt = packet_alloc();
-		hdr->packet = pkt;
-		d1 = virtq_alloc_desc(virtq, hdr);
-		d2 = virtq_alloc_desc(virtq, pkt->data);
-		virtq->desc[d1].len = VIRTIO_NET_HDRLEN;
-		virtq->desc[d1].flags = VIRTQ_DESC_F_WRITE | VIRTQ_DESC_F_NEXT;
-		virtq->desc[d1].next = d2;
-		virtq->desc[d2].len = PACKET_CAPACITY;
-		virtq->desc[d2].flags = VIRTQ_DESC_F_WRITE;
-		pkt->capacity = PACKET_CAPACITY;
-		virtq->avail->ring[virtq->avail->idx + i] = d1;
+	struct virtio_net_hdr *hdrs[VIRTIO_NET_RX_BATCH];
+	struct packet *pkts[VIRTIO_NET_RX_BATCH];
+	for (i = 0; i < n; i += batch) {
+		batch = min(n - i, VIRTIO_NET_RX_BATCH);
+		nhdrs = slab_alloc_bulk(nethdr_slab, (void **)hdrs, batch);
+		got = packet_alloc_bulk(pkts, nhdrs);
+		if (got < nhdrs) /* headers without a packet to go with */
+			slab_free_bulk(nethdr_slab, (void **)&hdrs[got],
+			               nhdrs - got);
+		for (j = 0; j < got; j++) {
+			hdrs[j]->packet = pkts[j];
+			dcache_clean_inval_range(pkts[j]->data,
+			                         PACKET_CAPACITY);
+			d1 = virtq_alloc_desc(virtq, hdrs[j]);
+			d2 = virtq_alloc_desc(virtq, pkts[j]->data);
+			virtq->desc[d1].len = VIRTIO_NET_HDRLEN;
+			virtq->desc[d1].flags =
+			        VIRTQ_DESC_F_WRITE | VIRTQ_DESC_F_NEXT;
+			virtq->desc[d1].next = d2;
+			virtq->desc[d2].len = PACKET_CAPACITY;
+			virtq->desc[d2].flags = VIRTQ_DESC_F_WRITE;
+			virtq->avail->ring[virtq_slot(
+			        virtq, virtq->avail->idx + added + j)] = d1;
+		}
+		added += got;
+		if (got < batch) {
+			printf("virtio-net: out of memory, only %d of %d RX "
+			       "buffers\n", added, n);
+			break;
+		}
 	}
 	mb();
-	virtq->avail->idx += n;
+	virtq->avail->idx += added;
+	return added;
 }
 
 void virtio_net_send(struct virtio_net *dev, struct packet *pkt)
 {
 	uint32_t d1, d2;
+	int flags;
 	struct virtio_net_hdr *hdr =
 	        (struct virtio_net_hdr *)slab_alloc(nethdr_slab);
 
-	hdr->flags = 0;
-	hdr->gso_type = VIRTIO_NET_HDR_GSO_NONE;
-	hdr->hdr_len = 0;  /* not used unless we have segmentation offload */
-	hdr->gso_size = 0; /* same */
-	hdr->csum_start = 0;
-	hdr->csum_offset = 0;
-	hdr->num_buffers = 0xDEAD;
 	hdr->packet = pkt;
+	dcache_clean_range(pkt->ll, pkt->end - pkt->ll);
 
+	/* the TX interrupt returns descriptors to the free list */
+	irqsave(&flags);
 	d1 = virtq_alloc_desc(dev->tx, (void *)hdr);
 	dev->tx->desc[d1].len = VIRTIO_NET_HDRLEN;
 	dev->tx->desc[d1].flags = VIRTQ_DESC_F_NEXT;
@@ -105,13 +143,27 @@ void virtio_net_send(struct virtio_net *dev, struct packet *pkt)
 
 	dev->tx->desc[d1].next = d2;
 
-	dev->tx->avail->ring[dev->tx->avail->idx] = d1;
+	dev->tx->avail->ring[virtq_slot(dev->tx, dev->tx->avail->idx)] = d1;
 	mb();
 	dev->tx->avail->idx += 1;
+	irqrestore(&flags);
 	mb();
 	WRITE32(dev->regs->QueueNotify, VIRTIO_NET_Q_TX);
 }
 
+/*
+ * Average a 64-bit total over count. We have no 64-bit division, so scale both
+ * down until the total fits in 32 bits, which loses only the low bits.
+ */
+static uint32_t cycles_per(uint64_t total, uint32_t count)
+{
+	while (total >> 32) {
+		total >>= 1;
+		count >>= 1;
+	}
+	return count ? (uint32_t)total / count : 0;
+}
+
 int virtio_net_cmd_status(int argc, char **argv)
 {
 	printf("virtio_net_dev at 0x%x\n",
@@ -134,66 +186,111 @@ int virtio_net_cmd_status(int argc, char **argv)
 	WRITE32(netdev.regs->QueueSel, VIRTIO_NET_Q_RX);
 	mb();
 	printf("    ready = 0x%x\n", READ32(netdev.regs->QueueReady));
+	if (netdev.rx_count) {
+		printf("  rx path: %u packets, %u cycles/packet "
+		       "(%u cycles/packet refilling)\n",
+		       netdev.rx_count,
+		       cycles_per(netdev.rx_cycles, netdev.rx_count),
+		       cycles_per(netdev.rx_refill_cycles, netdev.rx_count));
+		if (netdev.rx_dropped)
+			printf("  rx dropped: %u packets (out of memory)\n",
+			       netdev.rx_dropped);
+	}
 	return 0;
 }
 
-void virtio_handle_rxused(struct virtio_net *dev, uint32_t idx)
+/**
+ * Pass the received packet up the stack, and put the fresh packet in its place
+ * in the RX queue. With no fresh packet, drop the received one and reuse it, so
+ * the ring never runs dry.
+ */
+void virtio_handle_rxused(struct virtio_net *dev, uint16_t idx,
+                          struct packet *fresh)
 {
-	uint32_t d1 = dev->rx->used->ring[idx].id;
+	uint32_t refill;
+	uint32_t d1 = dev->rx->used->ring[virtq_slot(dev->rx, idx)].id;
 	uint32_t d2 = dev->rx->desc[d1].next;
-	uint32_t len = dev->rx->used->ring[idx].len;
+	uint32_t len = dev->rx->used->ring[virtq_slot(dev->rx, idx)].len;
 	struct virtio_net_hdr *hdr =
 	        (struct virtio_net_hdr *)dev->rx->desc_virt[d1];
 	/* We can get this from d2, but hdr->packet is more foolproof, since we
 	 * don't necessarily know the offset into the packet structure which d2
 	 * will point at. */
 	struct packet *pkt = hdr->packet;
-	pkt->ll = dev->rx->desc_virt[d2];
-	pkt->end = pkt->ll + (len - VIRTIO_NET_HDRLEN);
-	eth_recv(&nif, pkt);
 
-	/* eth_recv takes ownership of pkt, we will put a new packet in there
-	 * and stick the descriptor back into the avail queue */
-	pkt = packet_alloc();
+	if (fresh) {
+		/* drop lines the CPU may have speculatively fetched during the
+		 * DMA */
+		dcache_inval_range(dev->rx->desc_virt[d2],
+		                   len - VIRTIO_NET_HDRLEN);
+		pkt->ll = dev->rx->desc_virt[d2];
+		pkt->end = pkt->ll + (len - VIRTIO_NET_HDRLEN);
+		eth_recv(&nif, pkt);
+		/* eth_recv takes ownership of pkt, we will put a new packet in
+		 * there */
+		pkt = fresh;
+	} else {
+		dev->rx_dropped += 1;
+	}
+
+	/* stick the descriptor back into the avail queue */
+	refill = get_cycles();
 	hdr->packet = pkt;
 	dev->rx->desc[d2].addr = kmem_lookup_phys(&pkt->data);
 	dev->rx->desc_virt[d2] = &pkt->data;
+	dcache_clean_inval_range(&pkt->data, PACKET_CAPACITY);
 
-	dev->rx->avail->ring[dev->rx->avail->idx] = d1;
-	dev->rx->avail->ring[wrap(dev->rx->avail->idx + 1, dev->rx->len)] = d2;
+	/* only the head of the chain goes back in the ring */
+	dev->rx->avail->ring[virtq_slot(dev->rx, dev->rx->avail->idx)] = d1;
 	mb();
-	dev->rx->avail->idx = wrap(dev->rx->avail->idx + 2, dev->rx->len);
+	dev->rx->avail->idx += 1;
+
+	dev->rx_count += 1;
+	dev->rx_refill_cycles += get_cycles() - refill;
 }
 
-void virtio_handle_txused(struct virtio_net *dev, uint32_t idx)
+void virtio_handle_txused(struct virtio_net *dev, uint16_t idx)
 {
-	uint32_t d1 = dev->tx->used->ring[idx].id;
+	uint32_t d1 = dev->tx->used->ring[virtq_slot(dev->tx, idx)].id;
+	uint32_t d2 = dev->tx->desc[d1].next;
 
 	struct virtio_net_hdr *hdr =
 	        (struct virtio_net_hdr *)dev->tx->desc_virt[d1];
 	struct packet *pkt = hdr->packet;
 
+	virtq_free_desc(dev->tx, d2);
+	virtq_free_desc(dev->tx, d1);
 	slab_free(nethdr_slab, hdr);
 	packet_free(pkt);
 }
 
 void virtio_net_isr(uint32_t intid, struct ctx *ctx)
 {
-	uint32_t i;
+	uint32_t j, n, got, start;
+	uint16_t i;
+	struct packet *fresh[VIRTIO_NET_RX_BATCH];
 	struct virtio_net *dev = &netdev;
 	uint32_t stat = READ32(dev->regs->InterruptStatus);
 	WRITE32(dev->regs->InterruptACK, stat);
 
-	for (i = dev->rx->seen_used; i != dev->rx->used->idx;
-	     i = wrap(i + 1, 32)) {
-		virtio_handle_rxused(dev, i);
+	/* Allocate replacement packets for a batch of used buffers at once. If
+	 * we run short, the rest of the batch is dropped and its buffers go
+	 * straight back to the device. */
+	i = dev->rx->seen_used;
+	while (i != dev->rx->used->idx) {
+		n = (uint16_t)(dev->rx->used->idx - i);
+		n = min(n, VIRTIO_NET_RX_BATCH);
+		start = get_cycles();
+		got = packet_alloc_bulk(fresh, n);
+		dev->rx_refill_cycles += get_cycles() - start;
+		for (j = 0; j < n; j++, i++)
+			virtio_handle_rxused(dev, i, j < got ? fresh[j] : NULL);
+		dev->rx_cycles += get_cycles() - start;
 	}
-	dev->rx->seen_used = dev->rx->used->idx;
-	for (i = dev->tx->seen_used; i != dev->tx->used->idx;
-	     i = wrap(i + 1, 32)) {
+	dev->rx->seen_used = i;
+	for (i = dev->tx->seen_used; i != dev->tx->used->idx; i++)
 		virtio_handle_txused(dev, i);
-	}
-	dev->tx->seen_used = dev->tx->used->idx;
+	dev->tx->seen_used = i;
 	gic_end_interrupt(intid);
 }
 
@@ -201,6 +298,8 @@ int virtio_net_init(virtio_regs *regs, uint32_t intid)
 {
 	volatile struct virtio_net_config *cfg =
 	        (struct virtio_net_config *)regs->Config;
+	uint32_t len;
+
 	virtio_check_capabilities(regs, net_caps, nelem(net_caps),
 	                          "virtio-net");
 
@@ -213,8 +312,14 @@ int virtio_net_init(virtio_regs *regs, uint32_t intid)
 
 	netdev.regs = regs;
 	netdev.cfg = cfg;
-	netdev.tx = virtq_create(128);
-	netdev.rx = virtq_create(128);
+	len = virtq_choose_len(regs, VIRTIO_NET_Q_RX, CONFIG_VIRTIO_NET_QUEUE);
+	netdev.rx = virtq_create(len);
+	len = virtq_choose_len(regs, VIRTIO_NET_Q_TX, CONFIG_VIRTIO_NET_QUEUE);
+	netdev.tx = virtq_create(len);
+	if (!netdev.rx || !netdev.tx) {
+		puts("error: virtio-net queue setup failed\n");
+		return -1;
+	}
 
 	nif.ip = 0;
 	memcpy(&nif.mac, (void *)&cfg->mac, 6);
@@ -222,8 +327,12 @@ int virtio_net_init(virtio_regs *regs, uint32_t intid)
 	nif.subnet_mask = 0;
 	nif.dev = &netdev;
 
+	/* fill the RX queue, two descriptors (header and data) per packet */
 	maybe_init_nethdr_slab();
-	add_packets_to_virtqueue(64, netdev.rx);
+	if (!add_packets_to_virtqueue(netdev.rx->len / 2, netdev.rx)) {
+		puts("error: virtio-net has no RX buffers\n");
+		return -1;
+	}
 
 	virtq_add_to_device(regs, netdev.rx, VIRTIO_NET_Q_RX);
 	virtq_add_to_device(regs, netdev.tx, VIRTIO_NET_Q_TX);
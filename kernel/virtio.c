@@ -11,6 +11,30 @@
 #include "slab.h"
 #include "string.h"
 
+/**
+ * Return the largest power of two queue length up to want, which the device
+ * supports for the queue queue_sel, or 0 if the queue isn't available.
+ */
+uint32_t virtq_choose_len(volatile virtio_regs *regs, uint32_t queue_sel,
+                          uint32_t want)
+{
+	uint32_t max, len = 1;
+
+	WRITE32(regs->QueueSel, queue_sel);
+	mb();
+	max = READ32(regs->QueueNumMax);
+	max = min(max, VIRTQ_MAX_LEN);
+	if (!max)
+		return 0;
+	while (len * 2 <= want && len * 2 <= max)
+		len *= 2;
+	return len;
+}
+
+/**
+ * Allocate a virtqueue of len descriptors. The rings are physically contiguous
+ * pages, as many as it takes.
+ */
 struct virtqueue *virtq_create(uint32_t len)
 {
 	int i;
@@ -31,14 +55,19 @@ struct virtqueue *virtq_create(uint32_t len)
 	        ALIGN(off_avail_event + sizeof(uint16_t), sizeof(void *));
 	uint32_t memsize = off_desc_virt + len * sizeof(void *);
 
-	if (memsize > PAGE_SIZE) {
-		printf("virtq_create: error, too big for a page\n");
+	if (!len || (len & (len - 1)) || len > VIRTQ_MAX_LEN) {
+		printf("virtq_create: error, bad queue length %u\n", len);
+		return NULL;
+	}
+	/* the device reads and writes the rings under us, so skip the cache */
+	memsize = ALIGN(memsize, PAGE_SIZE);
+	page_virt = (uint32_t)kmem_get_uncached_pages(memsize, 0);
+	if (!page_virt) {
+		printf("virtq_create: error, no memory for %u bytes\n",
+		       memsize);
 		return NULL;
 	}
-	page_phys = alloc_pages(phys_allocator, PAGE_SIZE, 0);
-	page_virt = alloc_pages(kern_virt_allocator, PAGE_SIZE, 0);
-	kmem_map_pages(page_virt, page_phys, PAGE_SIZE,
-	               PRW_UNA | EXECUTE_NEVER);
+	page_phys = kmem_lookup_phys((void *)page_virt);
 
 	virtq = (struct virtqueue *)page_virt;
 	virtq->phys = page_phys;
@@ -218,7 +247,7 @@ void virtio_init(void)
 {
 	/* TODO: we know these addresses due to manually reading device tree,
 	 * but we should automate that */
-	uint32_t page_virt = alloc_pages(kern_virt_allocator, 0x4000, 0);
+	uint32_t page_virt = vmem_alloc(kern_virt_allocator, 0x4000, 0);
 	kmem_map_pages(page_virt, 0x0a000000U, 0x4000,
 	               DEVICE_SHAREABLE | KMEM_PERM_DATA);
 
@@ -12,7 +12,6 @@
 #define VIRTIO_VERSION 0x2
 #define VIRTIO_DEV_NET 0x1
 #define VIRTIO_DEV_BLK 0x2
-#define wrap(x, len)   ((x) & ~(len))
 
 /*
  * See Section 4.2.2 of VIRTIO 1.0 Spec:
@@ -104,14 +103,15 @@ struct virtqueue_used {
 } __attribute__((packed));
 
 /*
- * For simplicity, we lay out the virtqueue in contiguous memory on a single
- * page. See virtq_create for the layout and alignment requirements.
+ * For simplicity, we lay out the virtqueue in physically contiguous memory,
+ * which may span several pages. See virtq_create for the layout and alignment
+ * requirements.
  */
 struct virtqueue {
 	/* Physical base address of the full data structure. */
 	uint32_t phys;
-	uint32_t len;
-	uint32_t seen_used;
+	uint32_t len; /* a power of two, at most VIRTQ_MAX_LEN */
+	uint16_t seen_used;
 	uint32_t free_desc;
 
 	volatile struct virtqueue_desc *desc;
@@ -122,6 +122,15 @@ struct virtqueue {
 	void **desc_virt;
 } __attribute__((packed));
 
+/* Largest queue the spec allows */
+#define VIRTQ_MAX_LEN 32768
+
+/*
+ * The avail and used indices run freely, wrapping at 2^16. Since len is a
+ * power of two, the ring slot for an index is just its low bits.
+ */
+#define virtq_slot(virtq, idx) ((idx) & ((virtq)->len - 1))
+
 struct virtio_blk_config {
 	uint64_t capacity;
 	uint32_t size_max;
@@ -192,6 +201,9 @@ struct virtio_net_hdr {
 
 #define VIRTIO_NET_HDRLEN 10
 
+/* RX buffers are allocated and refilled this many at a time */
+#define VIRTIO_NET_RX_BATCH 16
+
 #define VIRTIO_NET_Q_RX 0
 #define VIRTIO_NET_Q_TX 1
 
@@ -200,11 +212,20 @@ struct virtio_net {
 	volatile struct virtio_net_config *cfg;
 	struct virtqueue *rx;
 	struct virtqueue *tx;
+
+	/* RX path measurements, in cycles (see netstatus). The totals are 64
+	 * bits, since 32 would wrap after a few seconds of traffic. */
+	uint32_t rx_count;
+	uint32_t rx_dropped;
+	uint64_t rx_cycles;
+	uint64_t rx_refill_cycles;
 };
 
 /*
  * virtqueue routines
  */
+uint32_t virtq_choose_len(volatile virtio_regs *regs, uint32_t queue_sel,
+                          uint32_t want);
 struct virtqueue *virtq_create(uint32_t len);
 uint32_t virtq_alloc_desc(struct virtqueue *virtq, void *addr);
 void virtq_free_desc(struct virtqueue *virtq, uint32_t desc);
@@ -7,7 +7,7 @@
 
 void wait_list_init(struct waitlist *wl)
 {
-	INIT_HLIST_HEAD(wl->waiting);
+	INIT_LIST_HEAD(wl->waiting);
 	wl->waitcount = 0;
 	INIT_SPINSEM(&wl->waitlock, 1);
 	wl->triggered = false;
@@ -21,32 +21,103 @@ void wait_list_destroy(struct waitlist *wl)
 	}
 }
 
-void wait_for(struct waitlist *wl)
+/* Called with the waitlock held */
+static void wait_remove(struct waitlist *wl, struct waiter *w)
+{
+	list_remove(&w->list);
+	w->list.next = NULL;
+	wl->waitcount--;
+}
+
+int wake_n(struct waitlist *wl, int n)
+{
+	struct waiter *w, *next;
+	int flags, woken = 0;
+
+	spin_acquire_irqsave(&wl->waitlock, &flags);
+	list_for_each_entry_safe(w, next, &wl->waiting, list)
+	{
+		if (w->exclusive && n-- <= 0)
+			break; /* only exclusive waiters remain */
+		wait_remove(wl, w);
+		w->woken = true;
+		ready_enqueue(w->proc);
+		woken++;
+	}
+	spin_release_irqrestore(&wl->waitlock, &flags);
+	return woken;
+}
+
+static void wait_timeout(void *arg)
+{
+	struct waiter *w = arg;
+
+	w->timed_out = true;
+	ready_enqueue(w->proc);
+}
+
+void wait_init(struct waiter *w, bool exclusive, uint32_t ms)
+{
+	w->list.next = NULL;
+	w->proc = current;
+	w->exclusive = exclusive;
+	w->woken = false;
+	w->timed_out = false;
+	wheel_timer_init(&w->timer, wait_timeout, w);
+	if (ms)
+		timer_add(&w->timer, ms);
+}
+
+void wait_prepare(struct waitlist *wl, struct waiter *w)
 {
 	int flags;
-	struct waiter waiter;
+
 	spin_acquire_irqsave(&wl->waitlock, &flags);
-	if (wl->triggered) {
-		spin_release_irqrestore(&wl->waitlock, &flags);
-		return;
+	w->woken = false;
+	if (!w->list.next) {
+		if (w->exclusive)
+			list_insert_end(&wl->waiting, &w->list);
+		else
+			list_insert(&wl->waiting, &w->list);
+		wl->waitcount++;
 	}
-	waiter.proc = current;
-	wl->waitcount++;
-	hlist_insert(&wl->waiting, &waiter.list);
-	current->flags.pr_ready = 0;
 	spin_release_irqrestore(&wl->waitlock, &flags);
-	schedule();
 }
 
-void wait_list_awaken(struct waitlist *wl)
+int wait_sleep(struct waitlist *wl, struct waiter *w)
 {
-	struct waiter *waiter;
 	int flags;
+
 	spin_acquire_irqsave(&wl->waitlock, &flags);
-	wl->triggered = true;
-	list_for_each_entry(waiter, &wl->waiting, list)
-	{
-		waiter->proc->flags.pr_ready = 1;
+	if (w->woken || w->timed_out) {
+		/* woken since wait_prepare(), go check the condition again */
+		spin_release_irqrestore(&wl->waitlock, &flags);
+	} else {
+		ready_dequeue(current);
+		spin_release_irqrestore(&wl->waitlock, &flags);
+		schedule();
 	}
+	return w->timed_out ? -ETIMEDOUT : 0;
+}
+
+void wait_finish(struct waitlist *wl, struct waiter *w)
+{
+	int flags;
+
+	timer_cancel(&w->timer);
+	spin_acquire_irqsave(&wl->waitlock, &flags);
+	if (w->list.next)
+		wait_remove(wl, w);
 	spin_release_irqrestore(&wl->waitlock, &flags);
 }
+
+void wait_for(struct waitlist *wl)
+{
+	wait_event(wl, wl->triggered);
+}
+
+void wait_list_awaken(struct waitlist *wl)
+{
+	wl->triggered = true;
+	wake_all(wl);
+}
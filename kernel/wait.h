@@ -5,29 +5,43 @@
  * allocate a struct waitlist, or initialize a struct waitlist embedded within
  * some other data structure.
  *
- * Anything which would like to wait on another thread should initialize a
- * struct waiter, and use wait_for() to go to sleep until woken by the waitlist.
- * When the owner of the waitlist wants to trigger the waiting processes
- * (perhaps causing a stampeding herd but we don't worry about that yet), it
- * calls wait_list_awaken(), which awakens each kthread and empties the
- * waitlist.
+ * Threads wait for a condition with wait_event(wl, cond), which sleeps until
+ * cond is true. Whoever makes it true then calls one of the wake functions.
+ * The waiter puts itself on the list before it checks the condition, so a
+ * wakeup can't slip in between and get lost. A waitlist can be used for as
+ * long as you like, and the condition is re-checked after every wakeup.
+ *
+ * Waiters are either shared or exclusive. wake_n() wakes every shared waiter,
+ * but only n of the exclusive ones, in the order they started waiting. So when
+ * each wakeup hands out one thing (a packet, say), many threads can wait for it
+ * with wait_event_exclusive() without all of them waking for every one.
+ *
+ * For events which happen once, like the completion of a request,
+ * wait_list_awaken() marks the waitlist triggered and wakes everybody, and
+ * wait_for() waits until it's triggered.
  */
 #pragma once
 
 #include "list.h"
 #include "sync.h"
+#include "wheel.h"
 #include <stdbool.h>
+#include <stdint.h>
 
 struct waitlist {
-	struct hlist_head waiting;
+	struct list_head waiting; /* shared waiters first, then exclusive */
 	int waitcount;
 	spinsem_t waitlock;
 	bool triggered;
 };
 
 struct waiter {
-	struct hlist_head list;
+	struct list_head list; /* next is NULL while not on the list */
 	struct process *proc;
+	bool exclusive;
+	bool woken;
+	bool timed_out;
+	struct wheel_timer timer;
 };
 
 /**
@@ -46,6 +60,71 @@ void wait_list_init(struct waitlist *wl);
  */
 void wait_list_destroy(struct waitlist *wl);
 
+/**
+ * @brief Wake waiters
+ * @param wl waitlist to wake
+ * @param n count of exclusive waiters to wake, shared ones all wake
+ * @return count of waiters woken
+ */
+int wake_n(struct waitlist *wl, int n);
+
+static inline int wake_one(struct waitlist *wl)
+{
+	return wake_n(wl, 1);
+}
+
+static inline int wake_all(struct waitlist *wl)
+{
+	return wake_n(wl, INT32_MAX);
+}
+
+/*
+ * The steps of wait_event(), which you shouldn't need to call yourself.
+ * wait_init() sets up the waiter, with a timeout unless ms is 0.
+ * wait_prepare() puts it on the list, if a wakeup took it off.
+ * wait_sleep() blocks unless we were woken since wait_prepare(). It returns
+ * -ETIMEDOUT once the timeout has passed.
+ * wait_finish() takes the waiter off the list and cancels the timeout.
+ */
+void wait_init(struct waiter *w, bool exclusive, uint32_t ms);
+void wait_prepare(struct waitlist *wl, struct waiter *w);
+int wait_sleep(struct waitlist *wl, struct waiter *w);
+void wait_finish(struct waitlist *wl, struct waiter *w);
+
+#define __wait_event(wl, cond, exclusive, ms)                                  \
+	({                                                                     \
+		struct waiter __w;                                             \
+		int __rv = 0;                                                  \
+		wait_init(&__w, exclusive, ms);                                \
+		for (;;) {                                                     \
+			wait_prepare(wl, &__w);                                \
+			if (cond)                                              \
+				break;                                         \
+			if (wait_sleep(wl, &__w) < 0) {                        \
+				__rv = (cond) ? 0 : -ETIMEDOUT;                \
+				break;                                         \
+			}                                                      \
+		}                                                              \
+		wait_finish(wl, &__w);                                         \
+		__rv;                                                          \
+	})
+
+/**
+ * Sleep until cond is true. cond is evaluated any number of times, and may
+ * have side effects, like taking an item off a queue.
+ */
+#define wait_event(wl, cond) ((void)__wait_event(wl, cond, false, 0))
+#define wait_event_exclusive(wl, cond)                                         \
+	((void)__wait_event(wl, cond, true, 0))
+
+/**
+ * Sleep until cond is true, for at most ms milliseconds (0 means forever).
+ * Return 0 if cond became true, or -ETIMEDOUT.
+ */
+#define wait_event_timeout(wl, cond, ms) __wait_event(wl, cond, false, ms)
+#define wait_event_exclusive_timeout(wl, cond, ms)                             \
+	__wait_event(wl, cond, true, ms)
+
 /**
  * @brief Begin waiting for a waitlist to be triggered
  * @param wl waitlist to wait for
@@ -53,7 +132,7 @@ void wait_list_destroy(struct waitlist *wl);
 void wait_for(struct waitlist *wl);
 
 /**
- * @brief Awaken all process in the waitlist
+ * @brief Trigger a waitlist, and awaken all processes waiting for it
  * @param wl waitlist to awaken
  */
 void wait_list_awaken(struct waitlist *wl);
@@ -0,0 +1,181 @@
+/*
+ * zeropool.c: pools of pre-zeroed pages
+ *
+ * Lots of allocations need cleared memory: page tables, and anonymous user
+ * pages (stacks and bss). Rather than clearing them when they're needed, the
+ * idle thread clears pages whenever nothing else is ready to run, and keeps
+ * them here. alloc_zeroed_pages() takes one off the pool when it has one of the
+ * right size, and otherwise clears a fresh allocation itself.
+ *
+ * Each pool holds blocks of one order. Free blocks are linked through their own
+ * first bytes, which we clear again as they leave the pool.
+ */
+#include "kernel.h"
+#include "string.h"
+
+struct zero_pool {
+	unsigned int order;  /* blocks are PAGE_SIZE << order bytes */
+	unsigned int target; /* count of blocks the idle thread keeps ready */
+	unsigned int count;
+	struct list_head blocks;
+	uint32_t hits;   /* allocations served from the pool */
+	uint32_t misses; /* allocations which had to clear memory themselves */
+};
+
+static struct zero_pool pools[] = {
+	/* single pages: user page tables, stacks, bss */
+	{ .order = 0, .target = 32 },
+	/* 32KB: a first-level table and its shadow, per process */
+	{ .order = 3, .target = 2 },
+};
+
+static struct zero_pool *find_pool(uint32_t bytes, uint32_t align)
+{
+	unsigned int i;
+	for (i = 0; i < nelem(pools); i++) {
+		/* buddy blocks are aligned to their size */
+		if (bytes == (PAGE_SIZE << pools[i].order) &&
+		    align <= PAGE_BITS + pools[i].order)
+			return &pools[i];
+	}
+	return NULL;
+}
+
+static void *pool_pop(struct zero_pool *pool)
+{
+	struct list_head *block = NULL;
+	int flags;
+
+	irqsave(&flags);
+	if (pool->count) {
+		block = pool->blocks.next;
+		list_remove(block);
+		pool->count--;
+	}
+	irqrestore(&flags);
+
+	if (block)
+		memset(block, 0, sizeof(*block));
+	return block;
+}
+
+static void pool_push(struct zero_pool *pool, void *block)
+{
+	int flags;
+
+	irqsave(&flags);
+	list_insert(&pool->blocks, (struct list_head *)block);
+	pool->count++;
+	irqrestore(&flags);
+}
+
+/**
+ * Return zeroed pages, like kmem_get_pages(). Free them with kmem_free_pages().
+ */
+void *alloc_zeroed_pages(uint32_t bytes, uint32_t align)
+{
+	struct zero_pool *pool = find_pool(bytes, align);
+	void *virt;
+
+	if (pool) {
+		virt = pool_pop(pool);
+		if (virt) {
+			pool->hits++;
+			return virt;
+		}
+		pool->misses++;
+	}
+
+	virt = kmem_get_pages(bytes, align);
+	if (virt)
+		memset(virt, 0, bytes);
+	return virt;
+}
+
+/**
+ * Clear one block for the first pool below its target. Called by the idle
+ * thread, so it's preemptible: only the allocator and the pool lists are
+ * touched with interrupts off, never the clearing.
+ * Return true if there was work to do.
+ */
+bool zero_pool_refill(void)
+{
+	struct zero_pool *pool = NULL;
+	unsigned int i;
+	uint32_t bytes;
+	void *block;
+	int flags;
+
+	/* cleared pages are a luxury when memory is short */
+	if (reclaim_memory_low())
+		return false;
+
+	for (i = 0; i < nelem(pools); i++) {
+		if (pools[i].count < pools[i].target) {
+			pool = &pools[i];
+			break;
+		}
+	}
+	if (!pool)
+		return false;
+
+	bytes = PAGE_SIZE << pool->order;
+	irqsave(&flags);
+	block = kmem_get_pages(bytes, 0);
+	irqrestore(&flags);
+	if (!block)
+		return false;
+
+	memset(block, 0, bytes);
+	pool_push(pool, block);
+	return true;
+}
+
+/*
+ * Pooled blocks are quick to give back: the pool lists are only touched with
+ * interrupts masked, so this is safe from any context.
+ */
+static uint32_t zero_pool_shrink(uint32_t want)
+{
+	uint32_t freed = 0;
+	unsigned int i;
+	void *block;
+
+	for (i = 0; i < nelem(pools) && freed < want; i++) {
+		while (freed < want && (block = pool_pop(&pools[i]))) {
+			kmem_free_pages(block, PAGE_SIZE << pools[i].order);
+			freed += 1U << pools[i].order;
+		}
+	}
+	return freed;
+}
+
+static struct shrinker zero_pool_shrinker = {
+	.name = "zeropool",
+	.shrink = zero_pool_shrink,
+	.atomic = true,
+};
+
+void zero_pool_init(void)
+{
+	unsigned int i;
+	for (i = 0; i < nelem(pools); i++) {
+		INIT_LIST_HEAD(pools[i].blocks);
+		pools[i].count = 0;
+		pools[i].hits = 0;
+		pools[i].misses = 0;
+	}
+	register_shrinker(&zero_pool_shrinker);
+}
+
+int zero_pool_cmd_status(int argc, char **argv)
+{
+	unsigned int i;
+
+	for (i = 0; i < nelem(pools); i++) {
+		printf("%u KB blocks: %u/%u ready, %u hits, %u misses\n",
+		       (PAGE_SIZE << pools[i].order) >> 10, pools[i].count,
+		       pools[i].target, pools[i].hits, pools[i].misses);
+	}
+	return 0;
+}
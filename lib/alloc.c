@@ -1,166 +1,384 @@
 /**
  * alloc.c: allocates pages of memory, physical or virtual
+ *
+ * This is a binary buddy allocator. See alloc_private.h for the data
+ * structures. The allocator never touches the memory it manages, so it works
+ * equally well for physical memory and for virtual address spaces.
  */
 #include "alloc.h"
 #include "alloc_private.h"
 
-#define MAX_DESCRIPTORS 1023
-
 /**
  * Declare this so we don't depend on any particular library providing printf,
  * whether it's the standard library or my own printf implementation...
  */
 extern int printf(const char *fmt, ...);
 
-void init_page_allocator(void *allocator, uint32_t start, uint32_t end)
+#define block_end(n) ((n)->pfn + (1U << (n)->order))
+
+static void add_nodes(struct buddyhdr *hdr, void *mem, uint32_t len)
 {
-	/*
-	 * We assume there are 3GB of available memory, starting at 0x40000000.
-	 * Everything beginning at dynamic_start and ending at 0xFFFFFFFF is
-	 * assumed to be available for us to allocate.
-	 */
-	struct zonehdr *zonehdr = (struct zonehdr *)allocator;
-	zonehdr->next = 0;
-	zonehdr->count = 2;
-	zonehdr->zones[0].addr = start >> PAGE_BITS;
-	zonehdr->zones[0].free = 1;
-	zonehdr->zones[1].addr = end >> PAGE_BITS;
-	zonehdr->zones[1].free = 0;
+	struct bnode *node = mem;
+	uint32_t i, count = len / sizeof(struct bnode);
+
+	for (i = 0; i < count; i++) {
+		node[i].list.next = hdr->unused;
+		hdr->unused = &node[i];
+	}
+	hdr->nunused += count;
 }
 
-void show_pages(void *allocator)
+static struct bnode *node_get(struct buddyhdr *hdr)
 {
-	struct zonehdr *hdr = (struct zonehdr *)allocator;
-	int i;
+	struct bnode *node = hdr->unused;
+	hdr->unused = node->list.next;
+	hdr->nunused--;
+	return node;
+}
 
-	printf("BEGIN MEMORY ZONES (%u)\n", hdr->count);
-	for (i = 0; i < hdr->count; i++)
-		printf(" 0x%x: %s\n", hdr->zones[i].addr << PAGE_BITS,
-		       hdr->zones[i].free ? "FREE" : "ALLOCATED");
-	printf("END MEMORY ZONES\n");
+static void node_put(struct buddyhdr *hdr, struct bnode *node)
+{
+	node->list.next = hdr->unused;
+	hdr->unused = node;
+	hdr->nunused++;
+}
+
+static void freelist_add(struct buddyhdr *hdr, struct bnode *node)
+{
+	struct bnode **head = &hdr->free_lists[node->order];
+	node->list.prev = NULL;
+	node->list.next = *head;
+	if (*head)
+		(*head)->list.prev = node;
+	*head = node;
+	hdr->nfree += 1U << node->order;
+}
+
+static void freelist_remove(struct buddyhdr *hdr, struct bnode *node)
+{
+	if (node->list.prev)
+		node->list.prev->list.next = node->list.next;
+	else
+		hdr->free_lists[node->order] = node->list.next;
+	if (node->list.next)
+		node->list.next->list.prev = node->list.prev;
+	hdr->nfree -= 1U << node->order;
+}
+
+/**
+ * Make sure we have `need` free nodes, growing if we can. We keep a reserve
+ * beyond that, because the getter may call back into this allocator: while it
+ * runs, `growing` is set and the nested call is served from the reserve.
+ */
+static bool reserve_nodes(struct buddyhdr *hdr, uint32_t need)
+{
+	void *page;
+
+	while (hdr->nunused < need + NODE_RESERVE && hdr->getter &&
+	       !hdr->growing) {
+		hdr->growing = true;
+		page = hdr->getter();
+		hdr->growing = false;
+		if (!page)
+			break;
+		add_nodes(hdr, page, PAGE_SIZE);
+		hdr->meta_pages++;
+	}
+	return hdr->nunused >= need;
 }
 
 /**
- * Move zones to the right by `to_shift` descriptors, starting at `start`.
- * This can fail if there's not enough room. Theoretically, we have a spot in
- * the zonehdr to point to a new page to store more zones, but hell if I'm going
- * to implement that.
+ * Split a leaf into two buddies which inherit its state.
  */
-static bool shift_zones_up(struct zonehdr *hdr, int start, int to_shift)
+static void split(struct buddyhdr *hdr, struct bnode *node)
 {
+	struct bnode *child;
 	int i;
 
-	if (hdr->count + start >= MAX_DESCRIPTORS)
-		return false;
+	if (node->state == BN_FREE)
+		freelist_remove(hdr, node);
+
+	for (i = 0; i < 2; i++) {
+		child = node_get(hdr);
+		child->order = node->order - 1;
+		child->pfn = node->pfn + (i << child->order);
+		child->state = node->state;
+		if (child->state == BN_FREE)
+			freelist_add(hdr, child);
+		node->child[i] = child;
+	}
+	node->state = BN_SPLIT;
+}
+
+/**
+ * If both buddies are leaves in the same state, merge them into their parent.
+ */
+static void try_merge(struct buddyhdr *hdr, struct bnode *node)
+{
+	struct bnode *left = node->child[0], *right = node->child[1];
+	uint8_t state = left->state;
+	int i;
 
-	for (i = hdr->count - 1; i >= start; i--)
-		hdr->zones[i + to_shift] = hdr->zones[i];
+	if (state == BN_SPLIT || right->state != state)
+		return;
 
-	hdr->count += to_shift;
-	return true;
+	for (i = 0; i < 2; i++) {
+		if (state == BN_FREE)
+			freelist_remove(hdr, node->child[i]);
+		node_put(hdr, node->child[i]);
+	}
+	node->state = state;
+	if (state == BN_FREE)
+		freelist_add(hdr, node);
 }
 
-static void shift_zones_down(struct zonehdr *hdr, int dst, int to_shift)
+/**
+ * Release every node beneath a split node, leaving it as a leaf with no state.
+ */
+static void drop_children(struct buddyhdr *hdr, struct bnode *node)
 {
+	struct bnode *child;
 	int i;
 
-	for (i = dst; i < hdr->count - to_shift; i++)
-		hdr->zones[i] = hdr->zones[i + to_shift];
+	for (i = 0; i < 2; i++) {
+		child = node->child[i];
+		if (child->state == BN_SPLIT)
+			drop_children(hdr, child);
+		else if (child->state == BN_FREE)
+			freelist_remove(hdr, child);
+		node_put(hdr, child);
+	}
+	node->state = BN_NONE;
+}
 
-	hdr->count -= to_shift;
+/**
+ * Return true if every page in [lo, hi) beneath node has the given state.
+ */
+static bool range_is(struct bnode *node, uint32_t lo, uint32_t hi,
+                     uint8_t state)
+{
+	if (block_end(node) <= lo || node->pfn >= hi)
+		return true;
+	if (node->state != BN_SPLIT)
+		return node->state == state;
+	return range_is(node->child[0], lo, hi, state) &&
+	       range_is(node->child[1], lo, hi, state);
 }
 
 /**
- * Change the allocation status of region `exact` of length `count` within the
- * (potentially larger) region `region`.
+ * Return how many nodes it would take to split a leaf block down to the
+ * boundaries of [lo, hi).
  */
-static bool change_status(struct zonehdr *hdr, uint32_t exact, uint32_t count,
-                          uint32_t region, uint32_t index, int status)
+static uint32_t leaf_cost(uint32_t pfn, uint8_t order, uint32_t lo,
+                          uint32_t hi)
+{
+	uint32_t end = pfn + (1U << order);
+
+	if (end <= lo || pfn >= hi || (pfn >= lo && end <= hi))
+		return 0;
+	return 2 + leaf_cost(pfn, order - 1, lo, hi) +
+	       leaf_cost(pfn + (1U << (order - 1)), order - 1, lo, hi);
+}
+
+/**
+ * Return how many nodes range_set() would need for the same arguments.
+ */
+static uint32_t range_cost(struct bnode *node, uint32_t lo, uint32_t hi,
+                           uint8_t state)
+{
+	if (block_end(node) <= lo || node->pfn >= hi)
+		return 0;
+	if (node->pfn >= lo && block_end(node) <= hi)
+		return 0;
+	if (node->state == state)
+		return 0;
+	if (node->state != BN_SPLIT)
+		return leaf_cost(node->pfn, node->order, lo, hi);
+	return range_cost(node->child[0], lo, hi, state) +
+	       range_cost(node->child[1], lo, hi, state);
+}
+
+/**
+ * Set every page in [lo, hi) beneath node to the given state, splitting blocks
+ * which straddle the boundaries and merging buddies on the way back up.
+ */
+static void range_set(struct buddyhdr *hdr, struct bnode *node, uint32_t lo,
+                      uint32_t hi, uint8_t state)
+{
+	if (block_end(node) <= lo || node->pfn >= hi)
+		return;
+
+	if (node->pfn >= lo && block_end(node) <= hi) {
+		if (node->state == BN_SPLIT)
+			drop_children(hdr, node);
+		else if (node->state == BN_FREE)
+			freelist_remove(hdr, node);
+		node->state = state;
+		if (state == BN_FREE)
+			freelist_add(hdr, node);
+		return;
+	}
+
+	if (node->state == state)
+		return;
+	if (node->state != BN_SPLIT)
+		split(hdr, node);
+	range_set(hdr, node->child[0], lo, hi, state);
+	range_set(hdr, node->child[1], lo, hi, state);
+	try_merge(hdr, node);
+}
+
+/**
+ * Convert a byte range to pages, returning false if it doesn't fit in the
+ * address space.
+ */
+static bool to_pages(uint32_t addr, uint32_t count, uint32_t *lo, uint32_t *hi)
+{
+	uint32_t npages = (count >> PAGE_BITS) + ((count & (PAGE_SIZE - 1)) ? 1 : 0);
+
+	*lo = addr >> PAGE_BITS;
+	*hi = *lo + npages;
+	return npages > 0 && *hi <= (1U << MAX_ORDER);
+}
+
+void init_page_allocator(void *allocator, uint32_t start, uint32_t end)
 {
-	uint32_t next = 0;
+	struct buddyhdr *hdr = (struct buddyhdr *)allocator;
+	uint32_t i;
+
+	hdr->root.pfn = 0;
+	hdr->root.order = MAX_ORDER;
+	hdr->root.state = BN_NONE;
+	for (i = 0; i <= MAX_ORDER; i++)
+		hdr->free_lists[i] = NULL;
+	hdr->unused = NULL;
+	hdr->nunused = 0;
+	hdr->meta_pages = 1;
+	hdr->getter = NULL;
+	hdr->growing = false;
+	hdr->nfree = 0;
+	hdr->low = 0;
+	hdr->high = 0;
+	hdr->reclaim = NULL;
+	hdr->reclaiming = false;
+	add_nodes(hdr, hdr->nodes, PAGE_SIZE - sizeof(struct buddyhdr));
+
+	range_set(hdr, &hdr->root, start >> PAGE_BITS, end >> PAGE_BITS,
+	          BN_FREE);
+}
 
-	bool have_left_zone = (index > 0);
-	bool have_right_zone = (index < hdr->count - 1);
-	bool exact_on_left = false, exact_on_right = false;
+void page_allocator_set_getter(void *allocator, void *(*getter)(void))
+{
+	struct buddyhdr *hdr = (struct buddyhdr *)allocator;
+	hdr->getter = getter;
+}
 
-	if (have_right_zone) {
-		next = hdr->zones[index + 1].addr << PAGE_BITS;
-		exact_on_right = (exact + count == next);
+void page_allocator_set_reclaim(void *allocator, uint32_t low, uint32_t high,
+                                uint32_t (*reclaim)(uint32_t want,
+                                                    bool failing))
+{
+	struct buddyhdr *hdr = (struct buddyhdr *)allocator;
+	hdr->low = low;
+	hdr->high = high < low ? low : high;
+	hdr->reclaim = reclaim;
+}
+
+uint32_t page_allocator_count_free(void *allocator)
+{
+	struct buddyhdr *hdr = (struct buddyhdr *)allocator;
+	return hdr->nfree;
+}
+
+static void show_node(struct bnode *node, uint8_t *last)
+{
+	if (node->state == BN_SPLIT) {
+		show_node(node->child[0], last);
+		show_node(node->child[1], last);
+	} else if (node->state != *last) {
+		*last = node->state;
+		printf(" 0x%x: %s\n", node->pfn << PAGE_BITS,
+		       node->state == BN_FREE
+		               ? "FREE"
+		               : (node->state == BN_ALLOC ? "ALLOCATED"
+		                                          : "UNMANAGED"));
 	}
-	exact_on_left = (region == exact);
-
-	if (exact_on_left && exact_on_right) {
-		/* there must be a right zone */
-		if (have_left_zone) {
-			/*
-			 * aaa  BBB  aaa
-			 *
-			 * We delete the last two and shift everything after
-			 * down by two:
-			 *
-			 * aaaAAAaaa
-			 *
-			 * (test_free)
-			 */
-			shift_zones_down(hdr, index, 2);
-		} else {
-			/*
-			 * BBB aaa
-			 *
-			 * Shift everything down by one and modify the AAA zone
-			 * to have our exact left address:
-			 *
-			 * AAAAAA
-			 */
-			shift_zones_down(hdr, index, 1);
-			hdr->zones[index].addr = (exact >> PAGE_BITS);
-		}
-	} else if (exact_on_left) {
-		/*
-		 * ?a? BBBbb (aaa)
-		 *
-		 * We move the current zone up to (exact+count). If
-		 * there's a left zone, we're set. Otherwise, we insert
-		 * one and set it to the correct status. We don't care if
-		 * there's a right zone.
-		 *
-		 * ?a?AAA bb AAA
-		 */
-		if (have_left_zone) {
-			hdr->zones[index].addr = ((exact + count) >> PAGE_BITS);
-		} else {
-			if (!shift_zones_up(hdr, index, 1))
-				return false;
-			hdr->zones[index + 1].addr =
-			        ((exact + count) >> PAGE_BITS);
-			hdr->zones[index].free = status;
-		}
-	} else if (exact_on_right) {
-		/*
-		 * ?a? bbBBB aaa
-		 *
-		 * We know there's a right zone, we just slide that one down.
-		 *
-		 * ?a? bb AAAaaa
-		 */
-		hdr->zones[index + 1].addr = (exact >> PAGE_BITS);
-	} else {
-		/*
-		 * ?a? bbBBBbb ?a?
-		 *
-		 * We must shift up two, insert a descriptor for the new AAA
-		 * zone, and a descriptor for the right side bb zone.
-		 *
-		 * ?a? bb AAA bb ?a?
-		 */
-		if (!shift_zones_up(hdr, index, 2))
-			return false;
-		hdr->zones[index + 1].addr = (exact >> PAGE_BITS);
-		hdr->zones[index + 1].free = status;
-		hdr->zones[index + 2].addr = ((exact + count) >> PAGE_BITS);
-		hdr->zones[index + 2].free = hdr->zones[index].free;
+}
+
+void show_pages(void *allocator)
+{
+	struct buddyhdr *hdr = (struct buddyhdr *)allocator;
+	uint8_t last = BN_SPLIT;
+	uint32_t i, count;
+	struct bnode *node;
+
+	printf("BEGIN MEMORY ZONES\n");
+	show_node(&hdr->root, &last);
+	printf("END MEMORY ZONES\n");
+	printf("free blocks by order:");
+	for (i = 0; i <= MAX_ORDER; i++) {
+		count = 0;
+		for (node = hdr->free_lists[i]; node; node = node->list.next)
+			count++;
+		printf(" %u", count);
 	}
-	return true;
+	printf("\n%u free pages, %u metadata pages, %u unused nodes\n",
+	       hdr->nfree, hdr->meta_pages, hdr->nunused);
+}
+
+/**
+ * Find the smallest free block which can hold count (rounded up to a power of
+ * two pages) at the requested alignment, and allocate exactly the pages we
+ * need from the front of it. The remainder stays free.
+ */
+static uint32_t __alloc_pages(struct buddyhdr *hdr, uint32_t count,
+                              uint32_t align)
+{
+	uint32_t order = 0, lo, hi;
+
+	/* threshold alignment between PAGE_BITS <= align <= 32 */
+	align = (align < PAGE_BITS ? PAGE_BITS : align);
+	align = (align > 32 ? 32 : align);
+
+	if (!to_pages(0, count, &lo, &hi))
+		return 0;
+	while ((1U << order) < hi)
+		order++;
+	if (order < align - PAGE_BITS)
+		order = align - PAGE_BITS;
+
+	/* carving a prefix out of a block splits at most two nodes per level */
+	if (!reserve_nodes(hdr, 2 * MAX_ORDER))
+		return 0;
+
+	for (; order <= MAX_ORDER; order++)
+		if (hdr->free_lists[order])
+			break;
+	if (order > MAX_ORDER)
+		return 0;
+
+	lo = hdr->free_lists[order]->pfn;
+	range_set(hdr, &hdr->root, lo, lo + hi, BN_ALLOC);
+	return lo << PAGE_BITS;
+}
+
+/**
+ * Ask the reclaim callback for at least `want` pages, plus whatever it takes to
+ * get back to the high watermark. Not while the callback is already running,
+ * nor while a getter is: either may be allocating from us right now.
+ */
+static uint32_t call_reclaim(struct buddyhdr *hdr, uint32_t want, bool failing)
+{
+	uint32_t freed;
+
+	if (!hdr->reclaim || hdr->reclaiming || hdr->growing)
+		return 0;
+	if (hdr->nfree < hdr->high)
+		want += hdr->high - hdr->nfree;
+
+	hdr->reclaiming = true;
+	freed = hdr->reclaim(want, failing);
+	hdr->reclaiming = false;
+	return freed;
 }
 
 /**
@@ -172,105 +390,60 @@ static bool change_status(struct zonehdr *hdr, uint32_t exact, uint32_t count,
  *   14: 16KB aligned, etc
  * return: physical pointer to contiguous pages
  *   NULL if the memory could not be allocated
+ *
+ * When the allocation fails, or leaves us below the low watermark, the reclaim
+ * callback gets a chance to give memory back. A failed allocation is retried
+ * once if it freed anything.
  */
 uint32_t alloc_pages(void *allocator, uint32_t count, uint32_t align)
 {
-	uint32_t i, align_mask, zone, alignzone, next;
-	struct zonehdr *hdr = (struct zonehdr *)allocator;
-	bool result = false;
-
-	/* threshold alignment between PAGE_BITS <= align <= 32 */
-	align = (align < PAGE_BITS ? PAGE_BITS : align);
-	align = (align > 32 ? 32 : align);
-
-	/* align mask has the N least significant bits set */
-	align_mask = 0xFFFFFFFF >> (32 - align);
-
-	for (i = 0; i < hdr->count; i++) {
-		if (!hdr->zones[i].free)
-			continue;
-		alignzone = zone = hdr->zones[i].addr << PAGE_BITS;
-
-		/* align memory if necessary */
-		if (zone & align_mask) {
-			alignzone = ((zone >> align) + 1) << align;
-		}
-
-		next = hdr->zones[i + 1].addr << PAGE_BITS;
-		if (alignzone + count > next) {
-			/* can't satisfy alignment and/or size in zone */
-			continue;
-		}
-
-		result = change_status(hdr, alignzone, count, zone, i, 0);
-		if (result) {
-			return alignzone;
-		}
+	struct buddyhdr *hdr = (struct buddyhdr *)allocator;
+	uint32_t addr = __alloc_pages(hdr, count, align);
+	uint32_t want = (count + PAGE_SIZE - 1) >> PAGE_BITS;
+
+	if (!addr) {
+		if (call_reclaim(hdr, want, true))
+			addr = __alloc_pages(hdr, count, align);
+	} else if (hdr->nfree < hdr->low) {
+		call_reclaim(hdr, 0, false);
 	}
-
-	return 0;
+	return addr;
 }
 
 bool free_pages(void *allocator, uint32_t start, uint32_t count)
 {
-	uint32_t i, addr, next;
-	bool has_next;
-	struct zonehdr *hdr = (struct zonehdr *)allocator;
+	struct buddyhdr *hdr = (struct buddyhdr *)allocator;
+	uint32_t lo, hi;
 
-	for (i = 0; i < hdr->count; i++) {
-		addr = hdr->zones[i].addr << PAGE_BITS;
-		has_next = i + 1 < hdr->count;
-
-		/* Trying to free a region from before the allocator's memory.
-		 */
-		if (addr > start)
-			return false;
-
-		/* Compute next */
-		if (has_next)
-			next = hdr->zones[i + 1].addr << PAGE_BITS;
+	if (!to_pages(start, count, &lo, &hi))
+		return false;
 
-		/* If the zone doesn't fit within this block, continue */
-		if (has_next && start + count > next)
-			continue;
+	/* already freed, never even allocated, or out of our range */
+	if (!range_is(&hdr->root, lo, hi, BN_ALLOC))
+		return false;
 
-		/* already freed, or never even allocated */
-		if (hdr->zones[i].free)
-			return false;
+	if (!reserve_nodes(hdr, range_cost(&hdr->root, lo, hi, BN_FREE)))
+		return false;
 
-		return change_status(hdr, start, count, addr, i, 1);
-	}
-	return false;
+	range_set(hdr, &hdr->root, lo, hi, BN_FREE);
+	return true;
 }
 
 bool mark_alloc(void *allocator, uint32_t start, uint32_t count)
 {
-	uint32_t i, addr, next;
-	bool has_next;
-	struct zonehdr *hdr = (struct zonehdr *)allocator;
+	struct buddyhdr *hdr = (struct buddyhdr *)allocator;
+	uint32_t lo, hi;
 
-	for (i = 0; i < hdr->count; i++) {
-		addr = hdr->zones[i].addr << PAGE_BITS;
-		has_next = i + 1 < hdr->count;
-
-		/* Trying to free a region from before the allocator's memory.
-		 */
-		if (addr > start)
-			return false;
-
-		/* Compute next */
-		if (has_next)
-			next = hdr->zones[i + 1].addr << PAGE_BITS;
+	if (!to_pages(start, count, &lo, &hi))
+		return false;
 
-		/* If the zone doesn't fit within this block, continue */
-		if (has_next && start + count > next)
-			continue;
+	/* already allocated! */
+	if (!range_is(&hdr->root, lo, hi, BN_FREE))
+		return false;
 
-		/* already allocated! */
-		if (!hdr->zones[i].free)
-			return false;
+	if (!reserve_nodes(hdr, range_cost(&hdr->root, lo, hi, BN_ALLOC)))
+		return false;
 
-		return change_status(hdr, start, count, addr, i, 0);
-	}
-	return false;
+	range_set(hdr, &hdr->root, lo, hi, BN_ALLOC);
+	return true;
 }
@@ -20,6 +20,42 @@
  */
 void init_page_allocator(void *allocator, uint32_t start, uint32_t end);
 
+/**
+ * Allow the allocator to grow its bookkeeping beyond the initial page.
+ *
+ * The allocator needs more bookkeeping the more fragmented memory becomes. When
+ * it runs low, it calls getter for another page. The getter may call back into
+ * this allocator, which will be served from a reserve. Without a getter,
+ * allocations fail once the first page is used up.
+ *
+ * allocator: allocator created by init_page_allocator()
+ * getter: function which returns a freshly allocated page (or NULL)
+ */
+void page_allocator_set_getter(void *allocator, void *(*getter)(void));
+
+/**
+ * Ask for memory back when the allocator runs low.
+ *
+ * Whenever an allocation leaves fewer than low pages free, reclaim is called
+ * with failing=false. When an allocation can't be satisfied at all, it is
+ * called with failing=true, and the allocation is retried once if it freed
+ * anything. Either way, want is the count of pages needed to get back up to
+ * high (plus the failed request). The callback returns the count of pages it
+ * freed. It may use this allocator, but won't be called again while it runs.
+ *
+ * allocator: allocator created by init_page_allocator()
+ * low, high: watermarks, in pages
+ * reclaim: function which frees memory back to the allocator (or NULL)
+ */
+void page_allocator_set_reclaim(void *allocator, uint32_t low, uint32_t high,
+                                uint32_t (*reclaim)(uint32_t want,
+                                                    bool failing));
+
+/**
+ * Return the count of free pages.
+ */
+uint32_t page_allocator_count_free(void *allocator);
+
 /**
  * Print out all allocations, for debugging.
  */
@@ -8,23 +8,66 @@
 
 #include "alloc.h"
 
-#define MAX_DESCRIPTORS 1023
+/*
+ * The allocator is a binary buddy system over the whole 32-bit address space,
+ * measured in pages. Order 0 is a single page, and order MAX_ORDER is the
+ * entire 4GB space.
+ */
+#define MAX_ORDER (32 - PAGE_BITS)
 
-/**
- * Zone descriptors manage zones of memory. The minimum zone that can be managed
- * by this mechanism is one 4096-byte page.
+/*
+ * Each buddy block is represented by a node in a binary tree (a "buddy trie").
+ * The root is the whole address space, and the two children of a split node
+ * are its buddies. A leaf is entirely free, entirely allocated, or entirely
+ * outside of the memory managed by the allocator. Whenever both buddies end up
+ * as leaves with the same state, they are merged back into their parent.
  *
- * Zone descriptors are kept in a sorted array (the zonelist), which may
- * dynamically expand and contract as needed. Each entry in the array is 4
- * bytes, containing the start address of the zone.
+ * Free leaves are additionally kept on a free list for their order, so that
+ * allocation can find a block of the right size without searching the tree.
  */
-struct zone {
-	unsigned int addr : 20;         /* last 12 bits do not matter */
-	unsigned int _unallocated : 11; /* reserved for other uses */
-	unsigned int free : 1;          /* boolean */
+#define BN_NONE  0 /* not managed by this allocator */
+#define BN_FREE  1
+#define BN_ALLOC 2
+#define BN_SPLIT 3
+
+struct bnode {
+	union {
+		/* BN_SPLIT: the two buddies, lower address first */
+		struct bnode *child[2];
+		/* BN_FREE: order free list. Unused nodes: pool list. */
+		struct {
+			struct bnode *next;
+			struct bnode *prev;
+		} list;
+	};
+	uint32_t pfn; /* first page number of the block */
+	uint8_t order;
+	uint8_t state;
 };
-struct zonehdr {
-	unsigned int next : 22;  /* last 10 bits do not matter */
-	unsigned int count : 10; /* number of zone structs */
-	struct zone zones[];     /* array of zones */
+
+/*
+ * Nodes are carved out of the rest of the allocator page. When a page getter is
+ * provided, more pages are requested as the pool runs low.
+ *
+ * OP_NODES is the most nodes a single operation may consume: a range can only
+ * partially overlap two blocks at each level of the tree, and splitting each of
+ * those takes two nodes. We try to keep a couple operations worth in reserve.
+ */
+#define OP_NODES     (2 * 2 * (MAX_ORDER + 1))
+#define NODE_RESERVE (2 * OP_NODES)
+
+struct buddyhdr {
+	struct bnode root;
+	struct bnode *free_lists[MAX_ORDER + 1];
+	struct bnode *unused;
+	uint32_t nunused;
+	uint32_t meta_pages;
+	void *(*getter)(void);
+	bool growing;
+	uint32_t nfree; /* pages on the free lists */
+	uint32_t low;   /* call reclaim when nfree drops below this... */
+	uint32_t high;  /* ...asking for enough to get back to this */
+	uint32_t (*reclaim)(uint32_t want, bool failing);
+	bool reclaiming;
+	struct bnode nodes[];
 };
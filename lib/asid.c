@@ -0,0 +1,63 @@
+/*
+ * asid.c: allocates hardware address space identifiers
+ */
+#include "asid.h"
+
+#define GENERATION_ONE ASID_COUNT
+
+static void asid_reset_bitmap(struct asid_allocator *alloc)
+{
+	uint32_t i;
+	for (i = 0; i < ASID_COUNT / 32; i++)
+		alloc->bitmap[i] = 0;
+	alloc->bitmap[ASID_RESERVED / 32] |= 1U << (ASID_RESERVED % 32);
+	alloc->next = ASID_RESERVED + 1;
+}
+
+void asid_init(struct asid_allocator *alloc)
+{
+	alloc->generation = GENERATION_ONE;
+	alloc->rollovers = 0;
+	asid_reset_bitmap(alloc);
+}
+
+/*
+ * Find and claim a free hardware ASID, or return ASID_RESERVED if there are
+ * none left in this generation.
+ */
+static uint32_t asid_claim(struct asid_allocator *alloc)
+{
+	uint32_t i, hw;
+	for (i = 0; i < ASID_COUNT; i++) {
+		hw = (alloc->next + i) & ASID_MASK;
+		if (!(alloc->bitmap[hw / 32] & (1U << (hw % 32)))) {
+			alloc->bitmap[hw / 32] |= 1U << (hw % 32);
+			alloc->next = (hw + 1) & ASID_MASK;
+			return hw;
+		}
+	}
+	return ASID_RESERVED;
+}
+
+bool asid_update(struct asid_allocator *alloc, uint32_t *asid)
+{
+	uint32_t hw;
+	bool flush = false;
+
+	if (*asid && (*asid & ~ASID_MASK) == alloc->generation)
+		return false;
+
+	hw = asid_claim(alloc);
+	if (hw == ASID_RESERVED) {
+		/* skip 0 on wraparound, it means "not allocated" */
+		alloc->generation += ASID_COUNT;
+		if (!alloc->generation)
+			alloc->generation = GENERATION_ONE;
+		alloc->rollovers++;
+		asid_reset_bitmap(alloc);
+		hw = asid_claim(alloc);
+		flush = true;
+	}
+	*asid = alloc->generation | hw;
+	return flush;
+}
@@ -0,0 +1,52 @@
+/*
+ * asid.h: allocates hardware address space identifiers
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * ARMv7 tags non-global TLB entries with an 8-bit ASID. We hand them out from
+ * a bitmap, and tag each one with a generation number in the upper bits. When
+ * the bitmap runs out we start a new generation, which invalidates every ASID
+ * handed out so far. Only then does the TLB need to be flushed.
+ *
+ * ASIDs are never freed within a generation: a process which exits may still
+ * have entries in the TLB, so its ASID isn't safe to reuse until a flush.
+ */
+#define ASID_BITS  8
+#define ASID_COUNT (1 << ASID_BITS)
+#define ASID_MASK  (ASID_COUNT - 1)
+
+/* ASID 0 is reserved for kernel threads and for switching between TTBRs */
+#define ASID_RESERVED 0
+
+struct asid_allocator {
+	uint32_t generation; /* current generation, in the upper bits */
+	uint32_t next;       /* where to start searching the bitmap */
+	uint32_t rollovers;  /* count of new generations, diagnostic */
+	uint32_t bitmap[ASID_COUNT / 32];
+};
+
+/**
+ * Initialize the allocator, starting at generation 1. An ASID value of 0 is
+ * never valid, so it may be used to mean "not allocated".
+ */
+void asid_init(struct asid_allocator *alloc);
+
+/**
+ * Make sure *asid is valid in the current generation, allocating a new one if
+ * necessary. Return true if the caller must flush the entire TLB before using
+ * it (that is, a new generation began).
+ */
+bool asid_update(struct asid_allocator *alloc, uint32_t *asid);
+
+/**
+ * Return the hardware ASID to write into CONTEXTIDR.
+ */
+static inline uint32_t asid_hw(uint32_t asid)
+{
+	return asid & ASID_MASK;
+}
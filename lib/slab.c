@@ -1,9 +1,19 @@
 /*
  * Slab allocator for frequently used structures. Built on top of a page
- * allocator. The first page allocated contains the struct slab, and the
- * remaining space is filled by structures. Subsequent pages contain only the
- * structures.
+ * allocator. A slab grows by 2^order contiguous pages at a time, which we call
+ * a "slab page". Every slab page starts with a small struct slab_page which
+ * tracks the free objects in it. The first slab page allocated also contains
+ * the struct slab, and the remaining space is filled by structures. Subsequent
+ * slab pages contain only the structures.
+ *
+ * Slab pages move between the full, partial and empty lists as objects are
+ * allocated and freed. Empty ones beyond the reserve are released.
+ *
+ * Slab pages are aligned to their size, so we find the header for an object by
+ * masking its address. That requires knowing the order, which slab_of() does
+ * not, so slab pages of more than one page are also kept in a small hash table.
  */
+#include <stdbool.h>
 #include <stdint.h>
 
 #include "slab_private.h"
@@ -18,94 +28,579 @@ extern int printf(const char *fmt, ...);
 
 DECLARE_LIST_HEAD(slabs);
 
-static void slab_add_entries(struct slab *slab, void *page, unsigned int len)
+static struct slab_sync slab_sync;
+
+/*
+ * The kernel never preempts code in this section (see timer_can_reschedule()).
+ * Elsewhere, it's just an ordinary section.
+ */
+#define SLAB_NOPREEMPT __attribute__((section(".nopreempt")))
+
+static unsigned long slab_lock(struct slab *slab);
+static void slab_unlock(struct slab *slab, unsigned long flags);
+static void __slab_free_bulk(struct slab *slab, void **objs, unsigned int n);
+
+#define list_empty(head) ((head)->next == (head))
+
+#define SLAB_BYTES(order) ((unsigned int)PAGE_SIZE << (order))
+
+#define SLAB_HASH_SIZE 64
+static struct slab_page *slab_hash[SLAB_HASH_SIZE];
+static unsigned int slab_hash_orders; /* bitmask of orders in the hash */
+
+static unsigned int slab_hash_fn(void *addr)
 {
-	unsigned int i;
-	struct list_head *tmp;
+	return ((uintptr_t)addr / PAGE_SIZE) % SLAB_HASH_SIZE;
+}
+
+static void slab_hash_insert(struct slab_page *page)
+{
+	unsigned int idx = slab_hash_fn(page);
+	page->hnext = slab_hash[idx];
+	slab_hash[idx] = page;
+	slab_hash_orders |= 1U << page->slab->order;
+}
+
+static void slab_hash_remove(struct slab_page *page)
+{
+	struct slab_page **iter = &slab_hash[slab_hash_fn(page)];
+	while (*iter != page)
+		iter = &(*iter)->hnext;
+	*iter = page->hnext;
+}
+
+static struct slab_page *slab_page_of(struct slab *slab, void *ptr)
+{
+	return (struct slab_page *)((uintptr_t)ptr &
+	                            ~(uintptr_t)(SLAB_BYTES(slab->order) - 1));
+}
+
+/**
+ * Return the waste in a slab page of the given order: space not used by the
+ * header or by objects.
+ */
+static unsigned int slab_waste(unsigned int size, unsigned int order)
+{
+	return (SLAB_BYTES(order) - SLAB_PAGE_HDR) % size;
+}
+
+/**
+ * Choose the smallest order which wastes no more than 1/SLAB_WASTE_FRACTION of
+ * each slab page. Failing that, the one wasting the smallest fraction.
+ */
+static int slab_auto_order(unsigned int size)
+{
+	int order, best = -1;
+
+	for (order = 0; order <= SLAB_MAX_ORDER; order++) {
+		if (SLAB_BYTES(order) < SLAB_HDR + size)
+			continue;
+		if (slab_waste(size, order) * SLAB_WASTE_FRACTION <=
+		    SLAB_BYTES(order))
+			return order;
+		/* compare waste / bytes of each order by cross multiplying */
+		if (best < 0 || slab_waste(size, order) * SLAB_BYTES(best) <
+		                        slab_waste(size, best) * SLAB_BYTES(order))
+			best = order;
+	}
+	return best;
+}
+
+/**
+ * Thread the objects in [start, end) onto the page's free list, lowest address
+ * first, and put the page on the empty list.
+ */
+static void slab_add_page(struct slab *slab, struct slab_page *page,
+                          void *start, void *end)
+{
+	unsigned int count = (end - start) / slab->size;
+	void *obj;
 
-	for (i = 0; i + slab->size <= len; i += slab->size) {
-		tmp = (struct list_head *)(page + i);
-		list_insert_end(&slab->entries, tmp);
-		slab->total += 1;
-		slab->free += 1;
+	page->slab = slab;
+	page->freelist = NULL;
+	page->inuse = 0;
+	page->total = count;
+	while (count--) {
+		obj = start + count * slab->size;
+		*(void **)obj = page->freelist;
+		page->freelist = obj;
 	}
+
+	slab->total += page->total;
+	slab->free += page->total;
+	slab->pages += 1;
+	slab->nempty += 1;
+	list_insert(&slab->empty, &page->list);
+	if (slab->order)
+		slab_hash_insert(page);
 }
 
-struct slab *slab_new(char *name, unsigned int size, void *(*getter)(void))
+/**
+ * Release empty pages beyond the reserve. The header page is never released,
+ * since it contains the struct slab. The release function may allocate from
+ * this very slab, so we look at the lists afresh for each page.
+ */
+static void slab_trim(struct slab *slab)
 {
-	void *void_page = getter();
-	struct slab *slab = void_page;
+	struct slab_page *page, *victim;
+
+	while (slab->page_release && slab->nempty > slab->reserve) {
+		victim = NULL;
+		list_for_each_entry(page, &slab->empty, list)
+		{
+			if (page != slab->header) {
+				victim = page;
+				break;
+			}
+		}
+		if (!victim)
+			return;
+
+		list_remove(&victim->list);
+		slab->nempty -= 1;
+		slab->pages -= 1;
+		slab->total -= victim->total;
+		slab->free -= victim->total;
+		slab->reclaimed += 1;
+		if (slab->order)
+			slab_hash_remove(victim);
+		slab->page_release(victim, slab->order);
+	}
+}
+
+struct slab *slab_new_ctor(char *name, unsigned int size, int order,
+                           void *(*getter)(unsigned int),
+                           void (*release)(void *, unsigned int),
+                           void (*ctor)(void *), void (*dtor)(void *))
+{
+	struct slab_page *page;
+	struct slab *slab;
 
 	if (size < sizeof(struct list_head)) {
 		printf("slab: invalid slab size %u smaller than llnode %u\n",
 		       size, sizeof(struct list_head));
 		return NULL;
 	}
+	if (order == SLAB_ORDER_AUTO)
+		order = slab_auto_order(size);
+	if (order < 0 || order > SLAB_MAX_ORDER ||
+	    SLAB_BYTES(order) < SLAB_HDR + size) {
+		printf("slab: invalid order %d for slab size %u\n", order,
+		       size);
+		return NULL;
+	}
 
+	page = getter(order);
+	if (!page)
+		return NULL;
+	slab = (void *)page + SLAB_PAGE_HDR;
 	slab->size = size;
+	slab->order = order;
 	slab->total = 0;
 	slab->free = slab->total;
+	slab->pages = 0;
+	slab->nempty = 0;
+	slab->reserve = SLAB_DEFAULT_RESERVE;
+	slab->reclaimed = 0;
 	slab->page_getter = getter;
-	INIT_LIST_HEAD(slab->entries);
+	slab->page_release = release;
+	slab->ctor = ctor;
+	slab->dtor = dtor;
+	slab->magazines = false;
+	slab->header = page;
+	INIT_LIST_HEAD(slab->full);
+	INIT_LIST_HEAD(slab->partial);
+	INIT_LIST_HEAD(slab->empty);
 	list_insert_end(&slabs, &slab->slabs);
 	slab->name = name;
 
-	slab_add_entries(slab, void_page + sizeof(struct slab),
-	                 PAGE_SIZE - sizeof(struct slab));
+	slab_add_page(slab, page, (void *)page + SLAB_HDR,
+	              (void *)page + SLAB_BYTES(order));
 	return slab;
 }
 
-void *slab_alloc(struct slab *slab)
+struct slab *slab_new(char *name, unsigned int size, int order,
+                      void *(*getter)(unsigned int),
+                      void (*release)(void *, unsigned int))
+{
+	return slab_new_ctor(name, size, order, getter, release, NULL, NULL);
+}
+
+void slab_set_reserve(struct slab *slab, unsigned int pages)
 {
-	struct list_head *entry;
+	unsigned long flags = slab_lock(slab);
+	slab->reserve = pages;
+	slab_trim(slab);
+	slab_unlock(slab, flags);
+}
 
-	/* Expand if necessary */
-	if (slab->free == 0) {
-		void *page = slab->page_getter();
-		slab_add_entries(slab, page, PAGE_SIZE);
+unsigned int slab_shrink(struct slab *slab)
+{
+	unsigned long flags = slab_lock(slab);
+	unsigned int i, reserve = slab->reserve, before = slab->reclaimed;
+
+	if (slab->magazines) {
+		for (i = 0; i < SLAB_CONTEXTS; i++) {
+			__slab_free_bulk(slab, slab->mag[i].objs,
+			                 slab->mag[i].count);
+			slab->mag[i].count = 0;
+		}
 	}
+	slab->reserve = 0;
+	slab_trim(slab);
+	slab->reserve = reserve;
+	slab_unlock(slab, flags);
+	return (slab->reclaimed - before) << slab->order;
+}
 
-	/* Return the first available entry from the first page */
-	list_for_each(entry, &slab->entries)
+unsigned int slab_shrink_all(void)
+{
+	struct slab *slab;
+	unsigned int pages = 0;
+	list_for_each_entry(slab, &slabs, slabs)
 	{
-		slab->free -= 1;
-		list_remove(entry);
-		return (void *)entry;
+		pages += slab_shrink(slab);
 	}
+	return pages;
+}
+
+/**
+ * Return a page with free objects on the partial list, growing the slab if
+ * needed. Return NULL when the page getter fails.
+ */
+static struct slab_page *slab_next_page(struct slab *slab)
+{
+	struct slab_page *page;
 
-	return NULL;
+	/* Prefer partially used pages, so that empty ones may be released */
+	if (!list_empty(&slab->partial))
+		return container_of(slab->partial.next, struct slab_page, list);
+
+	/* Expand if necessary */
+	if (list_empty(&slab->empty)) {
+		page = slab->page_getter(slab->order);
+		if (!page)
+			return NULL;
+		slab_add_page(slab, page, (void *)page + SLAB_PAGE_HDR,
+		              (void *)page + SLAB_BYTES(slab->order));
+	}
+	page = container_of(slab->empty.next, struct slab_page, list);
+	list_remove(&page->list);
+	list_insert(&slab->partial, &page->list);
+	slab->nempty -= 1;
+	return page;
+}
+
+/**
+ * Take up to n objects off the free lists, without running the constructor.
+ */
+static unsigned int __slab_alloc_bulk(struct slab *slab, void **objs,
+                                      unsigned int n)
+{
+	struct slab_page *page;
+	unsigned int got = 0, i;
+	void *obj;
+
+	while (got < n) {
+		page = slab_next_page(slab);
+		if (!page)
+			break;
+
+		/* Drain as much of this page as we need before moving it */
+		i = got;
+		while (got < n && page->freelist) {
+			obj = page->freelist;
+			page->freelist = *(void **)obj;
+			objs[got++] = obj;
+		}
+		page->inuse += got - i;
+		slab->free -= got - i;
+
+		if (page->inuse == page->total) {
+			list_remove(&page->list);
+			list_insert(&slab->full, &page->list);
+		}
+	}
+	return got;
+}
+
+/**
+ * Put n objects back onto the free lists, without running the destructor.
+ */
+static void __slab_free_bulk(struct slab *slab, void **objs, unsigned int n)
+{
+	struct slab_page *page;
+	unsigned int i = 0, count;
+	bool was_full;
+
+	while (i < n) {
+		page = slab_page_of(slab, objs[i]);
+		was_full = page->inuse == page->total;
+
+		/* Objects from the same page tend to be freed together */
+		count = 0;
+		do {
+			*(void **)objs[i] = page->freelist;
+			page->freelist = objs[i];
+			count++;
+			i++;
+		} while (i < n && slab_page_of(slab, objs[i]) == page);
+		page->inuse -= count;
+		slab->free += count;
+
+		if (page->inuse == 0) {
+			list_remove(&page->list);
+			list_insert(&slab->empty, &page->list);
+			slab->nempty += 1;
+		} else if (was_full) {
+			list_remove(&page->list);
+			list_insert(&slab->partial, &page->list);
+		}
+	}
+	slab_trim(slab);
+}
+
+/*
+ * Slabs with magazines may be used from interrupt handlers, so their free lists
+ * are only touched with interrupts masked.
+ */
+static unsigned long slab_lock(struct slab *slab)
+{
+	if (slab->magazines && slab_sync.irq_save)
+		return slab_sync.irq_save();
+	return 0;
+}
+
+static void slab_unlock(struct slab *slab, unsigned long flags)
+{
+	if (slab->magazines && slab_sync.irq_restore)
+		slab_sync.irq_restore(flags);
+}
+
+static struct slab_magazine *slab_magazine(struct slab *slab)
+{
+	unsigned int ctx = slab_sync.context ? slab_sync.context() : 0;
+	return &slab->mag[ctx];
+}
+
+/**
+ * Pop an object from a magazine, refilling it from the free lists if it's
+ * empty. Only this context uses the magazine, and the timer won't preempt us
+ * within this section, so we need only mask interrupts for the refill.
+ */
+static void *SLAB_NOPREEMPT slab_mag_pop(struct slab *slab,
+                                         struct slab_magazine *mag)
+{
+	unsigned long flags;
+	void *obj = NULL;
+
+	if (mag->count)
+		return mag->objs[--mag->count];
+
+	/* We may be preempted before interrupts are masked, so check again */
+	flags = slab_lock(slab);
+	if (!mag->count)
+		mag->count = __slab_alloc_bulk(slab, mag->objs, SLAB_MAG_BATCH);
+	if (mag->count)
+		obj = mag->objs[--mag->count];
+	slab_unlock(slab, flags);
+	return obj;
+}
+
+/**
+ * Push an object onto a magazine, first draining a batch of objects back to
+ * the free lists if it's full.
+ */
+static void SLAB_NOPREEMPT slab_mag_push(struct slab *slab,
+                                         struct slab_magazine *mag, void *obj)
+{
+	unsigned long flags;
+
+	if (mag->count < SLAB_MAG_SIZE) {
+		mag->objs[mag->count++] = obj;
+		return;
+	}
+
+	flags = slab_lock(slab);
+	if (mag->count == SLAB_MAG_SIZE) {
+		mag->count -= SLAB_MAG_BATCH;
+		__slab_free_bulk(slab, &mag->objs[mag->count], SLAB_MAG_BATCH);
+	}
+	mag->objs[mag->count++] = obj;
+	slab_unlock(slab, flags);
+}
+
+unsigned int slab_alloc_bulk(struct slab *slab, void **objs, unsigned int n)
+{
+	unsigned long flags;
+	unsigned int got, i;
+
+	flags = slab_lock(slab);
+	got = __slab_alloc_bulk(slab, objs, n);
+	slab_unlock(slab, flags);
+
+	if (slab->ctor)
+		for (i = 0; i < got; i++)
+			slab->ctor(objs[i]);
+	return got;
+}
+
+void *slab_alloc(struct slab *slab)
+{
+	void *obj;
+
+	if (slab->magazines) {
+		obj = slab_mag_pop(slab, slab_magazine(slab));
+		if (obj && slab->ctor)
+			slab->ctor(obj);
+		return obj;
+	}
+	if (!slab_alloc_bulk(slab, &obj, 1))
+		return NULL;
+	return obj;
+}
+
+void slab_free_bulk(struct slab *slab, void **objs, unsigned int n)
+{
+	unsigned long flags;
+	unsigned int i;
+
+	if (slab->dtor)
+		for (i = 0; i < n; i++)
+			slab->dtor(objs[i]);
+
+	flags = slab_lock(slab);
+	__slab_free_bulk(slab, objs, n);
+	slab_unlock(slab, flags);
 }
 
 void slab_free(struct slab *slab, void *ptr)
 {
-	list_insert(&slab->entries, (struct list_head *)ptr);
-	slab->free++;
+	if (slab->magazines) {
+		if (slab->dtor)
+			slab->dtor(ptr);
+		slab_mag_push(slab, slab_magazine(slab), ptr);
+		return;
+	}
+	slab_free_bulk(slab, &ptr, 1);
+}
+
+void slab_enable_magazines(struct slab *slab)
+{
+	unsigned int i;
+	for (i = 0; i < SLAB_CONTEXTS; i++)
+		slab->mag[i].count = 0;
+	slab->magazines = true;
+}
+
+void slab_set_sync(const struct slab_sync *sync)
+{
+	slab_sync = *sync;
+}
+
+struct slab *slab_of(void *ptr)
+{
+	struct slab_page *page, *block;
+	int order;
+
+	/* Multi-page slab pages are in the hash, try each order in use */
+	for (order = SLAB_MAX_ORDER; order > 0; order--) {
+		if (!(slab_hash_orders & (1U << order)))
+			continue;
+		block = (void *)((uintptr_t)ptr &
+		                 ~(uintptr_t)(SLAB_BYTES(order) - 1));
+		for (page = slab_hash[slab_hash_fn(block)]; page;
+		     page = page->hnext)
+			if (page == block && page->slab->order == order)
+				return page->slab;
+	}
+	/* Otherwise, it must be in a single page */
+	block = (void *)((uintptr_t)ptr & ~(uintptr_t)(PAGE_SIZE - 1));
+	return block->slab;
+}
+
+static unsigned int slab_count_pages(struct list_head *head)
+{
+	struct list_head *iter;
+	unsigned int count = 0;
+
+	list_for_each(iter, head)
+	{
+		count++;
+	}
+	return count;
 }
 
 void slab_report(struct slab *slab)
 {
-	int headerct, headerwaste, regct, regwaste, pages;
+	unsigned int bytes = SLAB_BYTES(slab->order);
+	unsigned int headerct, headerwaste, regct, regwaste, base;
 	printf(" slab \"%s\":\n", slab->name);
-	printf("  item_size %u\n  %u alloc / %u total (%u free)\n", slab->size,
-	       slab->total - slab->free, slab->total, slab->free);
-	headerct = (PAGE_SIZE - sizeof(struct slab)) / slab->size;
-	regct = PAGE_SIZE / slab->size;
-	headerwaste = PAGE_SIZE - sizeof(struct slab) - slab->size * headerct;
-	regwaste = PAGE_SIZE - slab->size * regct;
+	printf("  item_size %u, order %u (%u bytes per slab page)\n", slab->size,
+	       slab->order, bytes);
+	printf("  %u alloc / %u total (%u free)\n", slab->total - slab->free,
+	       slab->total, slab->free);
+	if (slab->magazines)
+		printf("  magazines: %u thread, %u irq objects cached\n",
+		       slab->mag[SLAB_CTX_THREAD].count,
+		       slab->mag[SLAB_CTX_IRQ].count);
+	headerct = (bytes - SLAB_HDR) / slab->size;
+	regct = (bytes - SLAB_PAGE_HDR) / slab->size;
+	headerwaste = bytes - SLAB_HDR - slab->size * headerct;
+	regwaste = slab_waste(slab->size, slab->order);
 	printf("  header fits %u structures, wasting %u bytes\n", headerct,
 	       headerwaste);
-	printf("  regular page fits %u structures, wasting %u bytes\n", regct,
-	       regwaste);
-	pages = (slab->total - headerct) / regct + 1;
-	printf("  %u pages (including header) allocated = %u bytes\n", pages,
-	       pages * PAGE_SIZE);
+	printf("  regular slab page fits %u structures, wasting %u bytes "
+	       "(%u%%)\n",
+	       regct, regwaste, regwaste * 100 / bytes);
+	if (slab->size <= PAGE_SIZE - SLAB_PAGE_HDR) {
+		base = slab_waste(slab->size, 0);
+		printf("  a single page would waste %u bytes per page (%u%%)\n",
+		       base, base * 100 / PAGE_SIZE);
+	}
+	printf("  %u slab pages (including header) allocated = %u bytes\n",
+	       slab->pages, slab->pages * bytes);
+	printf("  %u full, %u partial, %u empty slab pages (reserve %u)\n",
+	       slab_count_pages(&slab->full), slab_count_pages(&slab->partial),
+	       slab->nempty, slab->reserve);
+	printf("  %u slab pages reclaimed = %u bytes\n", slab->reclaimed,
+	       slab->reclaimed * bytes);
+}
+
+/**
+ * Return how many bytes would hold the same number of objects if the slab used
+ * single pages. Objects larger than a page would not fit at all, count them as
+ * taking a whole page of their own.
+ */
+static unsigned int slab_single_page_bytes(struct slab *slab)
+{
+	unsigned int per_page, first, rest;
+
+	if (slab->size > PAGE_SIZE - SLAB_HDR)
+		return slab->total * PAGE_SIZE;
+	per_page = (PAGE_SIZE - SLAB_PAGE_HDR) / slab->size;
+	first = (PAGE_SIZE - SLAB_HDR) / slab->size;
+	if (slab->total <= first)
+		return PAGE_SIZE;
+	rest = slab->total - first;
+	return PAGE_SIZE * (1 + (rest + per_page - 1) / per_page);
 }
 
 void slab_report_all(void)
 {
 	struct slab *slab;
+	unsigned int used = 0, bytes = 0, single = 0;
 	list_for_each_entry(slab, &slabs, slabs)
 	{
 		slab_report(slab);
+		used += slab->total * slab->size;
+		bytes += slab->pages * SLAB_BYTES(slab->order);
+		single += slab_single_page_bytes(slab);
 	}
+	printf(" all slabs: %u bytes of objects in %u bytes of slab pages "
+	       "(%u%% efficient)\n",
+	       used, bytes, bytes ? (uint32_t)((uint64_t)used * 100 / bytes) : 0);
+	printf(" single-page slabs would need %u bytes (%u%% efficient)\n",
+	       single,
+	       single ? (uint32_t)((uint64_t)used * 100 / single) : 0);
 }
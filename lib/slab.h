@@ -5,15 +5,13 @@
  * sockets, packets, etc. They help reduce memory fragmentation and can very
  * quickly allocate in most cases.
  *
- * This implementation can grow, but not shrink. Note that it depends on the
- * page size, and that wasted memory can occur if your objects don't fit nicely
- * into a page. Common examples of this are:
- *
- * - Objects larger than a page, of course
- * - Objects which are large and not near a power of two. For example, a
- *   3072-byte structure will fit once within a page, wasting 1024 bytes in
- *   every page which is part of the slab. This allocator is not equipped to
- *   allocate many contiguous pages in order to reduce waste.
+ * Objects are tracked per slab page, which is 2^order contiguous pages. Slab
+ * pages which become entirely free are handed back to the page allocator once
+ * there are more than a few of them (see slab_set_reserve()). Objects which
+ * don't fit nicely into a page waste the remainder: for example, a 2048-byte
+ * structure fits only once within a 4KB page, since the page also holds a
+ * small header. Larger slab pages spread that remainder over more objects, and
+ * SLAB_ORDER_AUTO chooses an order which keeps it small.
  */
 
 #pragma once
@@ -24,14 +22,66 @@
  */
 struct slab;
 
+/* Largest order a slab may use, i.e. slab pages of up to 32KB */
+#define SLAB_MAX_ORDER 3
+
+/* Choose the order automatically, based on how well objects pack */
+#define SLAB_ORDER_AUTO -1
+
+/* An automatic order wastes no more than 1/SLAB_WASTE_FRACTION, if possible */
+#define SLAB_WASTE_FRACTION 16
+
 /**
  * Create a new named slab cache.
  *
  * name: name of the slab allocator (used in diagnostics)
  * size: size of the item
- * getter: function which returns freshly allocated pages
+ * order: the slab grows by 2^order pages at a time, or SLAB_ORDER_AUTO
+ * getter: function which returns 2^order freshly allocated, contiguous pages,
+ *   aligned to their size
+ * release: function which frees pages returned by getter (may be NULL, in
+ *   which case the slab never shrinks)
+ */
+struct slab *slab_new(char *name, unsigned int size, int order,
+                      void *(*getter)(unsigned int order),
+                      void (*release)(void *ptr, unsigned int order));
+
+/**
+ * Create a new named slab cache whose objects are set up by a constructor.
+ *
+ * ctor: called on every object returned by slab_alloc(), so that it comes back
+ *   in a known state. Keep this cheap: reset only the fields that matter.
+ * dtor: called on every object passed to slab_free(), before it is reused
+ *
+ * Either may be NULL. The other arguments are the same as slab_new().
+ */
+struct slab *slab_new_ctor(char *name, unsigned int size, int order,
+                           void *(*getter)(unsigned int order),
+                           void (*release)(void *ptr, unsigned int order),
+                           void (*ctor)(void *), void (*dtor)(void *));
+
+/**
+ * Set how many entirely free slab pages the slab keeps around before releasing
+ * them. Keeping a few avoids bouncing pages back and forth with the page
+ * allocator. The default is SLAB_DEFAULT_RESERVE.
  */
-struct slab *slab_new(char *name, unsigned int size, void *(*getter)(void));
+void slab_set_reserve(struct slab *slab, unsigned int pages);
+
+#define SLAB_DEFAULT_RESERVE 1
+
+/**
+ * Give back every entirely free slab page, ignoring the reserve, after first
+ * emptying the magazines back onto the free lists. Used when memory is short.
+ * Don't call this while another context may be within a magazine operation:
+ * from the kernel, that means from a thread, never an interrupt handler.
+ * Return the count of pages (not slab pages) released.
+ */
+unsigned int slab_shrink(struct slab *slab);
+
+/**
+ * Call slab_shrink() on every slab, returning the total count of pages.
+ */
+unsigned int slab_shrink_all(void);
 
 /**
  * Allocate an object from the slab.
@@ -48,6 +98,76 @@ void *slab_alloc(struct slab *slab);
  */
 void slab_free(struct slab *slab, void *ptr);
 
+/*
+ * Contexts which may use a slab with magazines. Each gets its own magazine.
+ */
+#define SLAB_CTX_THREAD 0
+#define SLAB_CTX_IRQ    1
+#define SLAB_CONTEXTS   2
+
+/* A magazine holds up to SLAB_MAG_SIZE objects, and is refilled or drained
+ * SLAB_MAG_BATCH at a time */
+#define SLAB_MAG_SIZE  16
+#define SLAB_MAG_BATCH 8
+
+/*
+ * How the slab allocator synchronizes magazines with the environment. Any of
+ * these may be NULL, e.g. in unit tests.
+ *
+ * context: return SLAB_CTX_IRQ in an interrupt handler, else SLAB_CTX_THREAD
+ * irq_save: mask interrupts, returning whether they were enabled before
+ * irq_restore: undo irq_save()
+ *
+ * The magazine fast paths also assume that code in the ".nopreempt" section is
+ * never preempted.
+ */
+struct slab_sync {
+	unsigned int (*context)(void);
+	unsigned long (*irq_save)(void);
+	void (*irq_restore)(unsigned long flags);
+};
+
+/**
+ * Set the synchronization functions for all slabs.
+ */
+void slab_set_sync(const struct slab_sync *sync);
+
+/**
+ * Put per-context magazines in front of this slab's free lists, so that it may
+ * be used from both threads and interrupt handlers. slab_alloc() and
+ * slab_free() then usually touch only the magazine for the current context,
+ * and interrupts are masked just while a batch moves to or from the free lists.
+ * The bulk functions bypass the magazines, masking interrupts once per call.
+ *
+ * Objects cached in magazines are not available to other contexts, and keep
+ * their pages from being released.
+ */
+void slab_enable_magazines(struct slab *slab);
+
+/**
+ * Return the slab which an object was allocated from. Pages record their owner,
+ * so callers need not remember it.
+ *
+ * ptr: a pointer returned by slab_alloc()
+ */
+struct slab *slab_of(void *ptr);
+
+/**
+ * Allocate up to n objects at once, storing them into objs. This takes objects
+ * off each page's free list in one go, rather than touching the page lists for
+ * every object. The constructor (if any) runs on each object.
+ *
+ * return: how many objects were allocated, less than n only when out of memory
+ */
+unsigned int slab_alloc_bulk(struct slab *slab, void **objs, unsigned int n);
+
+/**
+ * Free n objects at once. Objects from the same page which are adjacent in objs
+ * are returned to their page together, and empty pages are released once at
+ * the end.
+ */
+void slab_free_bulk(struct slab *slab, void **objs, unsigned int n);
+
 /**
  * Report on the status of a slab. Requires a printf implementation linked in
  * with the library.
@@ -57,7 +177,8 @@ void slab_free(struct slab *slab, void *ptr);
 void slab_report(struct slab *slab);
 
 /**
- * Report on the status of all slabs. Requires a printf implementation linked in
- * with the library.
+ * Report on the status of all slabs, and how much memory their orders save
+ * compared to single pages. Requires a printf implementation linked in with the
+ * library.
  */
 void slab_report_all(void);
@@ -1,15 +1,67 @@
 #pragma once
 
+#include <stdbool.h>
+
 #include "list.h"
 #include "slab.h"
 
+/*
+ * Every slab page (2^order pages) begins with this header. Since slab pages are
+ * aligned to their size, we can find the header for any object by masking its
+ * address.
+ */
+struct slab_page {
+	struct list_head list;   /* on the full, partial, or empty list */
+	struct slab *slab;       /* slab which owns this page */
+	struct slab_page *hnext; /* hash chain, only when order > 0 */
+	void *freelist;          /* free objects within this page */
+	unsigned short inuse;    /* count of allocated objects */
+	unsigned short total;    /* count of objects in this page */
+};
+
+/*
+ * Objects start here, aligned to a cache line. Objects of a power of two size
+ * from 64 bytes up then never share a line, so kmalloc() buffers are safe to
+ * hand to devices with cache maintenance on their own range.
+ */
+#define SLAB_LINE 64
+#define SLAB_PAGE_HDR                                                          \
+	((sizeof(struct slab_page) + SLAB_LINE - 1) & ~(SLAB_LINE - 1))
+
+/*
+ * A magazine is a small stack of objects in front of the free lists, one per
+ * context (see slab_set_sync()). Objects in a magazine count as allocated.
+ */
+struct slab_magazine {
+	unsigned int count;
+	void *objs[SLAB_MAG_SIZE];
+};
+
 struct slab {
-	unsigned int size;        /* size of structure */
-	unsigned int total;       /* count of structures in total */
-	unsigned int free;        /* count which are free */
-	char *name;               /* name of this slab allocator, diagnostic */
-	struct list_head entries; /* list of pages */
+	unsigned int size;      /* size of structure */
+	unsigned int order;     /* each slab page is 2^order pages */
+	unsigned int total;     /* count of structures in total */
+	unsigned int free;      /* count which are free */
+	unsigned int pages;     /* count of slab pages, including the header */
+	unsigned int nempty;    /* count of pages on the empty list */
+	unsigned int reserve;   /* empty pages to keep before releasing */
+	unsigned int reclaimed; /* count of pages released so far */
+	char *name;             /* name of this slab allocator, diagnostic */
+	struct list_head full;    /* pages with no free objects */
+	struct list_head partial; /* pages with some free objects */
+	struct list_head empty;   /* pages with no allocated objects */
 	struct list_head slabs;   /* list of slab allocators */
+	struct slab_page *header; /* the page containing this struct */
 
-	void *(*page_getter)(void);
+	void *(*page_getter)(unsigned int order);
+	void (*page_release)(void *, unsigned int order);
+	void (*ctor)(void *);
+	void (*dtor)(void *);
+
+	bool magazines;
+	struct slab_magazine mag[SLAB_CONTEXTS];
 };
+
+/* objects on the header page start here */
+#define SLAB_HDR                                                               \
+	((SLAB_PAGE_HDR + sizeof(struct slab) + SLAB_LINE - 1) & ~(SLAB_LINE - 1))
@@ -0,0 +1,523 @@
+/**
+ * vmem.c: allocates ranges of a virtual address space
+ *
+ * Unlike physical memory, a virtual address space is huge and sparsely used,
+ * so we only keep track of the free ranges. See vmem.h for the data structure.
+ * Like alloc.c, this never touches the memory it manages.
+ */
+#include "vmem.h"
+
+extern int printf(const char *fmt, ...);
+
+/*
+ * Keep a few spare nodes around, since any operation may need one, and the
+ * node_alloc() function may need to call back into us.
+ */
+#define VMEM_RESERVE 4
+
+#define node_end(n) ((n)->start + (n)->len)
+#define align_up(x, a) (((x) + (a)-1) & ~((a)-1))
+
+static void spare_put(struct vmem *vm, struct vmem_node *n)
+{
+	n->link[VMEM_ADDR].child[0] = vm->spare;
+	vm->spare = n;
+	vm->nspare++;
+}
+
+static struct vmem_node *spare_get(struct vmem *vm)
+{
+	struct vmem_node *n = vm->spare;
+	vm->spare = n->link[VMEM_ADDR].child[0];
+	vm->nspare--;
+	return n;
+}
+
+/**
+ * Top up the spare nodes. Every operation calls this before it looks at the
+ * trees, since node_alloc() may change them.
+ */
+static void reserve_nodes(struct vmem *vm)
+{
+	struct vmem_node *n;
+
+	while (vm->nspare < VMEM_RESERVE && vm->node_alloc && !vm->growing) {
+		vm->growing = true;
+		n = vm->node_alloc();
+		vm->growing = false;
+		if (!n)
+			break;
+		spare_put(vm, n);
+	}
+}
+
+/*
+ * AVL tree routines. These work on either tree, selected by t.
+ */
+
+static bool before(int t, struct vmem_node *a, struct vmem_node *b)
+{
+	if (t == VMEM_SIZE && a->len != b->len)
+		return a->len < b->len;
+	return a->start < b->start;
+}
+
+static uint8_t height(struct vmem_node *n, int t)
+{
+	return n ? n->link[t].height : 0;
+}
+
+static void update(struct vmem_node *n, int t)
+{
+	struct vmem_node *l = n->link[t].child[0], *r = n->link[t].child[1];
+	uint8_t hl = height(l, t), hr = height(r, t);
+
+	n->link[t].height = 1 + (hl > hr ? hl : hr);
+	if (t == VMEM_ADDR) {
+		n->maxgap = n->len;
+		if (l && l->maxgap > n->maxgap)
+			n->maxgap = l->maxgap;
+		if (r && r->maxgap > n->maxgap)
+			n->maxgap = r->maxgap;
+	}
+}
+
+/**
+ * Rotate n down in direction dir (0 means left), returning the new root.
+ */
+static struct vmem_node *rotate(struct vmem_node *n, int t, int dir)
+{
+	struct vmem_node *c = n->link[t].child[!dir];
+
+	n->link[t].child[!dir] = c->link[t].child[dir];
+	c->link[t].child[dir] = n;
+	update(n, t);
+	update(c, t);
+	return c;
+}
+
+static struct vmem_node *balance(struct vmem_node *n, int t)
+{
+	struct vmem_node **c = n->link[t].child;
+	int bf;
+
+	update(n, t);
+	bf = height(c[0], t) - height(c[1], t);
+	if (bf > 1) {
+		if (height(c[0]->link[t].child[0], t) <
+		    height(c[0]->link[t].child[1], t))
+			c[0] = rotate(c[0], t, 0);
+		return rotate(n, t, 1);
+	} else if (bf < -1) {
+		if (height(c[1]->link[t].child[1], t) <
+		    height(c[1]->link[t].child[0], t))
+			c[1] = rotate(c[1], t, 1);
+		return rotate(n, t, 0);
+	}
+	return n;
+}
+
+static struct vmem_node *insert(struct vmem_node *root, struct vmem_node *n,
+                                int t)
+{
+	int dir;
+
+	if (!root) {
+		n->link[t].child[0] = NULL;
+		n->link[t].child[1] = NULL;
+		update(n, t);
+		return n;
+	}
+	dir = before(t, root, n);
+	root->link[t].child[dir] = insert(root->link[t].child[dir], n, t);
+	return balance(root, t);
+}
+
+static struct vmem_node *remove_min(struct vmem_node *root, int t,
+                                    struct vmem_node **min)
+{
+	if (!root->link[t].child[0]) {
+		*min = root;
+		return root->link[t].child[1];
+	}
+	root->link[t].child[0] = remove_min(root->link[t].child[0], t, min);
+	return balance(root, t);
+}
+
+static struct vmem_node *remove(struct vmem_node *root, struct vmem_node *n,
+                                int t)
+{
+	struct vmem_node *l, *r, *min;
+	int dir;
+
+	if (root == n) {
+		l = n->link[t].child[0];
+		r = n->link[t].child[1];
+		if (!r)
+			return l;
+		r = remove_min(r, t, &min);
+		min->link[t].child[0] = l;
+		min->link[t].child[1] = r;
+		return balance(min, t);
+	}
+	dir = before(t, root, n);
+	root->link[t].child[dir] = remove(root->link[t].child[dir], n, t);
+	return balance(root, t);
+}
+
+static void tree_insert(struct vmem *vm, struct vmem_node *n)
+{
+	vm->root[VMEM_ADDR] = insert(vm->root[VMEM_ADDR], n, VMEM_ADDR);
+	vm->root[VMEM_SIZE] = insert(vm->root[VMEM_SIZE], n, VMEM_SIZE);
+	vm->nfree++;
+}
+
+static void tree_remove(struct vmem *vm, struct vmem_node *n)
+{
+	vm->root[VMEM_ADDR] = remove(vm->root[VMEM_ADDR], n, VMEM_ADDR);
+	vm->root[VMEM_SIZE] = remove(vm->root[VMEM_SIZE], n, VMEM_SIZE);
+	vm->nfree--;
+}
+
+/*
+ * Searches
+ */
+
+/**
+ * Return the free range with the highest start <= addr.
+ */
+static struct vmem_node *floor_addr(struct vmem *vm, uint32_t addr)
+{
+	struct vmem_node *n = vm->root[VMEM_ADDR], *best = NULL;
+
+	while (n) {
+		if (n->start <= addr) {
+			best = n;
+			n = n->link[VMEM_ADDR].child[1];
+		} else {
+			n = n->link[VMEM_ADDR].child[0];
+		}
+	}
+	return best;
+}
+
+/**
+ * Return the free range with the lowest start > addr.
+ */
+static struct vmem_node *after_addr(struct vmem *vm, uint32_t addr)
+{
+	struct vmem_node *n = vm->root[VMEM_ADDR], *best = NULL;
+
+	while (n) {
+		if (n->start > addr) {
+			best = n;
+			n = n->link[VMEM_ADDR].child[0];
+		} else {
+			n = n->link[VMEM_ADDR].child[1];
+		}
+	}
+	return best;
+}
+
+/**
+ * Return the smallest free range of at least len bytes.
+ */
+static struct vmem_node *best_fit(struct vmem *vm, uint32_t len)
+{
+	struct vmem_node *n = vm->root[VMEM_SIZE], *best = NULL;
+
+	while (n) {
+		if (n->len >= len) {
+			best = n;
+			n = n->link[VMEM_SIZE].child[0];
+		} else {
+			n = n->link[VMEM_SIZE].child[1];
+		}
+	}
+	return best;
+}
+
+/**
+ * Return the lowest free range starting at or above lo, of at least len
+ * bytes. The largest gap of each subtree lets us skip most of the tree.
+ */
+static struct vmem_node *fit_above(struct vmem_node *n, uint32_t lo,
+                                   uint32_t len)
+{
+	struct vmem_node *found;
+
+	if (!n || n->maxgap < len)
+		return NULL;
+	if (n->start < lo)
+		return fit_above(n->link[VMEM_ADDR].child[1], lo, len);
+	found = fit_above(n->link[VMEM_ADDR].child[0], lo, len);
+	if (found)
+		return found;
+	if (n->len >= len)
+		return n;
+	return fit_above(n->link[VMEM_ADDR].child[1], lo, len);
+}
+
+/**
+ * Return true if an aligned range of size bytes fits in n, storing its address.
+ */
+static bool fits(struct vmem_node *n, uint32_t size, uint32_t align,
+                 uint32_t *addr)
+{
+	uint32_t a = align_up(n->start, align);
+
+	if (a < n->start || n->len < size || a - n->start > n->len - size)
+		return false;
+	*addr = a;
+	return true;
+}
+
+/**
+ * Allocate [addr, addr + size) out of free range n. This needs a spare node
+ * when the allocation is in the middle of the range.
+ */
+static bool carve(struct vmem *vm, struct vmem_node *n, uint32_t addr,
+                  uint32_t size)
+{
+	uint32_t front = addr - n->start;
+	uint32_t back = node_end(n) - (addr + size);
+	struct vmem_node *m;
+
+	if (front && back && !vm->spare)
+		return false;
+
+	tree_remove(vm, n);
+	if (front && back) {
+		m = spare_get(vm);
+		m->start = addr + size;
+		m->len = back;
+		n->len = front;
+		tree_insert(vm, n);
+		tree_insert(vm, m);
+	} else if (front) {
+		n->len = front;
+		tree_insert(vm, n);
+	} else if (back) {
+		n->start = addr + size;
+		n->len = back;
+		tree_insert(vm, n);
+	} else {
+		spare_put(vm, n);
+	}
+	return true;
+}
+
+/**
+ * Round a byte count up to pages, and an alignment to a byte boundary. Return
+ * false if the count is zero or too big.
+ */
+static bool to_pages(uint32_t *size, uint32_t *align)
+{
+	if (*size == 0 || *size > 0xFFFFF000)
+		return false;
+	*size = align_up(*size, PAGE_SIZE);
+
+	if (align) {
+		*align = (*align < PAGE_BITS ? PAGE_BITS : *align);
+		*align = (*align > 31 ? 31 : *align);
+		*align = 1U << *align;
+	}
+	return true;
+}
+
+bool vmem_init(struct vmem *vm, uint32_t start, uint32_t end,
+               void *(*node_alloc)(void), void (*node_free)(void *))
+{
+	struct vmem_node *n;
+
+	vm->root[VMEM_ADDR] = NULL;
+	vm->root[VMEM_SIZE] = NULL;
+	vm->spare = NULL;
+	vm->nspare = 0;
+	vm->nfree = 0;
+	vm->start = start;
+	vm->end = end & ~(PAGE_SIZE - 1);
+	vm->node_alloc = node_alloc;
+	vm->node_free = node_free;
+	vm->growing = false;
+
+	if (vm->start >= vm->end)
+		return true;
+
+	reserve_nodes(vm);
+	if (!vm->spare)
+		return false;
+	n = spare_get(vm);
+	n->start = vm->start;
+	n->len = vm->end - vm->start;
+	tree_insert(vm, n);
+	return true;
+}
+
+/**
+ * Allocate from the smallest free range which fits. The size and alignment
+ * have already been converted to bytes.
+ */
+static uint32_t alloc_best_fit(struct vmem *vm, uint32_t size, uint32_t align)
+{
+	struct vmem_node *n;
+	uint32_t addr;
+
+	/*
+	 * The smallest range which is big enough usually works. If it is
+	 * misaligned, fall back to the smallest range which is big enough
+	 * regardless of alignment.
+	 */
+	n = best_fit(vm, size);
+	if (n && !fits(n, size, align, &addr)) {
+		if (size + align - PAGE_SIZE < size)
+			return 0;
+		n = best_fit(vm, size + align - PAGE_SIZE);
+		if (n && !fits(n, size, align, &addr))
+			return 0;
+	}
+	if (!n || !carve(vm, n, addr, size))
+		return 0;
+	return addr;
+}
+
+uint32_t vmem_alloc(struct vmem *vm, uint32_t size, uint32_t align)
+{
+	if (!to_pages(&size, &align))
+		return 0;
+
+	reserve_nodes(vm);
+	return alloc_best_fit(vm, size, align);
+}
+
+uint32_t vmem_alloc_hint(struct vmem *vm, uint32_t hint, uint32_t size,
+                         uint32_t align)
+{
+	struct vmem_node *n;
+	uint32_t addr, need;
+
+	if (!to_pages(&size, &align))
+		return 0;
+
+	reserve_nodes(vm);
+
+	addr = align_up(hint, align);
+	n = floor_addr(vm, addr);
+	if (addr >= hint && n && node_end(n) >= addr + size &&
+	    addr + size > addr && carve(vm, n, addr, size))
+		return addr;
+
+	need = size + align - PAGE_SIZE;
+	if (need >= size) {
+		n = fit_above(vm->root[VMEM_ADDR], hint, need);
+		if (n && fits(n, size, align, &addr) && carve(vm, n, addr, size))
+			return addr;
+	}
+
+	return alloc_best_fit(vm, size, align);
+}
+
+bool vmem_free(struct vmem *vm, uint32_t addr, uint32_t size)
+{
+	struct vmem_node *prev, *next, *n;
+	bool join_prev, join_next;
+
+	if (!to_pages(&size, NULL) || (addr & (PAGE_SIZE - 1)) ||
+	    addr < vm->start || addr + size > vm->end || addr + size < addr)
+		return false;
+
+	reserve_nodes(vm);
+
+	/* already freed (at least partially) */
+	prev = floor_addr(vm, addr);
+	next = after_addr(vm, addr);
+	if ((prev && node_end(prev) > addr) ||
+	    (next && next->start < addr + size))
+		return false;
+
+	join_prev = prev && node_end(prev) == addr;
+	join_next = next && next->start == addr + size;
+
+	if (join_prev && join_next) {
+		tree_remove(vm, next);
+		tree_remove(vm, prev);
+		prev->len += size + next->len;
+		tree_insert(vm, prev);
+		spare_put(vm, next);
+	} else if (join_prev) {
+		tree_remove(vm, prev);
+		prev->len += size;
+		tree_insert(vm, prev);
+	} else if (join_next) {
+		tree_remove(vm, next);
+		next->start = addr;
+		next->len += size;
+		tree_insert(vm, next);
+	} else {
+		if (!vm->spare)
+			return false;
+		n = spare_get(vm);
+		n->start = addr;
+		n->len = size;
+		tree_insert(vm, n);
+	}
+	return true;
+}
+
+bool vmem_mark_alloc(struct vmem *vm, uint32_t addr, uint32_t size)
+{
+	struct vmem_node *n;
+
+	if (!to_pages(&size, NULL) || (addr & (PAGE_SIZE - 1)) ||
+	    addr + size < addr)
+		return false;
+
+	reserve_nodes(vm);
+
+	n = floor_addr(vm, addr);
+	if (!n || node_end(n) < addr + size)
+		return false;
+	return carve(vm, n, addr, size);
+}
+
+static void free_tree(struct vmem *vm, struct vmem_node *n)
+{
+	if (!n)
+		return;
+	free_tree(vm, n->link[VMEM_ADDR].child[0]);
+	free_tree(vm, n->link[VMEM_ADDR].child[1]);
+	vm->node_free(n);
+}
+
+void vmem_destroy(struct vmem *vm)
+{
+	if (vm->node_free) {
+		free_tree(vm, vm->root[VMEM_ADDR]);
+		while (vm->spare)
+			vm->node_free(spare_get(vm));
+	}
+	vm->root[VMEM_ADDR] = NULL;
+	vm->root[VMEM_SIZE] = NULL;
+	vm->spare = NULL;
+	vm->nspare = 0;
+	vm->nfree = 0;
+}
+
+static void show_tree(struct vmem_node *n)
+{
+	if (!n)
+		return;
+	show_tree(n->link[VMEM_ADDR].child[0]);
+	printf(" 0x%x - 0x%x: FREE\n", n->start, node_end(n));
+	show_tree(n->link[VMEM_ADDR].child[1]);
+}
+
+void vmem_show(struct vmem *vm)
+{
+	printf("BEGIN FREE RANGES\n");
+	show_tree(vm->root[VMEM_ADDR]);
+	printf("END FREE RANGES\n");
+	printf("%u free ranges, largest 0x%x bytes, %u spare nodes\n",
+	       vm->nfree, vm->root[VMEM_ADDR] ? vm->root[VMEM_ADDR]->maxgap : 0,
+	       vm->nspare);
+}
@@ -0,0 +1,100 @@
+/*
+ * vmem.h: allocates ranges of a virtual address space
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "alloc.h"
+
+/*
+ * Each free range of the address space is a node. Nodes live in two AVL trees
+ * at once: one sorted by address, and one sorted by (length, address). The
+ * address tree is augmented with the largest free range in each subtree, so
+ * both best-fit and first-fit-above-a-hint searches take O(log n).
+ */
+#define VMEM_ADDR 0
+#define VMEM_SIZE 1
+
+struct vmem_node {
+	struct {
+		struct vmem_node *child[2];
+		uint8_t height;
+	} link[2];
+	uint32_t start;
+	uint32_t len;
+	uint32_t maxgap; /* largest len in this node's address subtree */
+};
+
+/*
+ * An address space. This is small enough to embed into other structures.
+ *
+ * Nodes are allocated with node_alloc() as needed. Nodes which are no longer
+ * needed are kept on a spare list, and only released by vmem_destroy().
+ */
+struct vmem {
+	struct vmem_node *root[2];
+	struct vmem_node *spare;
+	uint32_t nspare;
+	uint32_t nfree;
+	uint32_t start;
+	uint32_t end;
+	void *(*node_alloc)(void);
+	void (*node_free)(void *);
+	bool growing;
+};
+
+/**
+ * Create an allocator managing addresses from start to end.
+ *
+ * vm: memory for the allocator
+ * start: first address managed by the allocator (page aligned)
+ * end: first address no longer managed by us (rounded down to a page)
+ * node_alloc: returns memory for a struct vmem_node, or NULL
+ * node_free: releases memory returned by node_alloc
+ *
+ * node_alloc may call back into this allocator, in which case the nested call
+ * is served from the spare nodes. Return false if no node could be allocated
+ * for the initial range.
+ */
+bool vmem_init(struct vmem *vm, uint32_t start, uint32_t end,
+               void *(*node_alloc)(void), void (*node_free)(void *));
+
+/**
+ * Allocate a range, using the smallest free range which fits.
+ * size: how many bytes to allocate (rounded up to a page)
+ * align: what byte boundary to align on, as in alloc_pages()
+ * return: the address, or 0 if the request could not be satisfied
+ */
+uint32_t vmem_alloc(struct vmem *vm, uint32_t size, uint32_t align);
+
+/**
+ * Allocate a range at hint if possible, otherwise at the first address above
+ * hint which fits, falling back to vmem_alloc().
+ */
+uint32_t vmem_alloc_hint(struct vmem *vm, uint32_t hint, uint32_t size,
+                         uint32_t align);
+
+/**
+ * Free a range. Return false if any of it was already free or outside of the
+ * address space.
+ */
+bool vmem_free(struct vmem *vm, uint32_t addr, uint32_t size);
+
+/**
+ * Mark a free range as allocated. Return false if any of it wasn't free.
+ */
+bool vmem_mark_alloc(struct vmem *vm, uint32_t addr, uint32_t size);
+
+/**
+ * Release all nodes back to node_free(). The allocator may not be used again
+ * until vmem_init().
+ */
+void vmem_destroy(struct vmem *vm);
+
+/**
+ * Print out the free ranges, for debugging.
+ */
+void vmem_show(struct vmem *vm);
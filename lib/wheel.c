@@ -0,0 +1,206 @@
+/*
+ * wheel.c: hierarchical timer wheel
+ */
+#include "wheel.h"
+
+#define LEVEL_SHIFT(level) (WHEEL_BITS * (level))
+
+/* the bitmaps hold one bit per slot */
+#if WHEEL_SLOTS != 32
+#error "WHEEL_SLOTS must match the width of the bitmaps"
+#endif
+
+static inline bool tick_before(uint32_t a, uint32_t b)
+{
+	return (int32_t)(a - b) < 0;
+}
+
+void wheel_init(struct wheel *wheel, uint32_t now)
+{
+	unsigned int level, slot;
+
+	wheel->now = now;
+	wheel->pending = 0;
+	for (level = 0; level < WHEEL_LEVELS; level++) {
+		wheel->bitmap[level] = 0;
+		for (slot = 0; slot < WHEEL_SLOTS; slot++)
+			INIT_LIST_HEAD(wheel->slots[level][slot]);
+	}
+}
+
+void wheel_timer_init(struct wheel_timer *timer, void (*func)(void *arg),
+                      void *arg)
+{
+	timer->list.next = NULL;
+	timer->list.prev = NULL;
+	timer->expires = 0;
+	timer->func = func;
+	timer->arg = arg;
+}
+
+static void wheel_insert(struct wheel *wheel, struct wheel_timer *timer)
+{
+	uint32_t delta = timer->expires - wheel->now;
+	uint32_t when = timer->expires;
+	unsigned int level, slot;
+
+	if ((int32_t)delta < 0) {
+		/* already expired: run it on the next tick */
+		delta = 0;
+		when = wheel->now;
+	} else if (delta >= WHEEL_RANGE) {
+		delta = WHEEL_RANGE - 1;
+		when = wheel->now + delta;
+	}
+
+	for (level = 0; level < WHEEL_LEVELS - 1; level++)
+		if (delta < 1U << LEVEL_SHIFT(level + 1))
+			break;
+
+	slot = (when >> LEVEL_SHIFT(level)) & WHEEL_MASK;
+	list_insert_end(&wheel->slots[level][slot], &timer->list);
+	wheel->bitmap[level] |= 1U << slot;
+}
+
+/*
+ * Take a pending timer off its slot. If that empties the slot, the entry which
+ * followed the timer is the slot's head (the only entry of an empty list which
+ * points to itself), and its position in the array tells us which bit to clear.
+ */
+static void wheel_unlink(struct wheel *wheel, struct wheel_timer *timer)
+{
+	struct list_head *next = timer->list.next;
+	unsigned int index;
+
+	list_remove(&timer->list);
+	timer->list.next = NULL;
+	timer->list.prev = NULL;
+	if (next->next == next) {
+		index = next - &wheel->slots[0][0];
+		wheel->bitmap[index / WHEEL_SLOTS] &=
+		        ~(1U << (index % WHEEL_SLOTS));
+	}
+}
+
+void wheel_add(struct wheel *wheel, struct wheel_timer *timer,
+               uint32_t expires)
+{
+	if (wheel_timer_pending(timer))
+		wheel_unlink(wheel, timer);
+	else
+		wheel->pending++;
+	timer->expires = expires;
+	wheel_insert(wheel, timer);
+}
+
+bool wheel_cancel(struct wheel *wheel, struct wheel_timer *timer)
+{
+	if (!wheel_timer_pending(timer))
+		return false;
+	wheel_unlink(wheel, timer);
+	wheel->pending--;
+	return true;
+}
+
+/*
+ * Return how many slots past `start` the first non-empty one is, going around
+ * the level.
+ */
+static unsigned int first_slot_from(uint32_t bitmap, unsigned int start)
+{
+	if (start)
+		bitmap = (bitmap >> start) | (bitmap << (WHEEL_SLOTS - start));
+	return __builtin_ctz(bitmap);
+}
+
+bool wheel_next(struct wheel *wheel, uint32_t *when)
+{
+	uint32_t span, base, tick, best = 0;
+	unsigned int level, start;
+	bool found = false;
+
+	for (level = 0; level < WHEEL_LEVELS; level++) {
+		if (!wheel->bitmap[level])
+			continue;
+		/* a level is processed on ticks which are a multiple of the
+		 * span of its slots: find the first such tick from now */
+		span = 1U << LEVEL_SHIFT(level);
+		base = (wheel->now + span - 1) & ~(span - 1);
+		start = (base >> LEVEL_SHIFT(level)) & WHEEL_MASK;
+		tick = base +
+		       first_slot_from(wheel->bitmap[level], start) * span;
+		if (!found || tick_before(tick, best)) {
+			best = tick;
+			found = true;
+		}
+	}
+	*when = best;
+	return found;
+}
+
+/*
+ * Add every timer of a higher level slot again, which moves it down.
+ */
+static void wheel_cascade(struct wheel *wheel, unsigned int level,
+                          unsigned int slot)
+{
+	struct list_head *head = &wheel->slots[level][slot];
+	struct wheel_timer *timer;
+
+	/* none of them can land back in this slot */
+	wheel->bitmap[level] &= ~(1U << slot);
+	while (head->next != head) {
+		timer = container_of(head->next, struct wheel_timer, list);
+		list_remove(&timer->list);
+		wheel_insert(wheel, timer);
+	}
+}
+
+/*
+ * Process the tick wheel->now: cascade the slots which start on it, then run
+ * the timers which expire.
+ */
+static void wheel_tick(struct wheel *wheel)
+{
+	uint32_t tick = wheel->now;
+	struct list_head *head = &wheel->slots[0][tick & WHEEL_MASK];
+	struct wheel_timer *timer;
+	unsigned int level;
+
+	for (level = 1; level < WHEEL_LEVELS; level++) {
+		if (tick & ((1U << LEVEL_SHIFT(level)) - 1))
+			break;
+		wheel_cascade(wheel, level,
+		              (tick >> LEVEL_SHIFT(level)) & WHEEL_MASK);
+	}
+
+	/*
+	 * Timers added by the functions we call go after the current tick,
+	 * and may land at the end of this very slot. So stop at the first timer
+	 * which isn't due.
+	 */
+	wheel->now = tick + 1;
+	while (head->next != head) {
+		timer = container_of(head->next, struct wheel_timer, list);
+		if (tick_before(tick, timer->expires))
+			break;
+		wheel_unlink(wheel, timer);
+		wheel->pending--;
+		timer->func(timer->arg);
+	}
+}
+
+void wheel_advance(struct wheel *wheel, uint32_t now)
+{
+	uint32_t next;
+
+	while (!tick_before(now, wheel->now)) {
+		if (!wheel_next(wheel, &next) || tick_before(now, next)) {
+			/* nothing to do in between, skip ahead */
+			wheel->now = now + 1;
+			return;
+		}
+		wheel->now = next;
+		wheel_tick(wheel);
+	}
+}
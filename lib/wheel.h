@@ -0,0 +1,83 @@
+/*
+ * wheel.h: hierarchical timer wheel
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "list.h"
+
+/*
+ * Time is counted in ticks of whatever length the user likes, in a uint32_t
+ * which is allowed to wrap around. Each level of the wheel has WHEEL_SLOTS
+ * lists of timers, and each slot of level N covers WHEEL_SLOTS^N ticks. A timer
+ * goes into the lowest level which reaches its expiry, so adding and cancelling
+ * are O(1). As time passes, the slots of a higher level are "cascaded": their
+ * timers are added again, which moves them down a level.
+ *
+ * Timers further out than the top level can reach are kept in its last slot,
+ * and simply cascade once more before they expire.
+ */
+#define WHEEL_BITS   5
+#define WHEEL_SLOTS  (1U << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 5
+#define WHEEL_RANGE  (1U << (WHEEL_BITS * WHEEL_LEVELS))
+
+struct wheel_timer {
+	struct list_head list; /* next is NULL when not pending */
+	uint32_t expires;      /* in ticks */
+	void (*func)(void *arg);
+	void *arg;
+};
+
+struct wheel {
+	uint32_t now; /* next tick to process */
+	uint32_t pending;
+	uint32_t bitmap[WHEEL_LEVELS]; /* non-empty slots of each level */
+	struct list_head slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+/**
+ * Initialize a wheel, with time starting at `now`.
+ */
+void wheel_init(struct wheel *wheel, uint32_t now);
+
+/**
+ * Initialize a timer which calls func(arg) when it expires.
+ */
+void wheel_timer_init(struct wheel_timer *timer, void (*func)(void *arg),
+                      void *arg);
+
+static inline bool wheel_timer_pending(struct wheel_timer *timer)
+{
+	return timer->list.next != NULL;
+}
+
+/**
+ * Arm a timer to expire at tick `expires`, or on the next tick processed if
+ * that has already passed. A pending timer is moved.
+ */
+void wheel_add(struct wheel *wheel, struct wheel_timer *timer,
+               uint32_t expires);
+
+/**
+ * Disarm a timer. Return true if it was pending.
+ */
+bool wheel_cancel(struct wheel *wheel, struct wheel_timer *timer);
+
+/**
+ * Find the next tick on which wheel_advance() has work to do: either a timer
+ * expires, or a slot must be cascaded. Return false if no timers are pending.
+ */
+bool wheel_next(struct wheel *wheel, uint32_t *when);
+
+/**
+ * Process every tick up to and including `now`, calling the functions of the
+ * timers which expire. A function may add or cancel timers, including its own.
+ * Ticks with nothing to do are skipped, so this takes time in proportion to
+ * the work done rather than the ticks passed.
+ */
+void wheel_advance(struct wheel *wheel, uint32_t now);
@@ -2,6 +2,7 @@
  * test_alloc.c: test the page allocator routines
  */
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "alloc_private.h"
 #include "unittest.h"
@@ -10,24 +11,50 @@
 #define ALLOC 0
 #define ZONE(addr_, free_)                                                     \
 	{                                                                      \
-		.addr = (addr_) >> PAGE_BITS, .free = free_                    \
+		.addr = (addr_), .free = free_                                 \
 	}
-uint8_t allocator[PAGE_SIZE];
+
+/*
+ * A zone starts at addr, and continues until the next zone in the list. The
+ * last zone marks the end of the memory we check.
+ */
+struct zone {
+	uint32_t addr;
+	int free;
+};
+
+uint8_t allocator[PAGE_SIZE] __attribute__((aligned(4096)));
 
 void init(struct unittest *test)
 {
 	init_page_allocator(allocator, 0x1000, 0x100000);
 }
 
+/*
+ * Walk the buddy tree to find whether a page is free.
+ */
+static int page_free(uint32_t addr)
+{
+	struct buddyhdr *hdr = (struct buddyhdr *)allocator;
+	struct bnode *node = &hdr->root;
+	uint32_t pfn = addr >> PAGE_BITS;
+
+	while (node->state == BN_SPLIT)
+		node = node->child[pfn >= node->child[1]->pfn];
+	return node->state == BN_FREE;
+}
+
 void expect_zones(struct unittest *test, struct zone zones[])
 {
 	int i;
-	struct zonehdr *hdr = (struct zonehdr *)allocator;
-	for (i = 0; zones[i].addr != 0; i++) {
-		UNITTEST_EXPECT_EQ(test, hdr->zones[i].addr, zones[i].addr);
-		UNITTEST_EXPECT_EQ(test, hdr->zones[i].free, zones[i].free);
+	uint32_t addr;
+	for (i = 0; zones[i + 1].addr != 0; i++) {
+		for (addr = zones[i].addr; addr < zones[i + 1].addr;
+		     addr += PAGE_SIZE) {
+			UNITTEST_EXPECT_EQ(test, page_free(addr),
+			                   zones[i].free);
+		}
 	}
-	UNITTEST_EXPECT_EQ(test, hdr->count, i);
 }
 
 void test_first_fit(struct unittest *test)
@@ -93,7 +120,9 @@ void test_skip_hole(struct unittest *test)
 	uint32_t allocated;
 
 	init(test);
-	alloc_pages(allocator, PAGE_SIZE * 3, 0); /* 0x1000 - 0x4000 */
+	alloc_pages(allocator, PAGE_SIZE, 0);     /* 0x1000 - 0x2000 */
+	alloc_pages(allocator, PAGE_SIZE, 0);     /* 0x2000 - 0x3000 */
+	alloc_pages(allocator, PAGE_SIZE, 0);     /* 0x3000 - 0x4000 */
 	free_pages(allocator, 0x2000, PAGE_SIZE); /* 0x2000 - 0x3000 */
 
 	/* the first gap is not big enough, have to use 0x4000 */
@@ -116,7 +145,9 @@ void test_exact_hole(struct unittest *test)
 	uint32_t allocated;
 
 	init(test);
-	alloc_pages(allocator, PAGE_SIZE * 3, 0); /* 0x1000 - 0x4000 */
+	alloc_pages(allocator, PAGE_SIZE, 0);     /* 0x1000 - 0x2000 */
+	alloc_pages(allocator, PAGE_SIZE, 0);     /* 0x2000 - 0x3000 */
+	alloc_pages(allocator, PAGE_SIZE, 0);     /* 0x3000 - 0x4000 */
 	free_pages(allocator, 0x2000, PAGE_SIZE); /* 0x2000 - 0x3000 */
 
 	/* we should be able to use 0x2000 */
@@ -160,31 +191,31 @@ void test_free_after_free_region(struct unittest *test)
 	bool result;
 
 	init(test);
-	/* should get 0x2000 - 0x6000 */
+	/* four pages come from the first 16KB buddy: 0x4000 - 0x8000 */
 	allocated = alloc_pages(allocator, PAGE_SIZE * 4, PAGE_BITS + 1);
-	UNITTEST_EXPECT_EQ(test, allocated, 0x2000);
+	UNITTEST_EXPECT_EQ(test, allocated, 0x4000);
 
-	result = free_pages(allocator, 0x3000, PAGE_SIZE);
+	result = free_pages(allocator, 0x5000, PAGE_SIZE);
 	UNITTEST_EXPECT_EQ(test, result, true);
 
-	result = free_pages(allocator, 0x5000, PAGE_SIZE);
+	result = free_pages(allocator, 0x7000, PAGE_SIZE);
 	UNITTEST_EXPECT_EQ(test, result, true);
 
 	struct zone zones[] = {
 		ZONE(0x1000, FREE),
-		ZONE(0x2000, ALLOC),
-		ZONE(0x3000, FREE),
 		ZONE(0x4000, ALLOC),
 		ZONE(0x5000, FREE),
+		ZONE(0x6000, ALLOC),
+		ZONE(0x7000, FREE),
 		ZONE(0x100000, ALLOC),
 		{},
 	};
 	expect_zones(test, zones);
 
-	result = free_pages(allocator, 0x4000, PAGE_SIZE);
+	result = free_pages(allocator, 0x6000, PAGE_SIZE);
 	UNITTEST_EXPECT_EQ(test, result, true);
 
-	result = free_pages(allocator, 0x2000, PAGE_SIZE);
+	result = free_pages(allocator, 0x4000, PAGE_SIZE);
 	UNITTEST_EXPECT_EQ(test, result, true);
 
 	struct zone final_zones[] = {
@@ -199,17 +230,22 @@ void test_alloc_whole_thing(struct unittest *test)
 {
 	/*
 	 * Weird scenario, make sure that allocating and freeing the whole
-	 * memory region works.
+	 * memory region works. A buddy allocator can only hand out the whole
+	 * thing if it is a single buddy, so use an aligned 1MB region.
 	 */
 	uint32_t allocated;
 
-	init(test);
-	allocated = alloc_pages(allocator, 0x100000 - 0x1000, 0);
-	UNITTEST_EXPECT_EQ(test, allocated, 0x1000);
+	init_page_allocator(allocator, 0x100000, 0x200000);
+	allocated = alloc_pages(allocator, 0x100000, 0);
+	UNITTEST_EXPECT_EQ(test, allocated, 0x100000);
 
-	free_pages(allocator, allocated, 0x100000 - 0x1000);
+	/* nothing left */
+	UNITTEST_EXPECT_EQ(test, alloc_pages(allocator, 0x1000, 0), 0);
 
-	struct zone zones[] = { ZONE(0x1000, FREE), ZONE(0x100000, ALLOC), {} };
+	free_pages(allocator, allocated, 0x100000);
+
+	struct zone zones[] = { ZONE(0x100000, FREE), ZONE(0x200000, ALLOC),
+		                {} };
 	expect_zones(test, zones);
 }
 
@@ -222,12 +258,13 @@ void test_free_exact_on_right_but_not_left(struct unittest *test)
 	uint32_t allocated;
 
 	init(test);
-	alloc_pages(allocator, 0x2000, 0);     /* gives me 0x1000-0x3000 */
-	free_pages(allocator, 0x2000, 0x1000); /* free 0x2000-0x3000 */
+	alloc_pages(allocator, 0x2000, 0);     /* gives me 0x2000-0x4000 */
+	free_pages(allocator, 0x3000, 0x1000); /* free 0x3000-0x4000 */
 
 	struct zone zones[] = {
-		ZONE(0x1000, ALLOC),
-		ZONE(0x2000, FREE),
+		ZONE(0x1000, FREE),
+		ZONE(0x2000, ALLOC),
+		ZONE(0x3000, FREE),
 		ZONE(0x100000, ALLOC),
 		{},
 	};
@@ -350,6 +387,244 @@ void test_mark_alloc_already_alloced(struct unittest *test)
 	expect_zones(test, zones);
 }
 
+/*
+ * Pages handed to the allocator for its bookkeeping, for the tests which need
+ * more than the first page.
+ */
+#define META_POOL 128
+uint8_t meta_pool[META_POOL][PAGE_SIZE] __attribute__((aligned(4096)));
+int meta_used;
+
+void *meta_getter(void)
+{
+	if (meta_used >= META_POOL)
+		return NULL;
+	return meta_pool[meta_used++];
+}
+
+void test_heavy_fragmentation(struct unittest *test)
+{
+	/*
+	 * Allocate every page of a 16MB region, free every other one, and make
+	 * sure nothing larger than a page can be found. Then free the rest and
+	 * check that everything coalesced back into a single block.
+	 */
+	struct buddyhdr *hdr = (struct buddyhdr *)allocator;
+	uint32_t addr, start = 0x1000000, end = 0x2000000, nunused, single;
+
+	meta_used = 0;
+	init_page_allocator(allocator, start, end);
+	page_allocator_set_getter(allocator, meta_getter);
+	nunused = hdr->nunused;
+
+	for (addr = start; addr < end; addr += PAGE_SIZE)
+		UNITTEST_EXPECT_EQ(test, alloc_pages(allocator, PAGE_SIZE, 0),
+		                   addr);
+	UNITTEST_EXPECT_EQ(test, alloc_pages(allocator, PAGE_SIZE, 0), 0);
+
+	for (addr = start; addr < end; addr += 2 * PAGE_SIZE)
+		UNITTEST_EXPECT_EQ(test,
+		                   free_pages(allocator, addr, PAGE_SIZE), true);
+
+	UNITTEST_EXPECT_EQ(test, alloc_pages(allocator, 2 * PAGE_SIZE, 0), 0);
+	single = alloc_pages(allocator, PAGE_SIZE, 0);
+	UNITTEST_EXPECT_EQ(test, single != 0, true);
+	UNITTEST_EXPECT_EQ(test, (single - start) & PAGE_SIZE, 0);
+
+	for (addr = start; addr < end; addr += 2 * PAGE_SIZE)
+		UNITTEST_EXPECT_EQ(test,
+		                   free_pages(allocator, addr + PAGE_SIZE,
+		                              PAGE_SIZE),
+		                   true);
+	UNITTEST_EXPECT_EQ(test, free_pages(allocator, single, PAGE_SIZE),
+	                   true);
+
+	struct zone zones[] = { ZONE(start, FREE), ZONE(end, ALLOC), {} };
+	expect_zones(test, zones);
+
+	/* all nodes returned to the pool, plus the ones we grew */
+	UNITTEST_EXPECT_EQ(test, hdr->meta_pages, 1 + meta_used);
+	UNITTEST_EXPECT_EQ(test, hdr->nunused,
+	                   nunused + meta_used * (PAGE_SIZE /
+	                                          sizeof(struct bnode)));
+	UNITTEST_EXPECT_EQ(test, alloc_pages(allocator, end - start, 0), start);
+}
+
+void test_random_churn(struct unittest *test)
+{
+	/*
+	 * Randomly allocate and free regions of various sizes and alignments.
+	 * Live allocations may never overlap, and once everything is freed, the
+	 * memory should be back in one piece.
+	 */
+	struct {
+		uint32_t addr;
+		uint32_t size;
+	} live[64] = { 0 };
+	uint32_t addr, size, align;
+	int i, j, round;
+
+	meta_used = 0;
+	init_page_allocator(allocator, 0x100000, 0x900000);
+	page_allocator_set_getter(allocator, meta_getter);
+	srand(1234);
+
+	for (round = 0; round < 4096; round++) {
+		i = rand() % 64;
+		if (live[i].addr) {
+			UNITTEST_EXPECT_EQ(test,
+			                   free_pages(allocator, live[i].addr,
+			                              live[i].size),
+			                   true);
+			live[i].addr = 0;
+			continue;
+		}
+
+		size = (1 + rand() % 16) * PAGE_SIZE;
+		align = PAGE_BITS + rand() % 4;
+		addr = alloc_pages(allocator, size, align);
+		if (!addr)
+			continue;
+		UNITTEST_EXPECT_EQ(test, addr & ((1U << align) - 1), 0);
+		UNITTEST_EXPECT_EQ(test, addr >= 0x100000, true);
+		UNITTEST_EXPECT_EQ(test, addr + size <= 0x900000, true);
+		for (j = 0; j < 64; j++) {
+			if (!live[j].addr)
+				continue;
+			UNITTEST_EXPECT_EQ(test,
+			                   (addr + size <= live[j].addr ||
+			                    live[j].addr + live[j].size <= addr),
+			                   true);
+		}
+		live[i].addr = addr;
+		live[i].size = size;
+	}
+
+	for (i = 0; i < 64; i++)
+		if (live[i].addr)
+			UNITTEST_EXPECT_EQ(test,
+			                   free_pages(allocator, live[i].addr,
+			                              live[i].size),
+			                   true);
+
+	struct zone zones[] = { ZONE(0x100000, FREE), ZONE(0x900000, ALLOC),
+		                {} };
+	expect_zones(test, zones);
+}
+
+void test_no_getter(struct unittest *test)
+{
+	/*
+	 * Without a getter, fragmenting memory eventually fails cleanly rather
+	 * than corrupting anything.
+	 */
+	uint32_t addr, last = 0;
+
+	init_page_allocator(allocator, 0x1000000, 0x2000000);
+	for (addr = 0x1000000; addr < 0x2000000; addr += 2 * PAGE_SIZE) {
+		if (!mark_alloc(allocator, addr, PAGE_SIZE))
+			break;
+		last = addr;
+	}
+	UNITTEST_EXPECT_EQ(test, addr < 0x2000000, true);
+
+	/* everything we did get is still consistent */
+	UNITTEST_EXPECT_EQ(test, page_free(0x1000000), 0);
+	UNITTEST_EXPECT_EQ(test, page_free(0x1001000), 1);
+	UNITTEST_EXPECT_EQ(test, page_free(last), 0);
+	UNITTEST_EXPECT_EQ(test, page_free(addr), 1);
+	UNITTEST_EXPECT_EQ(test, free_pages(allocator, last, PAGE_SIZE), true);
+}
+
+/*
+ * A reclaim callback which frees pages allocated earlier, as a cache would.
+ */
+uint32_t cached[16];
+int ncached, reclaim_calls, reclaim_failing;
+uint32_t reclaim_want;
+
+uint32_t reclaim_cache(uint32_t want, bool failing)
+{
+	uint32_t freed = 0;
+
+	reclaim_calls++;
+	reclaim_failing += failing;
+	reclaim_want = want;
+	while (ncached && freed < want) {
+		free_pages(allocator, cached[--ncached], PAGE_SIZE);
+		freed++;
+	}
+	return freed;
+}
+
+void test_count_free(struct unittest *test)
+{
+	uint32_t addr;
+
+	init_page_allocator(allocator, 0x100000, 0x200000);
+	UNITTEST_EXPECT_EQ(test, page_allocator_count_free(allocator), 256);
+	addr = alloc_pages(allocator, 3 * PAGE_SIZE, 14);
+	UNITTEST_EXPECT_EQ(test, page_allocator_count_free(allocator), 253);
+	mark_alloc(allocator, 0x1f0000, 0x10000);
+	UNITTEST_EXPECT_EQ(test, page_allocator_count_free(allocator), 237);
+	free_pages(allocator, addr, 3 * PAGE_SIZE);
+	free_pages(allocator, 0x1f0000, 0x10000);
+	UNITTEST_EXPECT_EQ(test, page_allocator_count_free(allocator), 256);
+}
+
+void test_reclaim_low_watermark(struct unittest *test)
+{
+	uint32_t addr;
+	int i;
+
+	init_page_allocator(allocator, 0x100000, 0x120000);
+	page_allocator_set_reclaim(allocator, 8, 12, reclaim_cache);
+	reclaim_calls = reclaim_failing = ncached = 0;
+
+	/* 32 pages: 24 allocated leaves exactly 8 free, which is fine */
+	for (i = 0; i < 24; i++) {
+		addr = alloc_pages(allocator, PAGE_SIZE, 0);
+		if (ncached < 16)
+			cached[ncached++] = addr;
+	}
+	UNITTEST_EXPECT_EQ(test, reclaim_calls, 0);
+
+	/* 7 free is below the watermark, and 5 more get us to high */
+	alloc_pages(allocator, PAGE_SIZE, 0);
+	UNITTEST_EXPECT_EQ(test, reclaim_calls, 1);
+	UNITTEST_EXPECT_EQ(test, reclaim_failing, 0);
+	UNITTEST_EXPECT_EQ(test, reclaim_want, 5);
+	UNITTEST_EXPECT_EQ(test, page_allocator_count_free(allocator), 12);
+}
+
+void test_reclaim_on_failure(struct unittest *test)
+{
+	uint32_t addr;
+	int i;
+
+	init_page_allocator(allocator, 0x100000, 0x110000);
+	reclaim_calls = reclaim_failing = ncached = 0;
+	for (i = 0; i < 16; i++) {
+		addr = alloc_pages(allocator, PAGE_SIZE, 0);
+		if (ncached < 2)
+			cached[ncached++] = addr;
+	}
+	page_allocator_set_reclaim(allocator, 0, 0, reclaim_cache);
+
+	/* each failure frees one cached page, and the retry takes it */
+	UNITTEST_EXPECT_EQ(test, alloc_pages(allocator, PAGE_SIZE, 0),
+	                   0x101000);
+	UNITTEST_EXPECT_EQ(test, alloc_pages(allocator, PAGE_SIZE, 0),
+	                   0x100000);
+	UNITTEST_EXPECT_EQ(test, reclaim_calls, 2);
+	UNITTEST_EXPECT_EQ(test, reclaim_failing, 2);
+	UNITTEST_EXPECT_EQ(test, reclaim_want, 1);
+
+	/* nothing left to reclaim */
+	UNITTEST_EXPECT_EQ(test, alloc_pages(allocator, PAGE_SIZE, 0), 0);
+	UNITTEST_EXPECT_EQ(test, reclaim_calls, 3);
+}
+
 struct unittest_case cases[] = {
 	UNITTEST_CASE(test_first_fit),
 	UNITTEST_CASE(test_combine_adjacent),
@@ -365,6 +640,12 @@ struct unittest_case cases[] = {
 	UNITTEST_CASE(test_free_already_freed),
 	UNITTEST_CASE(test_mark_alloc),
 	UNITTEST_CASE(test_mark_alloc_already_alloced),
+	UNITTEST_CASE(test_heavy_fragmentation),
+	UNITTEST_CASE(test_random_churn),
+	UNITTEST_CASE(test_no_getter),
+	UNITTEST_CASE(test_count_free),
+	UNITTEST_CASE(test_reclaim_low_watermark),
+	UNITTEST_CASE(test_reclaim_on_failure),
 	{ 0 },
 };
 
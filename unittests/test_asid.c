@@ -0,0 +1,87 @@
+/*
+ * test_asid.c: test the ASID allocator
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "asid.h"
+#include "unittest.h"
+
+struct asid_allocator alloc;
+
+void init(struct unittest *test)
+{
+	asid_init(&alloc);
+}
+
+void test_alloc(struct unittest *test)
+{
+	uint32_t a = 0, b = 0;
+
+	init(test);
+	UNITTEST_EXPECT_EQ(test, asid_update(&alloc, &a), false);
+	UNITTEST_EXPECT_EQ(test, asid_update(&alloc, &b), false);
+	UNITTEST_EXPECT_EQ(test, asid_hw(a), 1);
+	UNITTEST_EXPECT_EQ(test, asid_hw(b), 2);
+
+	/* still valid, so nothing changes */
+	UNITTEST_EXPECT_EQ(test, asid_update(&alloc, &a), false);
+	UNITTEST_EXPECT_EQ(test, asid_hw(a), 1);
+	UNITTEST_EXPECT_EQ(test, alloc.rollovers, 0);
+}
+
+void test_rollover(struct unittest *test)
+{
+	uint32_t asids[ASID_COUNT] = { 0 };
+	uint32_t i, first;
+
+	init(test);
+	/* every hardware ASID but the reserved one */
+	for (i = 1; i < ASID_COUNT; i++) {
+		UNITTEST_EXPECT_EQ(test, asid_update(&alloc, &asids[i]), false);
+		UNITTEST_EXPECT_EQ(test, asid_hw(asids[i]), i);
+	}
+	first = asids[1];
+
+	/* the next one starts a new generation and requires a flush */
+	UNITTEST_EXPECT_EQ(test, asid_update(&alloc, &asids[0]), true);
+	UNITTEST_EXPECT_EQ(test, asid_hw(asids[0]), 1);
+	UNITTEST_EXPECT_EQ(test, alloc.rollovers, 1);
+
+	/* old ASIDs are reallocated without another flush */
+	UNITTEST_EXPECT_EQ(test, asid_update(&alloc, &asids[1]), false);
+	UNITTEST_EXPECT_EQ(test, asid_hw(asids[1]), 2);
+	UNITTEST_EXPECT_EQ(test, (asids[1] != first), true);
+	UNITTEST_EXPECT_EQ(test, asid_update(&alloc, &asids[0]), false);
+	UNITTEST_EXPECT_EQ(test, asid_hw(asids[0]), 1);
+}
+
+void test_never_reserved(struct unittest *test)
+{
+	uint32_t asid, i;
+
+	init(test);
+	for (i = 0; i < 4 * ASID_COUNT; i++) {
+		asid = 0;
+		asid_update(&alloc, &asid);
+		UNITTEST_EXPECT_EQ(test, (asid_hw(asid) != ASID_RESERVED), true);
+		UNITTEST_EXPECT_EQ(test, (asid != 0), true);
+	}
+	UNITTEST_EXPECT_EQ(test, alloc.rollovers, 4);
+}
+
+struct unittest_case cases[] = {
+	UNITTEST_CASE(test_alloc),
+	UNITTEST_CASE(test_rollover),
+	UNITTEST_CASE(test_never_reserved),
+	{ 0 },
+};
+
+struct unittest_module module = {
+	.name = "asid",
+	.cases = cases,
+	.printf = printf,
+};
+
+UNITTEST(module);
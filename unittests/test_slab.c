@@ -14,11 +14,16 @@ int pages_allocd;
 uint8_t first_page[4096] __attribute__((aligned(4096)));
 uint8_t second_page[4096] __attribute__((aligned(4096)));
 
+/* and blocks for multi-page slabs, aligned to their size */
+uint8_t blocks[2][16384] __attribute__((aligned(16384)));
+int blocks_allocd;
+unsigned int block_released_order;
+
 bool first_page_freed, second_page_freed;
 
 struct slab *slab;
 
-void *page_getter(void)
+void *page_getter(unsigned int order)
 {
 	pages_allocd++;
 	if (pages_allocd == 1) {
@@ -28,9 +33,33 @@ void *page_getter(void)
 	}
 }
 
+void page_release(void *page, unsigned int order)
+{
+	if (page == first_page)
+		first_page_freed = true;
+	else if (page == second_page)
+		second_page_freed = true;
+}
+
+void *block_getter(unsigned int order)
+{
+	if (blocks_allocd == 2 || order != 2)
+		return NULL;
+	return blocks[blocks_allocd++];
+}
+
+void block_release(void *block, unsigned int order)
+{
+	block_released_order = order;
+	if (block == blocks[1])
+		second_page_freed = true;
+}
+
 void init(struct unittest *test)
 {
 	pages_allocd = 0;
+	blocks_allocd = 0;
+	block_released_order = 0;
 	first_page_freed = false;
 	second_page_freed = false;
 }
@@ -39,10 +68,10 @@ void test_allocates(struct unittest *test)
 {
 	void *alloc, *expected;
 	init(test);
-	slab = slab_new("tester", 64, page_getter);
+	slab = slab_new("tester", 64, 0, page_getter, page_release);
 	alloc = slab_alloc(slab);
 
-	expected = (void *)first_page + sizeof(struct slab);
+	expected = (void *)first_page + SLAB_HDR;
 	UNITTEST_EXPECT_EQ(test, alloc, expected);
 
 	alloc = slab_alloc(slab);
@@ -54,7 +83,7 @@ void test_frees(struct unittest *test)
 {
 	void *alloc1, *alloc2, *alloc3;
 	init(test);
-	slab = slab_new("tester", 64, page_getter);
+	slab = slab_new("tester", 64, 0, page_getter, page_release);
 	alloc1 = slab_alloc(slab);
 	alloc2 = slab_alloc(slab);
 	slab_free(slab, alloc2);
@@ -62,9 +91,377 @@ void test_frees(struct unittest *test)
 	UNITTEST_EXPECT_EQ(test, alloc2, alloc3);
 }
 
+void test_slab_of(struct unittest *test)
+{
+	void *objs[4];
+	init(test);
+	slab = slab_new("tester", 1024, 0, page_getter, page_release);
+	UNITTEST_EXPECT_EQ(test, slab_alloc_bulk(slab, objs, 4), 4);
+	UNITTEST_EXPECT_EQ(test, slab_of(objs[0]), slab);
+	UNITTEST_EXPECT_EQ(test, (void *)objs[3] >= (void *)second_page, true);
+	UNITTEST_EXPECT_EQ(test, slab_of(objs[3]), slab);
+}
+
+void test_releases_empty_page(struct unittest *test)
+{
+	void *objs[6];
+	int i;
+	init(test);
+	/* 1024-byte objects: three fit in each page */
+	slab = slab_new("tester", 1024, 0, page_getter, page_release);
+	for (i = 0; i < 6; i++)
+		objs[i] = slab_alloc(slab);
+	UNITTEST_EXPECT_EQ(test, pages_allocd, 2);
+	UNITTEST_EXPECT_EQ(test, (void *)objs[3] >= (void *)second_page, true);
+
+	/* one empty page is kept in reserve by default */
+	for (i = 3; i < 6; i++)
+		slab_free(slab, objs[i]);
+	UNITTEST_EXPECT_EQ(test, second_page_freed, false);
+
+	/* until we ask for no reserve */
+	slab_set_reserve(slab, 0);
+	UNITTEST_EXPECT_EQ(test, second_page_freed, true);
+	UNITTEST_EXPECT_EQ(test, slab->pages, 1);
+	UNITTEST_EXPECT_EQ(test, slab->reclaimed, 1);
+	UNITTEST_EXPECT_EQ(test, slab->total, 3);
+	UNITTEST_EXPECT_EQ(test, slab->free, 0);
+
+	/* the header page is never released */
+	for (i = 0; i < 3; i++)
+		slab_free(slab, objs[i]);
+	UNITTEST_EXPECT_EQ(test, first_page_freed, false);
+	UNITTEST_EXPECT_EQ(test, slab->free, 3);
+}
+
+void test_reserve(struct unittest *test)
+{
+	void *objs[6];
+	int i;
+	init(test);
+	slab = slab_new("tester", 1024, 0, page_getter, page_release);
+	for (i = 0; i < 6; i++)
+		objs[i] = slab_alloc(slab);
+
+	/* once both pages are empty, one exceeds the reserve */
+	for (i = 0; i < 6; i++)
+		slab_free(slab, objs[i]);
+	UNITTEST_EXPECT_EQ(test, second_page_freed, true);
+	UNITTEST_EXPECT_EQ(test, first_page_freed, false);
+	UNITTEST_EXPECT_EQ(test, slab->nempty, 1);
+	UNITTEST_EXPECT_EQ(test, slab->reclaimed, 1);
+}
+
+void test_prefers_partial(struct unittest *test)
+{
+	void *objs[6], *alloc;
+	int i;
+	init(test);
+	slab = slab_new("tester", 1024, 0, page_getter, page_release);
+	slab_set_reserve(slab, 2);
+	for (i = 0; i < 6; i++)
+		objs[i] = slab_alloc(slab);
+
+	/* empty the header page, leave one object in the second */
+	for (i = 0; i < 5; i++)
+		slab_free(slab, objs[i]);
+
+	alloc = slab_alloc(slab);
+	UNITTEST_EXPECT_EQ(test, alloc, objs[4]);
+	UNITTEST_EXPECT_EQ(test, slab->nempty, 1);
+}
+
+int ctor_calls, dtor_calls;
+
+void ctor(void *obj)
+{
+	ctor_calls++;
+	*(int *)(obj + 8) = 42;
+}
+
+void dtor(void *obj)
+{
+	dtor_calls++;
+}
+
+void test_ctor_dtor(struct unittest *test)
+{
+	void *alloc;
+	init(test);
+	ctor_calls = dtor_calls = 0;
+	slab = slab_new_ctor("tester", 64, 0, page_getter, page_release, ctor,
+	                     dtor);
+	UNITTEST_EXPECT_EQ(test, ctor_calls, 0);
+
+	alloc = slab_alloc(slab);
+	UNITTEST_EXPECT_EQ(test, ctor_calls, 1);
+	UNITTEST_EXPECT_EQ(test, *(int *)(alloc + 8), 42);
+
+	*(int *)(alloc + 8) = 0;
+	slab_free(slab, alloc);
+	UNITTEST_EXPECT_EQ(test, dtor_calls, 1);
+
+	/* the constructor runs again on reuse */
+	alloc = slab_alloc(slab);
+	UNITTEST_EXPECT_EQ(test, ctor_calls, 2);
+	UNITTEST_EXPECT_EQ(test, *(int *)(alloc + 8), 42);
+}
+
+void test_alloc_bulk(struct unittest *test)
+{
+	void *objs[5];
+	int i;
+	init(test);
+	ctor_calls = 0;
+	slab = slab_new_ctor("tester", 1024, 0, page_getter, page_release, ctor,
+	                     NULL);
+
+	/* fills the header page, then spills into a new one */
+	UNITTEST_EXPECT_EQ(test, slab_alloc_bulk(slab, objs, 5), 5);
+	UNITTEST_EXPECT_EQ(test, pages_allocd, 2);
+	UNITTEST_EXPECT_EQ(test, ctor_calls, 5);
+	for (i = 0; i < 3; i++)
+		UNITTEST_EXPECT_EQ(test, objs[i],
+		                   (void *)first_page + SLAB_HDR + i * 1024);
+	for (i = 3; i < 5; i++)
+		UNITTEST_EXPECT_EQ(test, objs[i],
+		                   (void *)second_page + SLAB_PAGE_HDR +
+		                           (i - 3) * 1024);
+	UNITTEST_EXPECT_EQ(test, slab->free, 1);
+	UNITTEST_EXPECT_EQ(test, slab->header->inuse, 3);
+	UNITTEST_EXPECT_EQ(test, slab->full.next, &slab->header->list);
+}
+
+void test_free_bulk(struct unittest *test)
+{
+	void *objs[6];
+	init(test);
+	ctor_calls = dtor_calls = 0;
+	slab = slab_new_ctor("tester", 1024, 0, page_getter, page_release, NULL,
+	                     dtor);
+	UNITTEST_EXPECT_EQ(test, slab_alloc_bulk(slab, objs, 6), 6);
+
+	/* leave one object in the header page */
+	slab_free_bulk(slab, objs + 1, 5);
+	UNITTEST_EXPECT_EQ(test, dtor_calls, 5);
+	UNITTEST_EXPECT_EQ(test, slab->free, 5);
+	UNITTEST_EXPECT_EQ(test, slab->nempty, 1);
+	UNITTEST_EXPECT_EQ(test, second_page_freed, false);
+
+	slab_free_bulk(slab, objs, 1);
+	UNITTEST_EXPECT_EQ(test, second_page_freed, true);
+	UNITTEST_EXPECT_EQ(test, slab->reclaimed, 1);
+	UNITTEST_EXPECT_EQ(test, slab->free, 3);
+
+	/* the freed objects come back out, most recently freed first */
+	UNITTEST_EXPECT_EQ(test, slab_alloc_bulk(slab, objs + 3, 3), 3);
+	UNITTEST_EXPECT_EQ(test, objs[3], objs[0]);
+}
+
+void *limited_getter(unsigned int order)
+{
+	if (pages_allocd == 2)
+		return NULL;
+	return page_getter(order);
+}
+
+void test_alloc_bulk_oom(struct unittest *test)
+{
+	void *objs[10];
+	init(test);
+	slab = slab_new("tester", 1024, 0, limited_getter, page_release);
+	UNITTEST_EXPECT_EQ(test, slab_alloc_bulk(slab, objs, 10), 6);
+	UNITTEST_EXPECT_EQ(test, slab->free, 0);
+	UNITTEST_EXPECT_EQ(test, slab_alloc(slab), NULL);
+}
+
+void test_multi_page(struct unittest *test)
+{
+	void *objs[32];
+	unsigned int n, i;
+	init(test);
+	/* 3072-byte objects fit once per page, but five times in 16KB */
+	slab = slab_new("tester", 3072, 2, block_getter, block_release);
+	UNITTEST_EXPECT_EQ(test, slab->order, 2);
+	n = slab->total;
+	UNITTEST_EXPECT_EQ(test, n, (16384 - SLAB_HDR) / 3072);
+
+	UNITTEST_EXPECT_EQ(test, slab_alloc_bulk(slab, objs, n + 5), n + 5);
+	UNITTEST_EXPECT_EQ(test, blocks_allocd, 2);
+	for (i = n; i < n + 5; i++) {
+		UNITTEST_EXPECT_EQ(test, objs[i],
+		                   (void *)blocks[1] + SLAB_PAGE_HDR +
+		                           (i - n) * 3072);
+		/* objects past the first page still find their slab */
+		UNITTEST_EXPECT_EQ(test, slab_of(objs[i]), slab);
+	}
+	UNITTEST_EXPECT_EQ(test, slab_of(objs[n - 1]), slab);
+
+	slab_set_reserve(slab, 0);
+	slab_free_bulk(slab, objs + n, 5);
+	UNITTEST_EXPECT_EQ(test, second_page_freed, true);
+	UNITTEST_EXPECT_EQ(test, block_released_order, 2);
+	UNITTEST_EXPECT_EQ(test, slab->pages, 1);
+	slab_free_bulk(slab, objs, n);
+	UNITTEST_EXPECT_EQ(test, slab->free, n);
+}
+
+unsigned int order_asked;
+
+void *order_getter(unsigned int order)
+{
+	order_asked = order;
+	if (order == 0)
+		return page_getter(order);
+	return NULL;
+}
+
+void test_auto_order(struct unittest *test)
+{
+	init(test);
+	/* a 2048-byte object wastes nearly half of a single page */
+	slab_new("tester", 2048, SLAB_ORDER_AUTO, order_getter, page_release);
+	UNITTEST_EXPECT_EQ(test, order_asked, 3);
+	slab_new("tester", 3072, SLAB_ORDER_AUTO, order_getter, page_release);
+	UNITTEST_EXPECT_EQ(test, order_asked, 2);
+
+	/* but small objects pack well enough into one page */
+	slab = slab_new("tester", 64, SLAB_ORDER_AUTO, order_getter,
+	                page_release);
+	UNITTEST_EXPECT_EQ(test, slab->order, 0);
+
+	/* an order which doesn't fit even one object is refused */
+	UNITTEST_EXPECT_EQ(test,
+	                   slab_new("tester", 4096, 0, page_getter,
+	                            page_release),
+	                   NULL);
+}
+
+unsigned int fake_context;
+int irq_saves, irq_restores;
+
+unsigned int get_context(void)
+{
+	return fake_context;
+}
+
+unsigned long irq_save(void)
+{
+	irq_saves++;
+	return 1;
+}
+
+void irq_restore(unsigned long flags)
+{
+	irq_restores++;
+}
+
+void test_magazines(struct unittest *test)
+{
+	struct slab_sync sync = { get_context, irq_save, irq_restore };
+	struct slab_sync nosync = { 0 };
+	void *objs[SLAB_MAG_SIZE + 1], *obj;
+	unsigned int total, i;
+	init(test);
+	fake_context = SLAB_CTX_THREAD;
+	irq_saves = irq_restores = 0;
+	slab_set_sync(&sync);
+	slab = slab_new("tester", 64, 0, page_getter, page_release);
+	slab_enable_magazines(slab);
+	total = slab->total;
+
+	/* the first allocation refills the magazine with a batch */
+	objs[0] = slab_alloc(slab);
+	UNITTEST_EXPECT_EQ(test, irq_saves, 1);
+	UNITTEST_EXPECT_EQ(test, slab->free, total - SLAB_MAG_BATCH);
+	UNITTEST_EXPECT_EQ(test, slab->mag[SLAB_CTX_THREAD].count,
+	                   SLAB_MAG_BATCH - 1);
+
+	/* the rest of the batch comes without masking interrupts */
+	for (i = 1; i < SLAB_MAG_BATCH; i++)
+		objs[i] = slab_alloc(slab);
+	UNITTEST_EXPECT_EQ(test, irq_saves, 1);
+	for (i = SLAB_MAG_BATCH; i <= SLAB_MAG_SIZE; i++)
+		objs[i] = slab_alloc(slab);
+	UNITTEST_EXPECT_EQ(test, irq_saves, 3);
+
+	/*
+	 * frees fill the magazine (which has BATCH - 1 left over from the last
+	 * refill), and then drain a batch once it's full
+	 */
+	for (i = 0; i <= SLAB_MAG_SIZE; i++)
+		slab_free(slab, objs[i]);
+	UNITTEST_EXPECT_EQ(test, slab->mag[SLAB_CTX_THREAD].count,
+	                   2 * SLAB_MAG_BATCH);
+	UNITTEST_EXPECT_EQ(test, irq_saves, 4);
+
+	/* interrupt handlers get their own magazine */
+	fake_context = SLAB_CTX_IRQ;
+	obj = slab_alloc(slab);
+	UNITTEST_EXPECT_EQ(test, irq_saves, 5);
+	UNITTEST_EXPECT_EQ(test, slab->mag[SLAB_CTX_IRQ].count,
+	                   SLAB_MAG_BATCH - 1);
+	UNITTEST_EXPECT_EQ(test, slab->mag[SLAB_CTX_THREAD].count,
+	                   2 * SLAB_MAG_BATCH);
+
+	/* and the last freed object in a context is the next allocated */
+	slab_free(slab, obj);
+	UNITTEST_EXPECT_EQ(test, slab_alloc(slab), obj);
+	UNITTEST_EXPECT_EQ(test, irq_restores, irq_saves);
+	slab_set_sync(&nosync);
+}
+
+void test_shrink(struct unittest *test)
+{
+	struct slab_sync sync = { get_context, irq_save, irq_restore };
+	struct slab_sync nosync = { 0 };
+	void *objs[6];
+	int i;
+	init(test);
+	slab = slab_new("tester", 1024, 0, page_getter, page_release);
+	for (i = 0; i < 6; i++)
+		objs[i] = slab_alloc(slab);
+	for (i = 3; i < 6; i++)
+		slab_free(slab, objs[i]);
+	UNITTEST_EXPECT_EQ(test, second_page_freed, false);
+
+	/* the reserved page goes, but the reserve stays for next time */
+	UNITTEST_EXPECT_EQ(test, slab_shrink(slab), 1);
+	UNITTEST_EXPECT_EQ(test, second_page_freed, true);
+	UNITTEST_EXPECT_EQ(test, slab->reserve, SLAB_DEFAULT_RESERVE);
+	UNITTEST_EXPECT_EQ(test, slab_shrink(slab), 0);
+
+	/* magazines are emptied back onto the free lists */
+	fake_context = SLAB_CTX_THREAD;
+	slab_set_sync(&sync);
+	slab = slab_new("tester", 64, 0, page_getter, page_release);
+	slab_enable_magazines(slab);
+	slab_free(slab, slab_alloc(slab));
+	fake_context = SLAB_CTX_IRQ;
+	slab_free(slab, slab_alloc(slab));
+	UNITTEST_EXPECT_EQ(test, slab->free, slab->total - 2 * SLAB_MAG_BATCH);
+	UNITTEST_EXPECT_EQ(test, slab_shrink(slab), 0);
+	UNITTEST_EXPECT_EQ(test, slab->free, slab->total);
+	UNITTEST_EXPECT_EQ(test, slab->mag[SLAB_CTX_THREAD].count, 0);
+	UNITTEST_EXPECT_EQ(test, slab->mag[SLAB_CTX_IRQ].count, 0);
+	slab_set_sync(&nosync);
+}
+
 struct unittest_case cases[] = {
 	UNITTEST_CASE(test_allocates),
 	UNITTEST_CASE(test_frees),
+	UNITTEST_CASE(test_slab_of),
+	UNITTEST_CASE(test_releases_empty_page),
+	UNITTEST_CASE(test_reserve),
+	UNITTEST_CASE(test_prefers_partial),
+	UNITTEST_CASE(test_ctor_dtor),
+	UNITTEST_CASE(test_alloc_bulk),
+	UNITTEST_CASE(test_free_bulk),
+	UNITTEST_CASE(test_alloc_bulk_oom),
+	UNITTEST_CASE(test_multi_page),
+	UNITTEST_CASE(test_auto_order),
+	UNITTEST_CASE(test_magazines),
+	UNITTEST_CASE(test_shrink),
 	{ 0 },
 };
 
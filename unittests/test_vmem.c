@@ -0,0 +1,276 @@
+/*
+ * test_vmem.c: test the virtual range allocator
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "unittest.h"
+#include "vmem.h"
+
+#define START 0x40000000
+#define END   0x40100000
+
+struct vmem vm;
+int nodes_allocd;
+
+void *node_alloc(void)
+{
+	nodes_allocd++;
+	return malloc(sizeof(struct vmem_node));
+}
+
+void node_free(void *ptr)
+{
+	nodes_allocd--;
+	free(ptr);
+}
+
+void init(struct unittest *test)
+{
+	nodes_allocd = 0;
+	vmem_init(&vm, START, END, node_alloc, node_free);
+}
+
+void fini(struct unittest *test)
+{
+	vmem_destroy(&vm);
+	UNITTEST_EXPECT_EQ(test, nodes_allocd, 0);
+}
+
+/*
+ * Check the AVL and largest gap invariants, returning the subtree height.
+ */
+int check_tree(struct unittest *test, struct vmem_node *n, int t)
+{
+	int hl, hr;
+	uint32_t maxgap;
+	struct vmem_node *l, *r;
+
+	if (!n)
+		return 0;
+	l = n->link[t].child[0];
+	r = n->link[t].child[1];
+	hl = check_tree(test, l, t);
+	hr = check_tree(test, r, t);
+	UNITTEST_EXPECT_EQ(test, (hl - hr <= 1 && hr - hl <= 1), true);
+	UNITTEST_EXPECT_EQ(test, n->link[t].height, 1 + (hl > hr ? hl : hr));
+	if (t == VMEM_ADDR) {
+		maxgap = n->len;
+		if (l && l->maxgap > maxgap)
+			maxgap = l->maxgap;
+		if (r && r->maxgap > maxgap)
+			maxgap = r->maxgap;
+		UNITTEST_EXPECT_EQ(test, n->maxgap, maxgap);
+		if (l)
+			UNITTEST_EXPECT_EQ(test, l->start + l->len < n->start,
+			                   true);
+		if (r)
+			UNITTEST_EXPECT_EQ(test, n->start + n->len < r->start,
+			                   true);
+	}
+	return 1 + (hl > hr ? hl : hr);
+}
+
+void check(struct unittest *test)
+{
+	check_tree(test, vm.root[VMEM_ADDR], VMEM_ADDR);
+	check_tree(test, vm.root[VMEM_SIZE], VMEM_SIZE);
+}
+
+void test_alloc_free(struct unittest *test)
+{
+	uint32_t a, b;
+
+	init(test);
+	a = vmem_alloc(&vm, PAGE_SIZE, 0);
+	UNITTEST_EXPECT_EQ(test, a, START);
+	b = vmem_alloc(&vm, 100, 0); /* rounds up to a page */
+	UNITTEST_EXPECT_EQ(test, b, START + PAGE_SIZE);
+
+	UNITTEST_EXPECT_EQ(test, vmem_free(&vm, a, PAGE_SIZE), true);
+	UNITTEST_EXPECT_EQ(test, vm.nfree, 2);
+	UNITTEST_EXPECT_EQ(test, vmem_free(&vm, b, PAGE_SIZE), true);
+	UNITTEST_EXPECT_EQ(test, vm.nfree, 1);
+	UNITTEST_EXPECT_EQ(test, vm.root[VMEM_ADDR]->start, START);
+	UNITTEST_EXPECT_EQ(test, vm.root[VMEM_ADDR]->len, END - START);
+	check(test);
+	fini(test);
+}
+
+void test_best_fit(struct unittest *test)
+{
+	uint32_t a;
+
+	init(test);
+	/* holes of 3, 1 and 2 pages, separated by allocations */
+	vmem_mark_alloc(&vm, START + 0x3000, 0x1000);
+	vmem_mark_alloc(&vm, START + 0x5000, 0x1000);
+	vmem_mark_alloc(&vm, START + 0x8000, 0x1000);
+	UNITTEST_EXPECT_EQ(test, vm.nfree, 4);
+
+	a = vmem_alloc(&vm, 0x2000, 0);
+	UNITTEST_EXPECT_EQ(test, a, START + 0x6000);
+	a = vmem_alloc(&vm, 0x1000, 0);
+	UNITTEST_EXPECT_EQ(test, a, START + 0x4000);
+	a = vmem_alloc(&vm, 0x1000, 0);
+	UNITTEST_EXPECT_EQ(test, a, START);
+	a = vmem_alloc(&vm, 0x4000, 0);
+	UNITTEST_EXPECT_EQ(test, a, START + 0x9000);
+	check(test);
+	fini(test);
+}
+
+void test_alignment(struct unittest *test)
+{
+	uint32_t a;
+
+	init(test);
+	vmem_mark_alloc(&vm, START, 0x1000);
+	a = vmem_alloc(&vm, 0x1000, 14);
+	UNITTEST_EXPECT_EQ(test, a, START + 0x4000);
+
+	/* the unaligned piece before it is still free */
+	a = vmem_alloc(&vm, 0x3000, 0);
+	UNITTEST_EXPECT_EQ(test, a, START + 0x1000);
+	check(test);
+	fini(test);
+}
+
+void test_hint(struct unittest *test)
+{
+	uint32_t a;
+
+	init(test);
+	a = vmem_alloc_hint(&vm, START + 0x10000, 0x2000, 0);
+	UNITTEST_EXPECT_EQ(test, a, START + 0x10000);
+	UNITTEST_EXPECT_EQ(test, vm.nfree, 2);
+
+	/* taken, so we get the first fit above it */
+	a = vmem_alloc_hint(&vm, START + 0x11000, 0x1000, 0);
+	UNITTEST_EXPECT_EQ(test, a, START + 0x12000);
+
+	/* nothing above END, fall back to anywhere */
+	a = vmem_alloc_hint(&vm, END, 0x1000, 0);
+	UNITTEST_EXPECT_EQ(test, a, START);
+	check(test);
+	fini(test);
+}
+
+void test_bad_free(struct unittest *test)
+{
+	uint32_t a;
+
+	init(test);
+	a = vmem_alloc(&vm, 0x2000, 0);
+
+	UNITTEST_EXPECT_EQ(test, vmem_free(&vm, a, 0x3000), false);
+	UNITTEST_EXPECT_EQ(test, vmem_free(&vm, a - 0x1000, 0x1000), false);
+	UNITTEST_EXPECT_EQ(test, vmem_free(&vm, END, 0x1000), false);
+	UNITTEST_EXPECT_EQ(test, vmem_free(&vm, a + 1, 0x1000), false);
+	UNITTEST_EXPECT_EQ(test, vmem_free(&vm, a + 0x1000, 0x1000), true);
+	UNITTEST_EXPECT_EQ(test, vmem_free(&vm, a + 0x1000, 0x1000), false);
+	UNITTEST_EXPECT_EQ(test, vmem_free(&vm, a, 0x1000), true);
+	UNITTEST_EXPECT_EQ(test, vm.nfree, 1);
+	fini(test);
+}
+
+void test_mark_alloc(struct unittest *test)
+{
+	init(test);
+	UNITTEST_EXPECT_EQ(test, vmem_mark_alloc(&vm, START + 0x2000, 0x1000),
+	                   true);
+	UNITTEST_EXPECT_EQ(test, vm.nfree, 2);
+	UNITTEST_EXPECT_EQ(test, vmem_mark_alloc(&vm, START + 0x1000, 0x2000),
+	                   false);
+	UNITTEST_EXPECT_EQ(test, vmem_mark_alloc(&vm, END - 0x1000, 0x2000),
+	                   false);
+	UNITTEST_EXPECT_EQ(test, vmem_mark_alloc(&vm, END - 0x1000, 0x1000),
+	                   true);
+	check(test);
+	fini(test);
+}
+
+void test_random_churn(struct unittest *test)
+{
+	/*
+	 * Compare against a page map, and check the tree invariants as we go.
+	 */
+	static uint8_t used[(END - START) / PAGE_SIZE];
+	struct {
+		uint32_t addr;
+		uint32_t size;
+	} live[128] = { 0 };
+	uint32_t addr, size, align, i, j, round, runs;
+
+	init(test);
+	srand(42);
+	for (round = 0; round < 8192; round++) {
+		i = rand() % 128;
+		if (live[i].addr) {
+			UNITTEST_EXPECT_EQ(test,
+			                   vmem_free(&vm, live[i].addr,
+			                             live[i].size),
+			                   true);
+			for (j = 0; j < live[i].size / PAGE_SIZE; j++)
+				used[(live[i].addr - START) / PAGE_SIZE + j] = 0;
+			live[i].addr = 0;
+			continue;
+		}
+
+		size = (1 + rand() % 8) * PAGE_SIZE;
+		align = PAGE_BITS + rand() % 3;
+		if (rand() % 2)
+			addr = vmem_alloc(&vm, size, align);
+		else
+			addr = vmem_alloc_hint(
+			        &vm, START + (rand() % 256) * PAGE_SIZE, size,
+			        align);
+		if (!addr)
+			continue;
+		UNITTEST_EXPECT_EQ(test, addr & ((1U << align) - 1), 0);
+		for (j = 0; j < size / PAGE_SIZE; j++) {
+			UNITTEST_EXPECT_EQ(
+			        test, used[(addr - START) / PAGE_SIZE + j], 0);
+			used[(addr - START) / PAGE_SIZE + j] = 1;
+		}
+		live[i].addr = addr;
+		live[i].size = size;
+
+		if (round % 256 == 0) {
+			check(test);
+			runs = 0;
+			for (j = 0; j < sizeof(used); j++)
+				if (!used[j] && (j == 0 || used[j - 1]))
+					runs++;
+			UNITTEST_EXPECT_EQ(test, vm.nfree, runs);
+		}
+	}
+
+	for (i = 0; i < 128; i++)
+		if (live[i].addr)
+			vmem_free(&vm, live[i].addr, live[i].size);
+	UNITTEST_EXPECT_EQ(test, vm.nfree, 1);
+	check(test);
+	fini(test);
+}
+
+struct unittest_case cases[] = {
+	UNITTEST_CASE(test_alloc_free),
+	UNITTEST_CASE(test_best_fit),
+	UNITTEST_CASE(test_alignment),
+	UNITTEST_CASE(test_hint),
+	UNITTEST_CASE(test_bad_free),
+	UNITTEST_CASE(test_mark_alloc),
+	UNITTEST_CASE(test_random_churn),
+	{ 0 },
+};
+
+struct unittest_module module = {
+	.name = "vmem",
+	.cases = cases,
+	.printf = printf,
+};
+
+UNITTEST(module);
@@ -0,0 +1,244 @@
+/*
+ * test_wheel.c: test the hierarchical timer wheel
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "unittest.h"
+#include "wheel.h"
+
+struct wheel wheel;
+
+/* each timer records the tick it fired on, as wheel.now - 1 */
+struct fired {
+	struct wheel_timer timer;
+	uint32_t at;
+	unsigned int count;
+};
+
+static void record(void *arg)
+{
+	struct fired *f = arg;
+	f->at = wheel.now - 1;
+	f->count++;
+}
+
+static void setup(struct fired *f)
+{
+	wheel_timer_init(&f->timer, record, f);
+	f->at = 0;
+	f->count = 0;
+}
+
+void test_expire_in_order(struct unittest *test)
+{
+	struct fired a, b, c;
+
+	wheel_init(&wheel, 0);
+	setup(&a);
+	setup(&b);
+	setup(&c);
+	wheel_add(&wheel, &a.timer, 5);
+	wheel_add(&wheel, &b.timer, 100);
+	wheel_add(&wheel, &c.timer, 40000);
+	UNITTEST_EXPECT_EQ(test, wheel.pending, 3);
+
+	wheel_advance(&wheel, 4);
+	UNITTEST_EXPECT_EQ(test, a.count, 0);
+	wheel_advance(&wheel, 5);
+	UNITTEST_EXPECT_EQ(test, a.count, 1);
+	UNITTEST_EXPECT_EQ(test, a.at, 5);
+	UNITTEST_EXPECT_EQ(test, wheel_timer_pending(&a.timer), false);
+
+	wheel_advance(&wheel, 99);
+	UNITTEST_EXPECT_EQ(test, b.count, 0);
+	wheel_advance(&wheel, 1000);
+	UNITTEST_EXPECT_EQ(test, b.count, 1);
+	UNITTEST_EXPECT_EQ(test, b.at, 100);
+
+	wheel_advance(&wheel, 39999);
+	UNITTEST_EXPECT_EQ(test, c.count, 0);
+	wheel_advance(&wheel, 50000);
+	UNITTEST_EXPECT_EQ(test, c.count, 1);
+	UNITTEST_EXPECT_EQ(test, c.at, 40000);
+	UNITTEST_EXPECT_EQ(test, wheel.pending, 0);
+}
+
+void test_cancel(struct unittest *test)
+{
+	struct fired a, b;
+	uint32_t when;
+
+	wheel_init(&wheel, 0);
+	setup(&a);
+	setup(&b);
+	wheel_add(&wheel, &a.timer, 10);
+	wheel_add(&wheel, &b.timer, 10);
+	UNITTEST_EXPECT_EQ(test, wheel_cancel(&wheel, &a.timer), true);
+	UNITTEST_EXPECT_EQ(test, wheel_cancel(&wheel, &a.timer), false);
+	UNITTEST_EXPECT_EQ(test, wheel.pending, 1);
+
+	/* the slot still holds b */
+	UNITTEST_EXPECT_EQ(test, wheel_next(&wheel, &when), true);
+	UNITTEST_EXPECT_EQ(test, when, 10);
+	UNITTEST_EXPECT_EQ(test, wheel_cancel(&wheel, &b.timer), true);
+	UNITTEST_EXPECT_EQ(test, wheel_next(&wheel, &when), false);
+
+	wheel_advance(&wheel, 100);
+	UNITTEST_EXPECT_EQ(test, a.count, 0);
+	UNITTEST_EXPECT_EQ(test, b.count, 0);
+}
+
+void test_readd_moves(struct unittest *test)
+{
+	struct fired a;
+
+	wheel_init(&wheel, 0);
+	setup(&a);
+	wheel_add(&wheel, &a.timer, 5000);
+	wheel_add(&wheel, &a.timer, 20);
+	UNITTEST_EXPECT_EQ(test, wheel.pending, 1);
+	wheel_advance(&wheel, 10000);
+	UNITTEST_EXPECT_EQ(test, a.count, 1);
+	UNITTEST_EXPECT_EQ(test, a.at, 20);
+}
+
+void test_next(struct unittest *test)
+{
+	struct fired a, b;
+	uint32_t when;
+
+	wheel_init(&wheel, 7);
+	setup(&a);
+	setup(&b);
+	UNITTEST_EXPECT_EQ(test, wheel_next(&wheel, &when), false);
+
+	wheel_add(&wheel, &a.timer, 9);
+	UNITTEST_EXPECT_EQ(test, wheel_next(&wheel, &when), true);
+	UNITTEST_EXPECT_EQ(test, when, 9);
+
+	/* on level 1, so the next event is when its slot cascades */
+	wheel_add(&wheel, &b.timer, 200);
+	wheel_cancel(&wheel, &a.timer);
+	UNITTEST_EXPECT_EQ(test, wheel_next(&wheel, &when), true);
+	UNITTEST_EXPECT_EQ(test, when, 192);
+	wheel_advance(&wheel, 192);
+	UNITTEST_EXPECT_EQ(test, b.count, 0);
+	UNITTEST_EXPECT_EQ(test, wheel_next(&wheel, &when), true);
+	UNITTEST_EXPECT_EQ(test, when, 200);
+}
+
+void test_past_expiry(struct unittest *test)
+{
+	struct fired a;
+
+	wheel_init(&wheel, 1000);
+	setup(&a);
+	wheel_add(&wheel, &a.timer, 10);
+	wheel_advance(&wheel, 1000);
+	UNITTEST_EXPECT_EQ(test, a.count, 1);
+	UNITTEST_EXPECT_EQ(test, a.at, 1000);
+}
+
+void test_wraparound(struct unittest *test)
+{
+	struct fired a;
+
+	wheel_init(&wheel, 0xFFFFFFF0);
+	setup(&a);
+	wheel_add(&wheel, &a.timer, 0x30);
+	wheel_advance(&wheel, 0x2F);
+	UNITTEST_EXPECT_EQ(test, a.count, 0);
+	wheel_advance(&wheel, 0x40);
+	UNITTEST_EXPECT_EQ(test, a.count, 1);
+	UNITTEST_EXPECT_EQ(test, a.at, 0x30);
+}
+
+void test_beyond_range(struct unittest *test)
+{
+	struct fired a;
+	uint32_t expires = 3 * WHEEL_RANGE / 2;
+
+	wheel_init(&wheel, 0);
+	setup(&a);
+	wheel_add(&wheel, &a.timer, expires);
+	wheel_advance(&wheel, expires - 1);
+	UNITTEST_EXPECT_EQ(test, a.count, 0);
+	wheel_advance(&wheel, expires);
+	UNITTEST_EXPECT_EQ(test, a.count, 1);
+	UNITTEST_EXPECT_EQ(test, a.at, expires);
+}
+
+static struct fired periodic;
+
+static void rearm(void *arg)
+{
+	record(arg);
+	if (periodic.count < 4)
+		wheel_add(&wheel, &periodic.timer, wheel.now - 1 + 32);
+}
+
+void test_rearm_from_callback(struct unittest *test)
+{
+	wheel_init(&wheel, 0);
+	wheel_timer_init(&periodic.timer, rearm, &periodic);
+	periodic.count = 0;
+
+	/* every 32 ticks lands in the slot being processed */
+	wheel_add(&wheel, &periodic.timer, 3);
+	wheel_advance(&wheel, 3);
+	UNITTEST_EXPECT_EQ(test, periodic.count, 1);
+	wheel_advance(&wheel, 34);
+	UNITTEST_EXPECT_EQ(test, periodic.count, 1);
+	wheel_advance(&wheel, 35);
+	UNITTEST_EXPECT_EQ(test, periodic.count, 2);
+	wheel_advance(&wheel, 1000);
+	UNITTEST_EXPECT_EQ(test, periodic.count, 4);
+	UNITTEST_EXPECT_EQ(test, periodic.at, 99);
+	UNITTEST_EXPECT_EQ(test, wheel.pending, 0);
+}
+
+void test_many(struct unittest *test)
+{
+	static struct fired timers[500];
+	unsigned int i, bad = 0;
+	uint32_t expires;
+
+	wheel_init(&wheel, 12345);
+	for (i = 0; i < 500; i++) {
+		setup(&timers[i]);
+		wheel_add(&wheel, &timers[i].timer, 12345 + i * i * 37 + 1);
+	}
+	/* advance in uneven steps */
+	for (i = 12345; i < 12345 + 500 * 500 * 37 + 1000; i += 777)
+		wheel_advance(&wheel, i);
+	for (i = 0; i < 500; i++) {
+		expires = 12345 + i * i * 37 + 1;
+		if (timers[i].count != 1 || timers[i].at != expires)
+			bad++;
+	}
+	UNITTEST_EXPECT_EQ(test, bad, 0);
+	UNITTEST_EXPECT_EQ(test, wheel.pending, 0);
+}
+
+struct unittest_case cases[] = {
+	UNITTEST_CASE(test_expire_in_order),
+	UNITTEST_CASE(test_cancel),
+	UNITTEST_CASE(test_readd_moves),
+	UNITTEST_CASE(test_next),
+	UNITTEST_CASE(test_past_expiry),
+	UNITTEST_CASE(test_wraparound),
+	UNITTEST_CASE(test_beyond_range),
+	UNITTEST_CASE(test_rearm_from_callback),
+	UNITTEST_CASE(test_many),
+	{ 0 },
+};
+
+struct unittest_module module = {
+	.name = "wheel",
+	.cases = cases,
+	.printf = printf,
+};
+
+UNITTEST(module);
@@ -1,9 +1,13 @@
 # Startup conditions for userspace programs:
-# * The stack is not configured, do it yourself
+# * The kernel points SP at a stack which grows on demand
 # * Execution starts at PC=0x40000000, which normally is the _start handler
+# * The word after the first instruction tells the kernel where the writable
+#   part of the image begins (see struct image_header in kernel/process.c)
 .section text
 .global _start
 _start:
-	ldr sp, =stack_end
+	b 1f
+	.word data_start
+1:
 	bl main
 	swi #2
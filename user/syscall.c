@@ -2,6 +2,7 @@
  * syscall.c: code related to system calls
  */
 #include "syscall.h"
+#include "errno.h"
 #include "sys/socket.h"
 
 void puts(char *string)
@@ -104,3 +105,54 @@ int recv(int sockfd, void *buffer, size_t length, int flags)
 	                     : /* clobbers */ "a1", "a2", "a3", "a4");
 	return retval;
 }
+
+int setprio(int pid, int prio)
+{
+	int retval;
+	__asm__ __volatile__("svc #11\n"
+	                     "mov %[rv], a1"
+	                     : /* output operands */[ rv ] "=r"(retval)
+	                     : /* input operands */
+	                     : /* clobbers */ "a1", "a2", "a3", "a4");
+	return retval;
+}
+
+/*
+ * We have no signals, so a sleep is never cut short and rem is left alone.
+ */
+int nanosleep(const struct timespec *req, struct timespec *rem)
+{
+	int retval;
+	__asm__ __volatile__("svc #12\n"
+	                     "mov %[rv], a1"
+	                     : /* output operands */[ rv ] "=r"(retval)
+	                     : /* input operands */
+	                     : /* clobbers */ "a1", "a2", "a3", "a4");
+	return retval;
+}
+
+/* not inlined, so that the arguments are in a1-a4 */
+static int __attribute__((noinline))
+sys_setsockopt(int sockfd, int option_name, const void *option_value,
+               socklen_t option_len)
+{
+	int retval;
+	__asm__ __volatile__("svc #13\n"
+	                     "mov %[rv], a1"
+	                     : /* output operands */[ rv ] "=r"(retval)
+	                     : /* input operands */
+	                     : /* clobbers */ "a1", "a2", "a3", "a4");
+	return retval;
+}
+
+/*
+ * System calls take at most four arguments, and the kernel only has socket
+ * level options, so the level is checked here.
+ */
+int setsockopt(int sockfd, int level, int option_name, const void *option_value,
+               socklen_t option_len)
+{
+	if (level != SOL_SOCKET)
+		return -ENOPROTOOPT;
+	return sys_setsockopt(sockfd, option_name, option_value, option_len);
+}
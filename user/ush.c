@@ -141,11 +141,50 @@ static int cmd_recv(int argc, char **argv)
 	sockfd = atoi(argv[1]);
 	rv = recv(sockfd, data, sizeof(data), 0);
 	printf("recv() = %d\n", rv);
+	if (rv < 0)
+		return rv;
 	data[rv] = '\0'; /* just in case */
 	printf(" -> \"%s\"\n", data);
 	return rv;
 }
 
+static int cmd_timeout(int argc, char **argv)
+{
+	int rv, sockfd, ms;
+	struct timeval tv;
+
+	if (argc != 3) {
+		puts("usage: timeout FD MILLISECONDS (0 waits forever)\n");
+		return -1;
+	}
+
+	sockfd = atoi(argv[1]);
+	ms = atoi(argv[2]);
+	tv.tv_sec = ms / 1000;
+	tv.tv_usec = (ms % 1000) * 1000;
+	rv = setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	printf("setsockopt() = %d\n", rv);
+	return rv;
+}
+
+static int cmd_sleep(int argc, char **argv)
+{
+	int rv, ms;
+	struct timespec ts;
+
+	if (argc != 2) {
+		puts("usage: sleep MILLISECONDS\n");
+		return -1;
+	}
+
+	ms = atoi(argv[1]);
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000;
+	if ((rv = nanosleep(&ts, NULL)) != 0)
+		printf("failed: rv=%d\n", rv);
+	return rv;
+}
+
 static int cmd_demo(int argc, char **argv)
 {
 	int i, count = 10;
@@ -157,6 +196,19 @@ static int cmd_demo(int argc, char **argv)
 	return 0;
 }
 
+static int cmd_prio(int argc, char **argv)
+{
+	int rv;
+	if (argc != 3) {
+		puts("usage: prio PID LEVEL (PID 0 is this shell)\n");
+		return -1;
+	}
+
+	if ((rv = setprio(atoi(argv[1]), atoi(argv[2]))) != 0)
+		printf("failed: rv=%d\n", rv);
+	return rv;
+}
+
 static int help(int argc, char **argv);
 struct cmd cmds[] = {
 	{ .name = "echo",
@@ -168,11 +220,16 @@ struct cmd cmds[] = {
 	  .func = cmd_runp,
 	  .help = "run a process without waiting for it to finish" },
 	{ .name = "demo", .func = cmd_demo, .help = "run many processes" },
+	{ .name = "prio", .func = cmd_prio, .help = "set a process priority" },
+	{ .name = "sleep", .func = cmd_sleep, .help = "sleep for a while" },
 	{ .name = "socket", .func = cmd_socket, .help = "create socket" },
 	{ .name = "bind", .func = cmd_bind, .help = "bind socket" },
 	{ .name = "connect", .func = cmd_connect, .help = "connect socket" },
 	{ .name = "send", .func = cmd_send, .help = "send data on socket" },
 	{ .name = "recv", .func = cmd_recv, .help = "recv data from socket" },
+	{ .name = "timeout",
+	  .func = cmd_timeout,
+	  .help = "set socket receive timeout" },
 	{ .name = "exit", .func = cmd_exit, .help = "exit this process" },
 };
 /*